@@ -0,0 +1,252 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Time aligned aggregation of several meters.  see aggregate.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include "aggregate.h"
+
+/*
+ * returns 0 on success, errno on failure
+ */
+ int
+agg_init(struct aggregate *a, int nsrc, int64_t step_ns, int64_t gap_ns,
+	agg_emit_fn emit, void *arg)
+{
+	int i;
+
+	if ((nsrc <= 0) || (step_ns <= 0) || (gap_ns <= 0)) {
+		return EINVAL;
+	}
+	memset(a, 0, sizeof(*a));
+	a->src = calloc(nsrc, sizeof(*a->src));
+	a->watts = calloc(nsrc, sizeof(*a->watts));
+	if ((a->src == NULL) || (a->watts == NULL)) {
+		agg_free(a);
+		return ENOMEM;
+	}
+	for (i = 0; i < nsrc; i++) {
+		a->src[i].gap_ns = gap_ns;
+	}
+	a->nsrc = nsrc;
+	a->step_ns = step_ns;
+	a->gap_ns = gap_ns;
+	a->emit = emit;
+	a->arg = arg;
+
+	return 0;
+}
+
+ void
+agg_free(struct aggregate *a)
+{
+	int i;
+
+	if (a->src) {
+		for (i = 0; i < a->nsrc; i++) {
+			free(a->src[i].p);
+		}
+	}
+	free(a->src);
+	free(a->watts);
+	a->src = NULL;
+	a->watts = NULL;
+}
+
+/*
+ * a meter's watts at grid time t, from the two readings around it
+ */
+ static float
+value_at(struct agg_src *s, int64_t t)
+{
+	struct agg_point *p0, *p1;
+	int i;
+
+	for (i = 0; (i + 1 < s->n) && (s->p[i + 1].ns <= t); i++)
+		;
+	if ((s->n == 0) || (s->p[i].ns > t)) {
+		return NAN;
+	}
+	p0 = &s->p[i];
+	if (p0->ns == t) {
+		return p0->watts;
+	}
+	if (i + 1 >= s->n) {
+		return NAN;
+	}
+	p1 = &s->p[i + 1];
+	if (p1->ns - p0->ns > s->gap_ns) {
+		return NAN;
+	}
+	return p0->watts + ((p1->watts - p0->watts) *
+		((double)(t - p0->ns) / (p1->ns - p0->ns)));
+}
+
+/*
+ * a meter is caught up to grid time t when it's got a reading at or past
+ * it, or it's not going to get any more
+ */
+ static int
+caught_up(struct agg_src *s, int64_t t)
+{
+	return s->done || (s->n && (s->p[s->n - 1].ns >= t));
+}
+
+/*
+ * let go of the readings no grid time from t on can need: all but the
+ * last one at or before t
+ */
+ static void
+trim(struct agg_src *s, int64_t t)
+{
+	int i;
+
+	for (i = 0; (i + 1 < s->n) && (s->p[i + 1].ns <= t); i++)
+		;
+	if (i) {
+		memmove(&s->p[0], &s->p[i], (s->n - i) * sizeof(s->p[0]));
+		s->n -= i;
+	}
+}
+
+/*
+ * emit every grid time that all the meters are caught up to.  rows
+ * where no meter has a value, the gaps that are in all of them, are
+ * skipped over.
+ */
+ static void
+drain(struct aggregate *a)
+{
+	struct agg_src *s;
+	double total;
+	int64_t next;
+	int present;
+	int live;
+	int i, j;
+
+	if (!a->started) {
+		return;
+	}
+	for (;;) {
+		live = 0;
+		for (i = 0; i < a->nsrc; i++) {
+			if (!caught_up(&a->src[i], a->t)) {
+				return;
+			}
+			s = &a->src[i];
+			if (!s->done || (s->n && (s->p[s->n - 1].ns >= a->t))) {
+				live = 1;
+			}
+		}
+		if (!live) {
+			/* all the meters have ended */
+			return;
+		}
+
+		total = 0;
+		present = 0;
+		for (i = 0; i < a->nsrc; i++) {
+			a->watts[i] = value_at(&a->src[i], a->t);
+			if (!isnan(a->watts[i])) {
+				total += a->watts[i];
+				present++;
+			}
+		}
+		if (present) {
+			a->emit(a->arg, a->t, total, present, a->watts);
+			a->emitted = 1;
+		}
+
+		a->t += a->step_ns;
+		next = INT64_MAX;
+		for (i = 0; i < a->nsrc; i++) {
+			s = &a->src[i];
+			trim(s, a->t);
+			j = (s->n && (s->p[0].ns < a->t)) ? 1 : 0;
+			if ((j < s->n) && (s->p[j].ns < next)) {
+				next = s->p[j].ns;
+			}
+		}
+		if (!present && (next != INT64_MAX) && (next > a->t)) {
+			/* nothing anywhere until next, so don't step through it */
+			a->t = next + a->step_ns - 1;
+			a->t -= a->t % a->step_ns;
+		}
+	}
+}
+
+/*
+ * a reading from meter src.  each meter's readings have to come in time
+ * order; ones that don't are ignored.  returns 0 on success, errno on
+ * failure.
+ */
+ int
+agg_push(struct aggregate *a, int src, int64_t ns, float watts)
+{
+	struct agg_src *s = &a->src[src];
+	struct agg_point *p;
+
+	if (s->done || (s->n && (ns <= s->p[s->n - 1].ns))) {
+		return 0;
+	}
+	if (s->n == s->size) {
+		p = realloc(s->p, (s->size ? s->size * 2 : 16) * sizeof(*p));
+		if (p == NULL) {
+			return ENOMEM;
+		}
+		s->p = p;
+		s->size = s->size ? s->size * 2 : 16;
+	}
+	s->p[s->n].ns = ns;
+	s->p[s->n].watts = watts;
+	s->n++;
+
+	/*
+	 * the grid starts at the first step boundary after the earliest
+	 * reading, which can move back as other meters get their first ones
+	 * in, until a row has gone out
+	 */
+	if (!a->started || (!a->emitted && (ns < a->t))) {
+		a->t = ns + a->step_ns - 1;
+		a->t -= a->t % a->step_ns;
+		a->started = 1;
+	}
+	drain(a);
+
+	return 0;
+}
+
+/*
+ * a gap limit just for meter src
+ */
+ void
+agg_set_gap(struct aggregate *a, int src, int64_t gap_ns)
+{
+	a->src[src].gap_ns = gap_ns;
+}
+
+/*
+ * meter src has no more readings
+ */
+ void
+agg_end(struct aggregate *a, int src)
+{
+	a->src[src].done = 1;
+	drain(a);
+}
+
+/*
+ * whether the next row is waiting on meter src.  for feeding in
+ * readings from files: read from the ones that are needed until none
+ * are, and the rows come out as it goes.
+ */
+ int
+agg_needs(struct aggregate *a, int src)
+{
+	return !a->src[src].done && (!a->started || !caught_up(&a->src[src], a->t));
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Aggregating the watts of several meters onto one time grid.
+ *
+ * Every meter is read on its own schedule, so to add them up, each one's
+ * watts are interpolated to the same instants: multiples of a step since
+ * the epoch.  Readings are pushed in one meter at a time, in time order
+ * for each meter but in any order across meters, and a row is emitted
+ * for a grid time as soon as every meter has a reading at or after it
+ * (or has ended).  So it works the same on storefiles, read a little of
+ * each at a time, as on readings coming in live, and only keeps the few
+ * readings per meter that the next grid times still need.
+ *
+ * Between two readings further apart than the gap limit nothing is made
+ * up: the meter has no value for grid times in there, nor before its
+ * first reading or after its last, and the sum is of the meters that do.
+ * A meter whose readings are only stored when they change, like a
+ * deadband storefile, gets a longer gap limit of its own.
+ */
+#ifndef _AGGREGATE_H
+#define _AGGREGATE_H
+
+#include <stdint.h>
+
+struct agg_point {
+	int64_t ns;
+	float watts;
+};
+
+/*
+ * the readings of one meter that haven't been used up yet
+ */
+struct agg_src {
+	struct agg_point *p;
+	int n;
+	int size;
+	int done;
+	int64_t gap_ns;
+};
+
+/*
+ * called with each row: the grid time, the sum of the watts of the meters
+ * that have a value then, how many meters that is, and each meter's watts,
+ * NAN for the ones that don't have a value
+ */
+typedef void (*agg_emit_fn)(void *arg, int64_t ns, double total, int npresent,
+	const float *watts);
+
+struct aggregate {
+	int nsrc;
+	struct agg_src *src;
+	float *watts;
+	int64_t step_ns;
+	int64_t gap_ns;
+	int64_t t;			/* the next grid time to emit */
+	int started;
+	int emitted;			/* any rows yet */
+	agg_emit_fn emit;
+	void *arg;
+};
+
+extern int agg_init(struct aggregate *a, int nsrc, int64_t step_ns,
+	int64_t gap_ns, agg_emit_fn emit, void *arg);
+extern int agg_push(struct aggregate *a, int src, int64_t ns, float watts);
+extern void agg_set_gap(struct aggregate *a, int src, int64_t gap_ns);
+extern void agg_end(struct aggregate *a, int src);
+extern int agg_needs(struct aggregate *a, int src);
+extern void agg_free(struct aggregate *a);
+
+#endif
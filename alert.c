@@ -0,0 +1,391 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Alert rules, and the helper process that runs their hooks.  see
+ * alert.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "alert.h"
+
+enum {
+	AL_WATTS,
+	AL_PF,
+	AL_VOLTS,
+	AL_AMPS,
+	AL_RATE,
+};
+
+static const char *fields[] = {"watts", "pf", "volts", "amps", "rate", NULL};
+
+struct alert_rule {
+	char text[64];		/* as given, for messages */
+	int field;
+	int above;			/* > rather than < */
+	float limit;
+	int n;				/* readings in a row */
+	char *cmd;			/* or NULL */
+	int run;			/* readings in a row it's held so far */
+};
+
+/*
+ * what the sampling thread sends the helper: PIPE_BUF or less, so it
+ * goes in one piece or not at all
+ */
+struct alert_msg {
+	int rule;
+	float value;
+	float watts;
+	int64_t fired_ns;	/* CLOCK_MONOTONIC when it went off */
+	int64_t tstamp_ns;	/* the reading's, CLOCK_REALTIME */
+};
+
+/*
+ * counters the helper and its children keep, in memory shared with the
+ * main process
+ */
+struct alert_shared {
+	unsigned long hooks;	/* commands exec'd */
+	unsigned long failed;	/* forks that failed */
+	int64_t lat_sum_ns;		/* going off to exec */
+	int64_t lat_max_ns;
+};
+
+static struct alert_rule rules[ALERT_MAX];
+static int nrules;
+
+static struct alert_shared *shared;
+static int msg_fd = -1;
+static pid_t helper_pid = -1;
+static unsigned long fired;		/* the metrics read these as they go */
+static unsigned long lost;		/* pipe full */
+
+static int64_t last_ns = -1;
+static float last_watts;
+
+extern struct timespec startclk;
+extern struct timespec startmono;
+
+ static int64_t
+mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/*
+ * add a rule, "<field><op><limit>[/<n>][:<command>]".  returns 0 on
+ * success, errno on failure.
+ */
+ int
+alert_add(const char *spec)
+{
+	struct alert_rule *ar;
+	const char *colon;
+	char *end;
+	size_t len;
+	int i;
+
+	if (nrules >= ALERT_MAX) {
+		return ENOSPC;
+	}
+	ar = &rules[nrules];
+	memset(ar, 0, sizeof(*ar));
+
+	colon = strchr(spec, ':');
+	len = colon ? (size_t)(colon - spec) : strlen(spec);
+	if (len >= sizeof(ar->text)) {
+		return EINVAL;
+	}
+	memcpy(ar->text, spec, len);
+
+	for (i = 0; fields[i]; i++) {
+		if (!strncmp(ar->text, fields[i], strlen(fields[i]))) {
+			break;
+		}
+	}
+	if (fields[i] == NULL) {
+		return EINVAL;
+	}
+	ar->field = i;
+	end = &ar->text[strlen(fields[i])];
+	if ((*end != '>') && (*end != '<')) {
+		return EINVAL;
+	}
+	ar->above = (*end == '>');
+	ar->limit = strtof(end + 1, &end);
+	ar->n = 1;
+	if (*end == '/') {
+		ar->n = (int)strtol(end + 1, &end, 10);
+	}
+	if ((*end != '\0') || (ar->n < 1)) {
+		return EINVAL;
+	}
+	if (colon && colon[1]) {
+		ar->cmd = strdup(colon + 1);
+	}
+	nrules++;
+
+	return 0;
+}
+
+/*
+ * in the child, between fork and exec
+ */
+ static void
+run_hook(const struct alert_rule *ar, const struct alert_msg *m)
+{
+	char buf[64];
+	sigset_t none;
+	int64_t lat;
+
+	snprintf(buf, sizeof(buf), "%g", m->value);
+	setenv("EXTECH_VALUE", buf, 1);
+	snprintf(buf, sizeof(buf), "%g", m->watts);
+	setenv("EXTECH_WATTS", buf, 1);
+	snprintf(buf, sizeof(buf), "%ld.%.3ld", m->tstamp_ns / 1000000000,
+		(m->tstamp_ns % 1000000000) / 1000000);
+	setenv("EXTECH_TIME", buf, 1);
+	setenv("EXTECH_ALERT", ar->text, 1);
+
+	/* the helper's signal settings aren't for the command */
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGUSR1, SIG_DFL);
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+
+	lat = mono_ns() - m->fired_ns;
+	__atomic_fetch_add(&shared->hooks, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&shared->lat_sum_ns, lat, __ATOMIC_RELAXED);
+	if (lat > __atomic_load_n(&shared->lat_max_ns, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&shared->lat_max_ns, lat, __ATOMIC_RELAXED);
+	}
+	execl("/bin/sh", "sh", "-c", ar->cmd, (char *)NULL);
+	_exit(127);
+}
+
+/*
+ * the helper: a message at a time, say so and run the rule's command.
+ * the children are reaped by the kernel, SIGCHLD being ignored.
+ */
+ static void
+helper(int fd)
+{
+	struct alert_msg m;
+	struct alert_rule *ar;
+	pid_t pid;
+
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGINT, SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);
+	while (read(fd, &m, sizeof(m)) == sizeof(m)) {
+		if ((m.rule < 0) || (m.rule >= nrules)) {
+			continue;
+		}
+		ar = &rules[m.rule];
+		if (ar->cmd) {
+			pid = fork();
+			if (pid == 0) {
+				close(fd);
+				run_hook(ar, &m);
+			}
+			if (pid < 0) {
+				__atomic_fetch_add(&shared->failed, 1, __ATOMIC_RELAXED);
+			}
+		}
+		fprintf(stderr, "alert: %s at %ld.%.3ld, %g\n", ar->text,
+			m.tstamp_ns / 1000000000, (m.tstamp_ns % 1000000000) / 1000000,
+			m.value);
+	}
+	_exit(0);
+}
+
+/*
+ * fork the helper.  has to be called before any threads are started,
+ * and before anything is open that the hooks shouldn't get.  returns 0
+ * on success, errno on failure.
+ */
+ int
+alert_start(void)
+{
+	int fds[2];
+	int ret;
+
+	if (nrules == 0) {
+		return 0;
+	}
+	shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		shared = NULL;
+		return errno;
+	}
+	if (pipe(fds)) {
+		return errno;
+	}
+
+	fflush(NULL);
+	helper_pid = fork();
+	if (helper_pid < 0) {
+		ret = errno;
+		close(fds[0]);
+		close(fds[1]);
+		return ret;
+	}
+	if (helper_pid == 0) {
+		close(fds[1]);
+		helper(fds[0]);
+	}
+	close(fds[0]);
+	msg_fd = fds[1];
+	fcntl(msg_fd, F_SETFL, O_NONBLOCK);
+	fcntl(msg_fd, F_SETFD, FD_CLOEXEC);
+
+	return 0;
+}
+
+ static float
+field_value(const struct alert_rule *ar, const struct reading *r,
+	float rate)
+{
+	switch (ar->field) {
+		case AL_WATTS:
+			return r->watts;
+		case AL_PF:
+			return r->pf;
+		case AL_VOLTS:
+			return r->volts;
+		case AL_AMPS:
+			return r->amps;
+		default:
+			return rate;
+	}
+}
+
+/*
+ * called on the sampling thread with each reading, tstamp monotonic.
+ * never blocks: with the helper that far behind, the alert is lost,
+ * and counted.
+ */
+ void
+alert_check(const struct reading *r)
+{
+	struct alert_rule *ar;
+	struct alert_msg m;
+	int64_t ns;
+	float rate = 0;
+	float v;
+	int have_rate;
+	int i;
+
+	if (msg_fd < 0) {
+		return;
+	}
+	ns = ((int64_t)r->tstamp.tv_sec * 1000000000) + r->tstamp.tv_nsec;
+	have_rate = (last_ns >= 0) && (ns > last_ns);
+	if (have_rate) {
+		rate = (r->watts - last_watts) / ((ns - last_ns) / 1e9);
+	}
+	last_ns = ns;
+	last_watts = r->watts;
+
+	for (i = 0; i < nrules; i++) {
+		ar = &rules[i];
+		v = field_value(ar, r, rate);
+		if (((ar->field == AL_RATE) && !have_rate) ||
+			(ar->above ? !(v > ar->limit) : !(v < ar->limit))) {
+			ar->run = 0;
+			continue;
+		}
+		if (++ar->run != ar->n) {
+			continue;
+		}
+
+		__atomic_fetch_add(&fired, 1, __ATOMIC_RELAXED);
+		m.rule = i;
+		m.value = v;
+		m.watts = r->watts;
+		m.tstamp_ns = ((int64_t)startclk.tv_sec * 1000000000) +
+			startclk.tv_nsec + (ns - (((int64_t)startmono.tv_sec * 1000000000) +
+			startmono.tv_nsec));
+		m.fired_ns = mono_ns();
+		if (write(msg_fd, &m, sizeof(m)) != sizeof(m)) {
+			__atomic_fetch_add(&lost, 1, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/*
+ * let the helper finish what it's been sent, and wait for it.  the
+ * sampling thread has to be done by now.
+ */
+ void
+alert_stop(void)
+{
+	if (msg_fd < 0) {
+		return;
+	}
+	close(msg_fd);
+	msg_fd = -1;
+	waitpid(helper_pid, NULL, 0);
+}
+
+/*
+ * how the alerts went: how many went off, how many hooks ran, and how
+ * long from going off to the hook being exec'd
+ */
+ void
+alert_report(void)
+{
+	unsigned long hooks;
+
+	if (shared == NULL) {
+		return;
+	}
+	printf("alerts: %lu went off", fired);
+	if (lost) {
+		printf(", %lu lost", lost);
+	}
+	hooks = __atomic_load_n(&shared->hooks, __ATOMIC_RELAXED);
+	if (hooks) {
+		printf(", %lu hooks run, %.3fms mean %.3fms worst to exec", hooks,
+			shared->lat_sum_ns / 1e6 / hooks, shared->lat_max_ns / 1e6);
+	}
+	if (shared->failed) {
+		printf(", %lu forks failed", shared->failed);
+	}
+	printf("\n");
+}
+
+/*
+ * a snapshot of how the alerts are going, for the metrics.  returns 0,
+ * or ENOENT if there aren't any alerts.
+ */
+ int
+alert_get_stats(struct alert_stats *st)
+{
+	if (shared == NULL) {
+		return ENOENT;
+	}
+	st->fired = __atomic_load_n(&fired, __ATOMIC_RELAXED);
+	st->lost = __atomic_load_n(&lost, __ATOMIC_RELAXED);
+	st->hooks = __atomic_load_n(&shared->hooks, __ATOMIC_RELAXED);
+	st->failed = __atomic_load_n(&shared->failed, __ATOMIC_RELAXED);
+	st->lat_sum_ns = __atomic_load_n(&shared->lat_sum_ns, __ATOMIC_RELAXED);
+	st->lat_max_ns = __atomic_load_n(&shared->lat_max_ns, __ATOMIC_RELAXED);
+
+	return 0;
+}
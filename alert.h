@@ -0,0 +1,50 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Alerts: rules checked against every reading as the sampling thread
+ * takes it, like "watts>1500/3" (watts above 1500 for 3 readings in a
+ * row) or "rate>200" (watts climbing faster than 200 a second), each
+ * with a command to run when it goes off.  extech_rdr
+ * --alert=<rule>[:<command>] adds one.
+ *
+ * A rule is <field><op><limit>[/<n>]: field is watts, pf, volts, amps
+ * or rate (the change in watts per second since the last reading), op
+ * is > or <, and n is how many readings in a row it has to hold for,
+ * default 1.  It goes off once when it's held for n readings, and not
+ * again until it's stopped holding.  Checking a rule is a compare and a
+ * count, whatever n is.
+ *
+ * The sampling thread never forks, or waits on anything: when a rule
+ * goes off it writes a message down a non-blocking pipe to a helper
+ * process, forked before any threads were, which says so on stderr and
+ * forks and execs the command with /bin/sh.  The command gets
+ * EXTECH_ALERT, EXTECH_VALUE, EXTECH_WATTS and EXTECH_TIME in its
+ * environment.  The time from the rule going off to the command being
+ * exec'd is kept for alert_report(), and for the metrics as it goes
+ * with alert_get_stats().
+ */
+#ifndef _ALERT_H
+#define _ALERT_H
+
+#include "extech.h"
+
+#define ALERT_MAX 16	/* rules */
+
+struct alert_stats {
+	unsigned long fired;	/* rules that went off */
+	unsigned long lost;		/* ...and never got to the helper */
+	unsigned long hooks;	/* commands exec'd */
+	unsigned long failed;	/* forks that failed */
+	int64_t lat_sum_ns;		/* going off to exec */
+	int64_t lat_max_ns;
+};
+
+extern int alert_add(const char *spec);
+extern int alert_start(void);
+extern void alert_check(const struct reading *r);
+extern void alert_stop(void);
+extern void alert_report(void);
+extern int alert_get_stats(struct alert_stats *st);
+
+#endif
@@ -0,0 +1,235 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Raw protocol capture.  see capture.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include "capture.h"
+#include "storefile.h"
+#include "overhead.h"
+
+#define CAP_SLOTS 512			/* reads the ring holds, ~200s at 400ms */
+#define CAP_FLUSH_NS 250000000	/* how often the writer empties the ring */
+#define CAP_LAZY_NS 2000000000L	/* or in low overhead mode */
+#define CAP_BUFSIZE 65536
+
+struct cap_slot {
+	struct cap_rec rec;
+	unsigned char data[CAP_MAXLEN];
+};
+
+/*
+ * single producer, single consumer: only the sampling thread moves head,
+ * only the writer thread moves tail, and they both just keep counting
+ */
+static struct cap_slot *ring;
+static unsigned int head;
+static unsigned int tail;
+static uint32_t dropped;	/* sampling thread's, since the last record */
+
+static int cap_fd = -1;
+static int cap_on;
+static int cap_stop;
+static int cap_err;
+static pthread_t cap_thread;
+static long flush_ns = CAP_FLUSH_NS;
+static int lazy;
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond;	/* cap_stop was set */
+
+/*
+ * copy whatever is in the ring out to the file
+ */
+ static void
+drain(void)
+{
+	static unsigned char buf[CAP_BUFSIZE];
+	struct cap_slot *s;
+	unsigned int h, t;
+	size_t n = 0;
+	size_t len;
+	int ret;
+
+	h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	for (t = tail; t != h; t++) {
+		s = &ring[t % CAP_SLOTS];
+		len = sizeof(s->rec) + s->rec.len;
+		if (n + len > sizeof(buf)) {
+			ret = cap_err ? 0 : sf_write_all(cap_fd, buf, n);
+			if (ret) {
+				fprintf(stderr, "capture write failed, capture stopped.  "
+					"errno=%d\n", ret);
+				cap_err = ret;
+			}
+			n = 0;
+		}
+		memcpy(&buf[n], s, len);
+		n += len;
+		__atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+	}
+	if (n && !cap_err) {
+		ret = sf_write_all(cap_fd, buf, n);
+		if (ret) {
+			fprintf(stderr, "capture write failed, capture stopped.  "
+				"errno=%d\n", ret);
+			cap_err = ret;
+		}
+	}
+}
+
+ static void *
+writer_proc(void *arg)
+{
+	struct timespec t;
+
+	if (lazy) {
+		prctl(PR_SET_TIMERSLACK, OH_LAZY_SLACK_NS, 0, 0, 0);
+	}
+	pthread_mutex_lock(&stop_lock);
+	while (!cap_stop) {
+		/* sleep flush_ns, or until capture_close() doesn't want to wait */
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		t.tv_sec += flush_ns / 1000000000;
+		t.tv_nsec += flush_ns % 1000000000;
+		if (t.tv_nsec >= 1000000000) {
+			t.tv_nsec -= 1000000000;
+			t.tv_sec++;
+		}
+		pthread_cond_timedwait(&stop_cond, &stop_lock, &t);
+		pthread_mutex_unlock(&stop_lock);
+		drain();
+		pthread_mutex_lock(&stop_lock);
+	}
+	pthread_mutex_unlock(&stop_lock);
+	drain();
+	overhead_thread_done("capture");
+
+	return NULL;
+}
+
+/*
+ * low overhead: the writer wakes up every couple of seconds, whenever
+ * the kernel gets to it, and writes that much more at a time.  has to
+ * be called before capture_open().
+ */
+ void
+capture_low_overhead(void)
+{
+	flush_ns = CAP_LAZY_NS;
+	lazy = 1;
+}
+
+/*
+ * start capturing to path, appending a new session to it if it's there
+ * already.  returns 0 on success, errno on failure.
+ */
+ int
+capture_open(const char *path)
+{
+	struct cap_header h;
+	pthread_condattr_t ca;
+	int ret;
+
+	ring = calloc(CAP_SLOTS, sizeof(*ring));
+	if (ring == NULL) {
+		return ENOMEM;
+	}
+	cap_fd = open(path, O_CREAT | O_APPEND | O_WRONLY, 0644);
+	if (cap_fd < 0) {
+		ret = errno;
+		goto error_exit;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CAP_MAGIC, 8);
+	h.version = CAP_VERSION;
+	h.size = sizeof(h);
+	clock_gettime(CLOCK_REALTIME, &h.startclk);
+	clock_gettime(CLOCK_MONOTONIC, &h.startmono);
+	ret = sf_write_all(cap_fd, &h, sizeof(h));
+	if (ret) {
+		goto error_exit;
+	}
+
+	cap_stop = 0;
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&stop_cond, &ca);
+	pthread_condattr_destroy(&ca);
+	ret = pthread_create(&cap_thread, NULL, writer_proc, NULL);
+	if (ret) {
+		goto error_exit;
+	}
+	cap_on = 1;
+
+	return 0;
+
+error_exit:
+	if (cap_fd >= 0) {
+		close(cap_fd);
+		cap_fd = -1;
+	}
+	free(ring);
+	ring = NULL;
+	return ret;
+}
+
+/*
+ * called on the sampling thread with each read from the meter.  never
+ * blocks: if the writer has fallen that far behind, the read is dropped.
+ */
+ void
+capture_put(const void *buf, int len)
+{
+	struct cap_slot *s;
+	struct timespec now;
+	unsigned int h = head;
+
+	if (!cap_on || (len <= 0)) {
+		return;
+	}
+	if (h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= CAP_SLOTS) {
+		dropped++;
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	s = &ring[h % CAP_SLOTS];
+	s->rec.mono_ns = ((int64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+	s->rec.len = (len > CAP_MAXLEN) ? CAP_MAXLEN : len;
+	s->rec.dropped = dropped;
+	memcpy(s->data, buf, s->rec.len);
+	dropped = 0;
+	__atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * stop capturing, after getting everything in the ring out to the file.
+ * the sampling thread has to be done by now.
+ */
+ void
+capture_close(void)
+{
+	if (!cap_on) {
+		return;
+	}
+	cap_on = 0;
+	pthread_mutex_lock(&stop_lock);
+	cap_stop = 1;
+	pthread_cond_signal(&stop_cond);
+	pthread_mutex_unlock(&stop_lock);
+	pthread_join(cap_thread, NULL);
+	close(cap_fd);
+	cap_fd = -1;
+	free(ring);
+	ring = NULL;
+}
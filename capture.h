@@ -0,0 +1,50 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Raw protocol capture: every read from the meter's serial port, as it
+ * came in, with the monotonic time of the read.  What EXTECH_DEBUG_PROTO
+ * used to do at compile time, but switched on at run time with
+ * extech_rdr --capture=<file>, and cheap enough to leave on.
+ *
+ * The sampling thread only copies each read into a ring; a writer thread
+ * empties the ring to the file a few times a second, or every couple of
+ * seconds with capture_low_overhead().  If the ring fills up, reads are
+ * dropped rather than the sampler ever waiting, and the next record says
+ * how many.
+ *
+ * A capture file is a struct cap_header for each session (each time
+ * capture_open() appends to the file), each followed by that session's
+ * records: a struct cap_rec and then len bytes of what was read.
+ * extech-capture dumps them.
+ */
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define CAP_MAGIC "EXTECHCP"
+#define CAP_VERSION 1
+#define CAP_MAXLEN 256	/* longest read kept, the size of epacket.buf */
+
+struct cap_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;		/* sizeof(struct cap_header) */
+	struct timespec startclk;	/* CLOCK_REALTIME when the session started */
+	struct timespec startmono;	/* CLOCK_MONOTONIC taken with it */
+};
+
+struct cap_rec {
+	int64_t mono_ns;	/* CLOCK_MONOTONIC when the read returned */
+	uint32_t len;		/* bytes of read data following */
+	uint32_t dropped;	/* reads lost to a full ring just before this one */
+};
+
+extern int capture_open(const char *path);
+extern void capture_put(const void *buf, int len);
+extern void capture_close(void);
+extern void capture_low_overhead(void);
+
+#endif
@@ -0,0 +1,400 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Column store and the reductions over it.  see columns.h.
+ *
+ * Each reduction has a plain C version and, on x86, an AVX2 one, picked
+ * the first time it's called by whether the CPU has AVX2.  NaNs are
+ * skipped by both, and the sums are done in double either way, so they
+ * only differ in the last bits from adding in a different order.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include "columns.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COL_AVX2
+#endif
+
+/*
+ * allocate room for size readings.  returns 0 on success, errno on
+ * failure.
+ */
+ int
+col_init(struct columns *c, long size)
+{
+	int i;
+
+	memset(c, 0, sizeof(*c));
+	c->ns = malloc(size * sizeof(*c->ns));
+	if (c->ns == NULL) {
+		return ENOMEM;
+	}
+	for (i = 0; i < COL_NFIELDS; i++) {
+		c->v[i] = malloc(size * sizeof(*c->v[i]));
+		if (c->v[i] == NULL) {
+			col_free(c);
+			return ENOMEM;
+		}
+	}
+	c->size = size;
+
+	return 0;
+}
+
+ void
+col_free(struct columns *c)
+{
+	int i;
+
+	free(c->ns);
+	c->ns = NULL;
+	for (i = 0; i < COL_NFIELDS; i++) {
+		free(c->v[i]);
+		c->v[i] = NULL;
+	}
+	c->n = c->size = 0;
+}
+
+/*
+ * reading i put back together as a struct reading
+ */
+ void
+col_get(const struct columns *c, long i, struct reading *r)
+{
+	r->tstamp.tv_sec = c->ns[i] / 1000000000;
+	r->tstamp.tv_nsec = c->ns[i] % 1000000000;
+	r->watts = c->v[COL_WATTS][i];
+	r->pf = c->v[COL_PF][i];
+	r->volts = c->v[COL_VOLTS][i];
+	r->amps = c->v[COL_AMPS][i];
+}
+
+
+ static float
+max_c(const float *v, long n)
+{
+	float m = -INFINITY;
+	long i;
+
+	for (i = 0; i < n; i++) {
+		if (v[i] > m) {
+			m = v[i];
+		}
+	}
+	return m;
+}
+
+ static float
+min_c(const float *v, long n)
+{
+	float m = INFINITY;
+	long i;
+
+	for (i = 0; i < n; i++) {
+		if (v[i] < m) {
+			m = v[i];
+		}
+	}
+	return m;
+}
+
+ static double
+sum_c(const float *v, long n)
+{
+	double s = 0;
+	long i;
+
+	for (i = 0; i < n; i++) {
+		if (!isnan(v[i])) {
+			s += v[i];
+		}
+	}
+	return s;
+}
+
+ static long
+find_c(const float *v, long n, float x)
+{
+	long i;
+
+	for (i = 0; i < n; i++) {
+		if (v[i] == x) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * bit i of bits set if v[i] cmp k.  a whole word of bits at a time, so
+ * no word is ever half done; the bits past n in the last one are 0.
+ */
+#define CMP_WORDS(OP) \
+	for (w = 0; w < (n + 63) / 64; w++) { \
+		word = 0; \
+		for (j = 0; (j < 64) && ((w * 64) + j < n); j++) { \
+			word |= (uint64_t)(v[(w * 64) + j] OP k) << j; \
+		} \
+		bits[w] = word; \
+	}
+
+ static void
+cmp_c(const float *v, long n, int cmp, float k, uint64_t *bits)
+{
+	uint64_t word;
+	long w;
+	int j;
+
+	switch (cmp) {
+		case COL_LT:
+			CMP_WORDS(<)
+			break;
+		case COL_LE:
+			CMP_WORDS(<=)
+			break;
+		case COL_GT:
+			CMP_WORDS(>)
+			break;
+		case COL_GE:
+			CMP_WORDS(>=)
+			break;
+		case COL_EQ:
+			CMP_WORDS(==)
+			break;
+		default:
+			CMP_WORDS(!=)
+			break;
+	}
+}
+
+#ifdef COL_AVX2
+/*
+ * max and min take the new values as the first operand: when either is
+ * a NaN the instruction gives back the second one, so NaNs drop out
+ */
+ __attribute__((target("avx2"))) static float
+max_avx2(const float *v, long n)
+{
+	__m256 m = _mm256_set1_ps(-INFINITY);
+	float t[8];
+	float r;
+	long i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		m = _mm256_max_ps(_mm256_loadu_ps(&v[i]), m);
+	}
+	_mm256_storeu_ps(t, m);
+	r = max_c(t, 8);
+	t[0] = max_c(&v[i], n - i);
+	return (t[0] > r) ? t[0] : r;
+}
+
+ __attribute__((target("avx2"))) static float
+min_avx2(const float *v, long n)
+{
+	__m256 m = _mm256_set1_ps(INFINITY);
+	float t[8];
+	float r;
+	long i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		m = _mm256_min_ps(_mm256_loadu_ps(&v[i]), m);
+	}
+	_mm256_storeu_ps(t, m);
+	r = min_c(t, 8);
+	t[0] = min_c(&v[i], n - i);
+	return (t[0] < r) ? t[0] : r;
+}
+
+ __attribute__((target("avx2"))) static double
+sum_avx2(const float *v, long n)
+{
+	__m256d s0 = _mm256_setzero_pd();
+	__m256d s1 = _mm256_setzero_pd();
+	__m256 x;
+	double t[4];
+	long i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		x = _mm256_loadu_ps(&v[i]);
+		/* NaNs aren't equal to themselves, so they're zeroed */
+		x = _mm256_and_ps(x, _mm256_cmp_ps(x, x, _CMP_ORD_Q));
+		s0 = _mm256_add_pd(s0, _mm256_cvtps_pd(_mm256_castps256_ps128(x)));
+		s1 = _mm256_add_pd(s1, _mm256_cvtps_pd(_mm256_extractf128_ps(x, 1)));
+	}
+	_mm256_storeu_pd(t, _mm256_add_pd(s0, s1));
+	return t[0] + t[1] + t[2] + t[3] + sum_c(&v[i], n - i);
+}
+
+ __attribute__((target("avx2"))) static long
+find_avx2(const float *v, long n, float x)
+{
+	__m256 k = _mm256_set1_ps(x);
+	int mask;
+	long i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(&v[i]), k,
+			_CMP_EQ_OQ));
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	n = find_c(&v[i], n - i, x);
+	return (n < 0) ? -1 : i + n;
+}
+
+/*
+ * 64 readings to a word of bits, 8 at a time.  the predicates are the
+ * ordered ones, except for not equal, so NaNs compare the same as in C.
+ */
+#define CMP_AVX2_WORDS(IMM) \
+	for (w = 0; w < n / 64; w++) { \
+		word = 0; \
+		for (j = 0; j < 8; j++) { \
+			word |= (uint64_t)_mm256_movemask_ps(_mm256_cmp_ps( \
+				_mm256_loadu_ps(&v[(w * 64) + (j * 8)]), kk, IMM)) << (j * 8); \
+		} \
+		bits[w] = word; \
+	}
+
+ __attribute__((target("avx2"))) static void
+cmp_avx2(const float *v, long n, int cmp, float k, uint64_t *bits)
+{
+	__m256 kk = _mm256_set1_ps(k);
+	uint64_t word;
+	long w;
+	int j;
+
+	switch (cmp) {
+		case COL_LT:
+			CMP_AVX2_WORDS(_CMP_LT_OQ)
+			break;
+		case COL_LE:
+			CMP_AVX2_WORDS(_CMP_LE_OQ)
+			break;
+		case COL_GT:
+			CMP_AVX2_WORDS(_CMP_GT_OQ)
+			break;
+		case COL_GE:
+			CMP_AVX2_WORDS(_CMP_GE_OQ)
+			break;
+		case COL_EQ:
+			CMP_AVX2_WORDS(_CMP_EQ_OQ)
+			break;
+		default:
+			CMP_AVX2_WORDS(_CMP_NEQ_UQ)
+			break;
+	}
+	/* the last part of a word */
+	w = n / 64;
+	if (n % 64) {
+		cmp_c(&v[w * 64], n % 64, cmp, k, &bits[w]);
+	}
+}
+
+static int have_avx2 = -1;
+
+ static int
+use_avx2(void)
+{
+	if (have_avx2 < 0) {
+		__builtin_cpu_init();
+		have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	}
+	return have_avx2;
+}
+#endif /* COL_AVX2 */
+
+/*
+ * the biggest of v[0..n-1], -INFINITY if there's nothing but NaNs
+ */
+ float
+col_max(const float *v, long n)
+{
+#ifdef COL_AVX2
+	if (use_avx2()) {
+		return max_avx2(v, n);
+	}
+#endif
+	return max_c(v, n);
+}
+
+/*
+ * the smallest of v[0..n-1], INFINITY if there's nothing but NaNs
+ */
+ float
+col_min(const float *v, long n)
+{
+#ifdef COL_AVX2
+	if (use_avx2()) {
+		return min_avx2(v, n);
+	}
+#endif
+	return min_c(v, n);
+}
+
+ double
+col_sum(const float *v, long n)
+{
+#ifdef COL_AVX2
+	if (use_avx2()) {
+		return sum_avx2(v, n);
+	}
+#endif
+	return sum_c(v, n);
+}
+
+/*
+ * the index of the first of the biggest of v[0..n-1], so the rest of
+ * that reading can be had from the other columns.  -1 if there isn't one.
+ * it's the max and then a search for it, both of which go at memory
+ * speed, rather than carrying indexes along through the max.
+ */
+ long
+col_argmax(const float *v, long n)
+{
+	float m = col_max(v, n);
+
+#ifdef COL_AVX2
+	if (use_avx2()) {
+		return find_avx2(v, n, m);
+	}
+#endif
+	return find_c(v, n, m);
+}
+
+ long
+col_argmin(const float *v, long n)
+{
+	float m = col_min(v, n);
+
+#ifdef COL_AVX2
+	if (use_avx2()) {
+		return find_avx2(v, n, m);
+	}
+#endif
+	return find_c(v, n, m);
+}
+
+/*
+ * a bitmap of which of v[0..n-1] compare cmp to k: bit i % 64 of
+ * bits[i / 64].  bits has to have room for (n + 63) / 64 words.
+ */
+ void
+col_cmp(const float *v, long n, int cmp, float k, uint64_t *bits)
+{
+#ifdef COL_AVX2
+	if (use_avx2()) {
+		cmp_avx2(v, n, cmp, k, bits);
+		return;
+	}
+#endif
+	cmp_c(v, n, cmp, k, bits);
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Readings as columns: the tstamps in one array and each of watts, pf,
+ * volts and amps in its own, instead of an array of struct reading.  A
+ * pass over one field, like finding the max watts, then only touches that
+ * field's 4 bytes a reading instead of all 32, and runs 8 readings at a
+ * time with AVX2 where the CPU has it.
+ *
+ * extech_rdr keeps its readings this way unless it needs whole records
+ * (--raw, --flight, --log), and a version 2 storefile can be laid out
+ * the same way (SF_LAYOUT_COLUMNS).
+ */
+#ifndef _COLUMNS_H
+#define _COLUMNS_H
+
+#include <stdint.h>
+#include "extech.h"
+
+#define COL_NFIELDS 4
+
+/*
+ * fields, in struct reading order
+ */
+#define COL_WATTS	0
+#define COL_PF		1
+#define COL_VOLTS	2
+#define COL_AMPS	3
+
+struct columns {
+	long n;
+	long size;
+	int64_t *ns;	/* the CLOCK_MONOTONIC tstamps, in nsecs */
+	float *v[COL_NFIELDS];
+};
+
+extern int col_init(struct columns *c, long size);
+extern void col_free(struct columns *c);
+extern void col_get(const struct columns *c, long i, struct reading *r);
+
+extern float col_max(const float *v, long n);
+extern float col_min(const float *v, long n);
+extern double col_sum(const float *v, long n);
+extern long col_argmax(const float *v, long n);
+extern long col_argmin(const float *v, long n);
+
+/*
+ * comparisons for col_cmp()
+ */
+#define COL_LT	0
+#define COL_LE	1
+#define COL_GT	2
+#define COL_GE	3
+#define COL_EQ	4
+#define COL_NE	5
+
+extern void col_cmp(const float *v, long n, int cmp, float k, uint64_t *bits);
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Copyright 2010, Intel Corporation
+ *
+ * The decoder in this file was originally part of extech.c, which was
+ * part of PowerTOP.  It lives on its own so the sampler and the programs
+ * that decode stored raw meter words all go through the same code.
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ * or just google for it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "extech.h"
+
+
+/*
+ * the dat that comes from the extech meter is encoded in a funky pseudo
+ * EBCIDIC like encoding, i guess to get the data transmitted in the fewest
+ * bytes possible, for the old days when serial ports ran at 9600 baud
+ * and like that
+ */
+ int
+decode_extech_value(unsigned char byt3, unsigned char byt4, char *a)
+{
+	unsigned int input = ((unsigned int)byt4 << 8) + byt3;
+	unsigned int i;
+	unsigned int idx;
+	unsigned char revnum[] = {
+				0x0, 0x8, 0x4, 0xc,
+				0x2, 0xa, 0x6, 0xe,
+				0x1, 0x9, 0x5, 0xd,
+				0x3, 0xb, 0x7, 0xf
+	};
+
+	unsigned char revdec[] = {0x0, 0x2, 0x1, 0x3};
+
+	unsigned int digit_map[] = {0x2, 0x3c, 0x3c0, 0x3c00};
+	unsigned int digit_shift[] = {1, 2, 6, 10};
+
+	unsigned int sign;
+	unsigned int decimal;
+
+	/*
+	 * this is basically BCD encoded floating point... but kinda weird
+	 */
+
+	decimal = (input & 0xc000) >> 14;
+	decimal = revdec[decimal];
+
+	sign = input & 0x1;
+
+	idx = 0;
+	if (sign) {
+		a[idx++] = '+';
+	} else {
+		a[idx++] = '-';
+	}
+
+	/* first digit is only one or zero */
+	a[idx] = '0';
+	if ((input & digit_map[0]) >> digit_shift[0]) {
+		a[idx] += 1;
+	}
+
+	idx++;
+	/* Reverse the remaining three digits and store in the array */
+	for (i = 1; i < 4; i++) {
+		int dig = ((input & digit_map[i]) >> digit_shift[i]);
+		dig = revnum[dig];
+		if (dig > 0xa) {
+			goto error_exit;
+		}
+
+		a[idx++] = '0' + dig;
+	}
+
+	/* Fit the decimal point where appropriate */
+	for (i = 0; i < decimal; i++) {
+		a[idx - i] = a[idx - i - 1];
+	}
+
+	a[idx - decimal] = '.';
+	a[++idx] = '0';
+	a[++idx] = '\0';
+
+	return 0;
+error_exit:
+	return -1;
+}
+
+/*
+ * decode one 16 bit value word, as it came off the wire (byte 3 of the
+ * 5 byte block in the low byte, byte 4 in the high byte), into a float.
+ * returns 0 on success, -1 if the word doesn't decode.
+ */
+ int
+extech_decode_word(unsigned short word, float *val)
+{
+	char a[16];
+
+	if (decode_extech_value(word & 0xff, word >> 8, a)) {
+		return -1;
+	}
+	*val = strtof(a, NULL);
+
+	return 0;
+}
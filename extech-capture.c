@@ -0,0 +1,176 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Program to dump a raw protocol capture file written by
+ * extech_rdr --capture.
+ *
+ * Each read is output with its wall clock time, its length and its bytes
+ * in hex, in blocks of 5 like the meter sends them, and, if it's a whole
+ * reading, the decoded watts, pf, volts and amps.
+ *
+ * With --frames, only the 20 byte readings are output, as is, back to
+ * back, which is what extech-decode reads.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include "extech.h"
+#include "capture.h"
+
+/*
+ * argument specification
+ */
+int frames_opt = 0; /* output the bare 20 byte readings */
+
+struct option ec_opts[] = {
+	{
+		"frames",
+		no_argument,
+		&frames_opt,
+		1
+	},
+	{}
+};
+
+ void
+usage(char **args)
+{
+	printf("usage: %s [--frames] <capture-file>\n", args[0]);
+}
+
+/*
+ * a whole reading: four blocks of 02 ?? lo hi 03
+ */
+ static int
+is_frame(const unsigned char *b, uint32_t len)
+{
+	int i;
+
+	if (len < 20) {
+		return 0;
+	}
+	for (i = 0; i < 4; i++) {
+		if ((b[i * 5] != 2) || (b[(i * 5) + 4] != 3)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+ static void
+show(const struct cap_header *h, const struct cap_rec *r,
+	const unsigned char *b)
+{
+	int64_t ns;
+	float v[4];
+	uint32_t i;
+	int bad = 0;
+
+	ns = ((int64_t)h->startclk.tv_sec * 1000000000) + h->startclk.tv_nsec +
+		(r->mono_ns - (((int64_t)h->startmono.tv_sec * 1000000000) +
+		h->startmono.tv_nsec));
+	if (r->dropped) {
+		printf("(%u reads dropped)\n", r->dropped);
+	}
+	printf("%ld.%.3ld %3u ", ns / 1000000000, (ns % 1000000000) / 1000000,
+		r->len);
+	for (i = 0; i < r->len; i++) {
+		printf("%s%.2x", (i && !(i % 5)) ? "|" : "", b[i]);
+	}
+	if (is_frame(b, r->len)) {
+		/* blocks come watts, amps, volts, pf */
+		for (i = 0; i < 4; i++) {
+			bad |= extech_decode_word((b[(i * 5) + 3] << 8) | b[(i * 5) + 2],
+				&v[i]);
+		}
+		if (bad) {
+			printf("  failed conversion");
+		} else {
+			printf("  %7.3f %7.3f %7.3f %7.3f", v[0], v[3], v[2], v[1]);
+		}
+	}
+	printf("\n");
+}
+
+
+ int
+main(int argc, char **argv) {
+	FILE *f;
+	struct cap_header h;
+	struct cap_rec r;
+	unsigned char b[CAP_MAXLEN];
+	char tst[64];
+	time_t t;
+	int have_hdr = 0;
+	int rc;
+
+	do {
+		rc = getopt_long(argc, argv, "", &ec_opts[0], NULL);
+		if ((rc == ':') || (rc == '?')) {
+			usage(argv);
+			exit(1);
+		}
+	} while (rc != -1);
+
+	if (optind + 1 != argc) {
+		usage(argv);
+		exit(1);
+	}
+
+	f = fopen(argv[optind], "r");
+	if (f == NULL) {
+		fprintf(stderr, "open capture file '%s' failed.  errno=%d\n",
+			argv[optind], errno);
+		exit(1);
+	}
+
+	/*
+	 * a session header or a record; a record's mono_ns can't look like
+	 * the magic number for a couple of centuries of uptime
+	 */
+	while (fread(&r, sizeof(r), 1, f) == 1) {
+		if (!memcmp(&r, CAP_MAGIC, 8)) {
+			memcpy(&h, &r, sizeof(r));
+			if (fread((char *)&h + sizeof(r), sizeof(h) - sizeof(r), 1, f) != 1) {
+				break;
+			}
+			if ((h.version != CAP_VERSION) || (h.size != sizeof(h))) {
+				fprintf(stderr, "unknown capture file version %u\n", h.version);
+				exit(1);
+			}
+			have_hdr = 1;
+			if (!frames_opt) {
+				t = h.startclk.tv_sec;
+				strftime(tst, sizeof(tst), "%Y-%m-%d %H:%M:%S",
+					localtime(&t));
+				printf("session %s\n", tst);
+			}
+			continue;
+		}
+		if (!have_hdr || (r.len > CAP_MAXLEN)) {
+			fprintf(stderr, "'%s' is not a capture file\n", argv[optind]);
+			exit(1);
+		}
+		if (fread(b, 1, r.len, f) != r.len) {
+			/* cut off in the middle; a crash, most likely */
+			break;
+		}
+		if (frames_opt) {
+			if (is_frame(b, r.len)) {
+				fwrite(b, 1, 20, stdout);
+			}
+		} else {
+			show(&h, &r, b);
+		}
+	}
+	fclose(f);
+
+	return 0;
+}
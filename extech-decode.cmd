@@ -3,4 +3,4 @@
 IFILE="$1"
 shift
 
-dd if="$IFILE" ibs=1 skip=14 obs=20 status=none | ./extech-decode "$@"
+./extech-capture --frames "$IFILE" | ./extech-decode "$@"
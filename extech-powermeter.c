@@ -8,6 +8,8 @@
 #include <getopt.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include "../../../../../software/perrno/perrno.h"
@@ -296,18 +298,278 @@ error_exit:
 int is_dfile = 0; /* set to 1 if "serial device" is actually a device file */
 int is_rfile = 0; /* set to 1 if "serial device" is a regular file */
 
+/*
+ * the meter is read on its own thread, and everything to do with the
+ * terminal happens on the main thread, so a slow terminal or ssh session
+ * never holds up the next reading.  the reader thread puts each reading
+ * in the samples ring and pokes the main thread through a pipe; the main
+ * thread polls that pipe and stdin together.
+ */
+#define NSAMPLES 256	/* > 60s worth at 2.5 readings a second */
+#define SPARK_LEN 40	/* readings in the sparkline */
+
+struct sample {
+	struct timespec ts;
+	float watts;
+	int ok[4];			/* which of the strings below decoded */
+	char str[4][32];	/* watts, pf, volts, amps as the meter shows them */
+};
+
+struct sample samples[NSAMPLES];
+unsigned long nsamples; /* total ever put in the ring */
+int reader_done;
+pthread_mutex_t samples_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int ser_port_fd;
+int wake_pipe[2]; /* reader -> main: there's a new sample */
+int quit_pipe[2]; /* main -> reader: time to go */
+
+/*
+ * wait up to timeout msecs for the serial port to have something, or for
+ * the main thread to say quit.  returns 1 if there's something to read,
+ * 0 on timeout, -1 to quit.
+ */
+ static int
+wait_serial(int timeout)
+{
+	struct pollfd pfd[2];
+
+	pfd[0].fd = ser_port_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = quit_pipe[0];
+	pfd[1].events = POLLIN;
+
+	if (is_rfile) {
+		/* a regular file always has something, or EOF */
+		timeout = 0;
+		pfd[0].fd = -1;
+		pfd[0].revents = POLLIN;
+	}
+	if (poll(pfd, 2, timeout) < 0) {
+		return (errno == EINTR) ? 0 : -1;
+	}
+	if (pfd[1].revents) {
+		return -1;
+	}
+	return (is_rfile || (pfd[0].revents & POLLIN)) ? 1 : 0;
+}
+
+ static void
+put_sample(unsigned char *buf)
+{
+	struct sample *sp;
+	/* watts, pf, volts, amps are blocks 0, 3, 2 and 1 */
+	int blk[4] = {0, 15, 10, 5};
+	int i;
+
+	pthread_mutex_lock(&samples_lock);
+	sp = &samples[nsamples % NSAMPLES];
+	clock_gettime(CLOCK_MONOTONIC, &sp->ts);
+	for (i = 0; i < 4; i++) {
+		sp->ok[i] = (decode_extech_value(buf[blk[i] + 2], buf[blk[i] + 3],
+			sp->str[i]) >= 0);
+	}
+	sp->watts = sp->ok[0] ? strtof(sp->str[0], NULL) : 0.0;
+	nsamples++;
+	pthread_mutex_unlock(&samples_lock);
+
+	/* if the pipe is full the main thread has plenty of waking up to do */
+	write(wake_pipe[1], "", 1);
+}
+
+/*
+ * the reader thread: trigger the meter every 400 msecs and collect what
+ * it sends back.  the sleeping is done in poll, so a quit from the main
+ * thread doesn't have to wait it out.
+ */
+ static void *
+reader(void *arg)
+{
+	unsigned char buf[256];
+	struct timespec next, now;
+	int have;
+	int rc;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (;;) {
+		if (is_dfile) {
+			/*
+			 * wait just a tad
+			 */
+			next.tv_nsec += 400000000;
+			if (next.tv_nsec >= 1000000000) {
+				next.tv_nsec -= 1000000000;
+				next.tv_sec++;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			ms = ((next.tv_sec - now.tv_sec) * 1000) +
+				((next.tv_nsec - now.tv_nsec) / 1000000);
+			if ((ms > 0) && (poll(&(struct pollfd){quit_pipe[0], POLLIN},
+				1, ms) > 0)) {
+				break;
+			}
+			/* send the "give me a reading" cmd char to powermeter */
+			write(ser_port_fd, " ", 1);
+		}
+
+		/*
+		 * a reading is 20 bytes, which at 9600 baud don't necessarily
+		 * all show up at once
+		 */
+		have = 0;
+		while (have < 20) {
+			rc = wait_serial(500);
+			if (rc <= 0) {
+				break;
+			}
+			rc = read(ser_port_fd, &buf[have], sizeof(buf) - have);
+			if ((rc == 0) || ((rc < 0) && (errno != EAGAIN) &&
+				(errno != EINTR))) {
+				if (is_rfile) {
+					/* eof */
+					rc = -1;
+					break;
+				}
+				fprintf(stderr, "\nread returned %d, errno = %d(%s)\n", rc,
+					errno, perrno(errno) ?: "NULL");
+				rc = 0;
+				break;
+			}
+			if (rc > 0) {
+				have += rc;
+			}
+		}
+		if (rc < 0) {
+			break;
+		}
+		if (have < 20) {
+			/*
+			 * short read?  get out of the car, walk around it,
+			 * get back in, and try again
+			 */
+			continue;
+		}
+
+		put_sample(buf);
+	}
+
+	pthread_mutex_lock(&samples_lock);
+	reader_done = 1;
+	pthread_mutex_unlock(&samples_lock);
+	write(wake_pipe[1], "", 1);
+
+	return NULL;
+}
+
+/*
+ * average watts over the last 'secs' seconds of samples
+ */
+ static float
+rolling_avg(unsigned long n, struct timespec *now, int secs)
+{
+	struct sample *sp;
+	double sum = 0.0;
+	int count = 0;
+	unsigned long i;
+
+	for (i = 0; (i < n) && (i < NSAMPLES); i++) {
+		sp = &samples[(n - 1 - i) % NSAMPLES];
+		if ((now->tv_sec - sp->ts.tv_sec) * 1000000000L +
+			(now->tv_nsec - sp->ts.tv_nsec) > secs * 1000000000L) {
+			break;
+		}
+		sum += sp->watts;
+		count++;
+	}
+
+	return count ? sum / count : 0.0;
+}
+
+/*
+ * the last SPARK_LEN watts, scaled between their own min and max
+ */
+ static int
+sparkline(char *out, unsigned long n)
+{
+	static const char *bars[] = {
+		"▁", "▂", "▃", "▄",
+		"▅", "▆", "▇", "█",
+	};
+	float min, max, w;
+	unsigned long i, first;
+	int len = 0;
+	int lvl;
+
+	first = (n > SPARK_LEN) ? n - SPARK_LEN : 0;
+	min = max = samples[first % NSAMPLES].watts;
+	for (i = first; i < n; i++) {
+		w = samples[i % NSAMPLES].watts;
+		min = (w < min) ? w : min;
+		max = (w > max) ? w : max;
+	}
+	for (i = first; i < n; i++) {
+		w = samples[i % NSAMPLES].watts;
+		lvl = (max > min) ? (int)(((w - min) / (max - min)) * 7.0 + 0.5) : 0;
+		len += sprintf(&out[len], "%s", bars[lvl]);
+	}
+
+	return len;
+}
+
+/*
+ * compose a frame with the latest reading and the stats kept on them,
+ * to go to the terminal in one write.  returns its length.
+ */
+ static int
+render(char *frame, unsigned long n, double wh)
+{
+	static const char *label[4] = {"watts: ", "pf: ", "volts: ", "amps: "};
+	struct sample *sp = &samples[(n - 1) % NSAMPLES];
+	struct timespec now = sp->ts;
+	int len = 0;
+	int i;
+
+	if (!scroll_opt) {
+		/*
+		 * move cursor to beginning of line and clear line
+		 */
+		len += sprintf(&frame[len], "\r\e[K");
+	}
+	for (i = 0; i < 4; i++) {
+		if (sp->ok[i]) {
+			len += sprintf(&frame[len], "%s%s ", label[i], sp->str[i]);
+		}
+	}
+	len += sprintf(&frame[len], "| avg 1s/10s/60s: %.1f/%.1f/%.1f | %.4f Wh ",
+		rolling_avg(n, &now, 1), rolling_avg(n, &now, 10),
+		rolling_avg(n, &now, 60), wh);
+	len += sparkline(&frame[len], n);
+	if (scroll_opt) {
+		frame[len++] = '\n';
+	}
+
+	return len;
+}
+
 
  int
 main(int argc, char **argv) {
 	unsigned char buf[256];
-	char out[32];
+	char frame[1024];
+	int flen;
 	unsigned int rc;
-	struct timespec tv;
-	int ser_port_fd;
 	struct termios ti; /* termios to set */
 	struct termios ts; /* place to store/save termios */
-	int flgs;
 	int argx;
+	struct pollfd pfd[2];
+	pthread_t rthread;
+	unsigned long seen = 0;
+	unsigned long n;
+	int done = 0;
+	double wh = 0.0;
+	struct timespec prev_ts;
+	float prev_watts = 0.0;
 
 
 	argvec = argv;
@@ -363,142 +625,111 @@ main(int argc, char **argv) {
 		exit(1);
 	}
 
-/*
-	rc = fcntl(0, F_GETFL, NULL);
-	printf("stdin flags: %#o\n", rc);
-	fflush(stdout);
-	* check if stdin is a tty, CTTY or whatever, and if not, close it
-	* otherwise, when run in background, redirect stdin from /dev/null
- */
+	if (pipe(wake_pipe) || pipe(quit_pipe)) {
+		fprintf(stderr, "pipe failed with errno %d\n", errno);
+		exit(1);
+	}
+	fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
 
 	/*
-	 * set stdin to non blocking and no ints
-	 * so we can check for a 'q' w/o getting stuck
+	 * no echo, no line buffering and no interrupt generation on stdin,
+	 * so a 'q' or ^C can be picked up as soon as it's typed.  stdin is
+	 * polled, so it doesn't need to be non-blocking.
 	 */
-	rc = tcgetattr(0, &ti);
-	ts = ti;
+	rc = tcgetattr(0, &ts);
+	ti = ts;
 
 	tcflush(0, TCIFLUSH); /* discard any unread characters */
 
-	ti.c_lflag |= (~ECHO | ~ISIG);  /* turn of echo and interrupt generation */
-
-	/* min 1 character.
-	 * could be zero, really, since we set non_block
-	 */
+	ti.c_lflag &= ~(ECHO | ICANON | ISIG);
 	ti.c_cc[VMIN] = 1;
 	ti.c_cc[VTIME] = 0; /* no min time to wait */
 
 	rc = tcsetattr(0, TCSANOW, &ti); /* set settings immediately TCSAFLUSH */
 
-	rc = fcntl(0, F_SETFL, O_NONBLOCK); /* set non-blocking i/o on stdin */
-	if (rc) {
-		fprintf(stderr, "fcntl of stdin failed with errno %d\n", errno);
-		rc = tcsetattr(0, TCSANOW, &ts);
-		exit(1);
-	}
-
-	/*
-	 * take a reading 2.5 times a second
-	 */
-	tv.tv_sec = 0;
-	tv.tv_nsec = 400000000;
-
 	if (is_dfile) {
 		/*
 		 * clear out any residual values in power meter output queue
 		 */
 		read(ser_port_fd, buf, 200);
-		nanosleep(&tv, NULL);
 	}
 	printf("\n");
+	fflush(stdout);
 
-	do {
-		if (is_dfile) {
-			/*
-			 * wait just a tad
-			 */
-			nanosleep(&tv, NULL);
-			/* send the "give me a reading" cmd char to powermeter */
-			write(ser_port_fd, " ", 1);
-		}
+	if (pthread_create(&rthread, NULL, reader, NULL)) {
+		fprintf(stderr, "reader thread creation failed\n");
+		tcsetattr(0, TCSANOW, &ts);
+		exit(1);
+	}
 
-		rc = read(ser_port_fd, buf, 40);
+	pfd[0].fd = 0;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = wake_pipe[0];
+	pfd[1].events = POLLIN;
 
-		if ((rc >= 0) && (rc < 20)) {
-			//fprintf(stderr, "\nread returned %d\n", rc);
-			/*
-			 * short read?  get out of the car, walk around it,
-			 * get back in, and try again
-			 */
-			continue;
-		} else if (rc == -1) {
-			if (errno == EAGAIN) {
-				if (is_rfile) {
-					/* eof */
-					break;
-				}
+	while (!done) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR) {
 				continue;
 			}
-			fprintf(stderr, "\nread returned %d, errno = %d(%s)\n", rc, errno,
-				perrno(errno) ?: "NULL");
-			continue;
+			break;
 		}
 
 		/*
-		 * watts
-		 */
-//print_block(buf);
-		rc = decode_extech_value(buf[2], buf[3], out);
-		if (rc >= 0) {
-			printf("watts: %s ", out);
-		}
-		fflush(stdout);
-		/*
-		 * power factor
+		 * bust out of here if user typed 'q'
 		 */
-//print_block(buf+15);
-		rc = decode_extech_value(buf[15 + 2], buf[15 + 3], out);
-		if (rc >= 0) {
-			printf("pf: %s ", out);
+		if (pfd[0].revents & POLLIN) {
+			if (read(0, buf, 1) == 1) {
+				if ((buf[0] == 'q') || (buf[0] == 0x3)) {
+					break;
+				}
+			}
+		} else if (pfd[0].revents) {
+			/* stdin went away */
+			pfd[0].fd = -1;
 		}
-		fflush(stdout);
-		/*
-		 * volts
-		 */
-//print_block(buf+10);
-		rc = decode_extech_value(buf[10 + 2], buf[10 + 3], out);
-		if (rc >= 0) {
-			printf("volts: %s ", out);
+
+		if (!(pfd[1].revents & POLLIN)) {
+			continue;
 		}
-		fflush(stdout);
+		read(wake_pipe[0], buf, sizeof(buf));
+
+		pthread_mutex_lock(&samples_lock);
+		n = nsamples;
+		done = reader_done;
 		/*
-		 * amps
+		 * running watt-hours over every sample since the last frame,
+		 * each one's watts held until the next.  if the terminal held
+		 * things up long enough for the ring to wrap, the ones that got
+		 * written over are lost.
 		 */
-//print_block(buf+5);
-		rc = decode_extech_value(buf[5 + 2], buf[5 + 3], out);
-		if (rc >= 0) {
-			printf("amps: %s", out);
+		if (n - seen > NSAMPLES) {
+			seen = n - NSAMPLES;
 		}
-		fflush(stdout);
+		for (; seen < n; seen++) {
+			struct sample *sp = &samples[seen % NSAMPLES];
 
-		/*
-		 * bust out of here if user typed 'q'
-		 */
-		if (read(0, buf, 1) == 1) {
-			if ((buf[0] == 'q') || (buf[0] == 0x3)) {
-				break;
+			if (seen) {
+				wh += prev_watts * ((sp->ts.tv_sec - prev_ts.tv_sec) +
+					((sp->ts.tv_nsec - prev_ts.tv_nsec) / 1e9)) / 3600.;
 			}
+			prev_ts = sp->ts;
+			prev_watts = sp->watts;
 		}
+		flen = n ? render(frame, n, wh) : 0;
+		pthread_mutex_unlock(&samples_lock);
 
 		/*
-		 * move cursor to beginning of line and clear line
+		 * the write happens without the lock, so if the terminal is
+		 * slow it's only the display that waits
 		 */
-		if (!scroll_opt) {
-			printf("\r\e[K");
-		} else {
-			printf("\n");
+		if (flen) {
+			write(1, frame, flen);
 		}
-	} while (1);
+	}
+
+	write(quit_pipe[1], "", 1);
+	pthread_join(rthread, NULL);
 
 	close(ser_port_fd);
 
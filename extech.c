@@ -37,6 +37,7 @@
  *
  */
 
+#define _GNU_SOURCE /* for pthread_attr_setaffinity_np */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -50,14 +51,22 @@
 #include <time.h>
 #include <signal.h>
 #include <strings.h>
+#include <sched.h>
+#include <poll.h>
 
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/prctl.h>
 
 #include "measurement.h"
 #include "extech.h"
+#include "storefile.h"
+#include "capture.h"
+#include "sink.h"
+#include "alert.h"
+#include "overhead.h"
 
 
 struct epacket {
@@ -66,13 +75,65 @@ struct epacket {
 	float	pf;
 	float	volts;
 	float	amps;
+	unsigned short word[4];	/* encoded values as they came off the wire */
 	int		len;
+	struct timespec trig_ts;	/* CLOCK_MONOTONIC: just before the trigger */
+	struct timespec done_ts;	/* the read that finished it returned */
+	struct timespec ts;		/* when the meter took it, estimated */
 };
 
 static struct power_meter et;
-#ifdef EXTECH_DEBUG_PROTO
-static FILE *dfile;
-#endif
+
+/*
+ * acquisition counters, for metrics.  bumped with relaxed atomics since
+ * anybody can be reading them while the sampling thread goes.
+ */
+static struct ex_stats stats;
+
+#define STAT_INC(F) __atomic_fetch_add(&stats.F, 1, __ATOMIC_RELAXED)
+
+/*
+ * a sampling period that starts more than this late counts as a deadline
+ * miss in realtime mode
+ */
+#define RT_SLACK_NS 2000000
+
+/*
+ * the sampling thread's timer slack in low overhead mode: room for the
+ * kernel to fold its wakeup in with somebody else's.  each reading's
+ * time is measured, not assumed, so it costs nothing in accuracy.
+ */
+#define LO_TIMER_SLACK_NS 1000000
+
+/*
+ * low overhead: how long after the trigger the whole reading should be
+ * in, a frame on the wire and a bit, and how long to give it if it isn't
+ */
+#define LO_ANSWER_NS (EXTECH_CHAR_NS + EXTECH_FRAME_NS + 5000000L)
+#define LO_READ_NS 500000000L
+
+/*
+ * the attach handshake: how many times the meter is asked for a reading,
+ * and how long it gets to answer each time.  a reading takes ~21ms on
+ * the wire, so this is plenty for a meter that's there, and not long to
+ * wait for one that isn't.
+ */
+#define ATTACH_TRIES 4
+#define ATTACH_WAIT_NS 100000000L
+
+/*
+ * the reading the attach handshake got, which is the first one stored
+ */
+static struct epacket attach_rp;
+static int have_attach_rp;
+
+/*
+ * CLOCK_BOOTTIME when the process started, for the time to the first
+ * reading
+ */
+static int64_t proc_start_ns;
+
+static void measured_at(struct epacket *ep);
 
 /*
  * these must be defined in the main line or other file
@@ -81,6 +142,15 @@ extern struct reading *rsp;
 extern int rs_nelems;
 int rs;  /* the index into the rsp array */
 
+/*
+ * if the main line sets rrp, readings are stored there as raw meter words
+ * (struct sf_rawrec) instead of being stored decoded in rsp, and if it
+ * sets rcp, they're stored decoded as columns.  either way rs is the
+ * index and rs_nelems the size.
+ */
+struct sf_rawrec *rrp;
+struct columns *rcp;
+
 
 
 /*
@@ -91,28 +161,24 @@ int rs;  /* the index into the rsp array */
 open_device(const char *device_name)
 {
 	struct stat s;
-	int ret;
-
-	ret = stat(device_name, &s);
-	if (ret < 0) {
-		return -1;
-	}
-
-	if (!S_ISCHR(s.st_mode)) {
-		return -1;
-	}
+	int fd;
 
-	ret = access(device_name, R_OK | W_OK);
-	if (ret) {
+	/*
+	 * straight to the open: anything a stat and access up front would
+	 * turn away, the open or the fstat after it does too
+	 */
+	fd = open(device_name, O_RDWR | O_NONBLOCK | O_NOCTTY);
+	if (fd < 0) {
 		return -1;
 	}
 
-	ret = open(device_name, O_RDWR | O_NONBLOCK | O_NOCTTY);
-	if (ret < 0) {
+	if (fstat(fd, &s) || !S_ISCHR(s.st_mode)) {
+		close(fd);
+		errno = ENOTTY;
 		return -1;
 	}
 
-	return ret;
+	return fd;
 }
 
 
@@ -198,81 +264,6 @@ print_block(char *b, int bcount)
 }
 
 
-/*
- * the dat that comes from the extech meter is encoded in a funky pseudo
- * EBCIDIC like encoding, i guess to get the data transmitted in the fewest
- * bytes possible, for the old days when serial ports ran at 9600 baud
- * and like that
- */
- static unsigned int
-decode_extech_value(unsigned char byt3, unsigned char byt4, char *a)
-{
-	unsigned int input = ((unsigned int)byt4 << 8) + byt3;
-	unsigned int i;
-	unsigned int idx;
-	unsigned char revnum[] = {
-				0x0, 0x8, 0x4, 0xc,
-				0x2, 0xa, 0x6, 0xe,
-				0x1, 0x9, 0x5, 0xd,
-				0x3, 0xb, 0x7, 0xf
-	};
-
-	unsigned char revdec[] = {0x0, 0x2, 0x1, 0x3};
-
-	unsigned int digit_map[] = {0x2, 0x3c, 0x3c0, 0x3c00};
-	unsigned int digit_shift[] = {1, 2, 6, 10};
-
-	unsigned int sign;
-	unsigned int decimal;
-
-	/*
-	 * this is basically BCD encoded floating point... but kinda weird
-	 */
-
-	decimal = (input & 0xc000) >> 14;
-	decimal = revdec[decimal];
-
-	sign = input & 0x1;
-
-	idx = 0;
-	if (sign) {
-		a[idx++] = '+';
-	} else {
-		a[idx++] = '-';
-	}
-
-	/* first digit is only one or zero */
-	a[idx] = '0';
-	if ((input & digit_map[0]) >> digit_shift[0]) {
-		a[idx] += 1;
-	}
-
-	idx++;
-	/* Reverse the remaining three digits and store in the array */
-	for (i = 1; i < 4; i++) {
-		int dig = ((input & digit_map[i]) >> digit_shift[i]);
-		dig = revnum[dig];
-		if (dig > 0xa) {
-			goto error_exit;
-		}
-
-		a[idx++] = '0' + dig;
-	}
-
-	/* Fit the decimal point where appropriate */
-	for (i = 0; i < decimal; i++) {
-		a[idx - i] = a[idx - i - 1];
-	}
-
-	a[idx - decimal] = '.';
-	a[++idx] = '0';
-	a[++idx] = '\0';
-
-	return 0;
-error_exit:
-	return -1;
-}
-
 /*
  * parse a line read from the meter and decode the values
  */
@@ -286,17 +277,13 @@ parse_epacket(struct epacket * p)
 
 	p->buf[p->len] = '\0';
 
-	/* write out the read data for debugging purposes */
-#ifdef EXTECH_DEBUG_PROTO
-	fwrite(p->buf, 1, p->len, dfile);
-#endif
-
 	/*
 	 * First character in 5 character block should be '02'
 	 * Fifth character in 5 character block should be '03'
 	 */
 	for (i = 0; i < 4; i++) {
 		if (p->buf[i * 5] != 2 || p->buf[(i * 5) + 4] != 3) {
+			STAT_INC(bad_bookends);
 			fprintf(stderr, "Invalid packet[%d] bookends ", i);
 			print_block(&p->buf[i * 5], 5);
 #if !defined DEBUG
@@ -310,9 +297,12 @@ parse_epacket(struct epacket * p)
 	 * order of values: watts, amps, volts, pf
 	 */
 	for (i = 0; i < 4; i++) {
+		p->word[i] = ((unsigned char)p->buf[(i * 5) + 3] << 8) |
+			(unsigned char)p->buf[(i * 5) + 2];
 		ret = decode_extech_value(p->buf[(i * 5) + 2], p->buf[(i * 5) + 3],
 				&op[i * 10]);
 		if (ret) {
+			STAT_INC(bad_digits);
 			fprintf(stderr, "Invalid packet[%d] failed conversion ", i);
 			print_block(&p->buf[i * 5], 0);
 #if !defined DEBUG
@@ -330,6 +320,69 @@ parse_epacket(struct epacket * p)
 }
 
 
+/*
+ * CLOCK_BOOTTIME in nsecs
+ */
+ static int64_t
+boottime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	return ((int64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/*
+ * when the process started, from field 22 of /proc/self/stat, in clock
+ * ticks since boot.  only good to a tick, 10ms most places, but there's
+ * no better record of it.  if it can't be had, now will have to do.
+ */
+ static void
+note_proc_start(void)
+{
+	char buf[1024];
+	char *p;
+	unsigned long long ticks;
+	ssize_t n;
+	int fd;
+	int i;
+
+	proc_start_ns = boottime_ns();
+	fd = open("/proc/self/stat", O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) {
+		return;
+	}
+	buf[n] = '\0';
+	/* the command name can have anything in it, up to the last ')' */
+	p = strrchr(buf, ')');
+	for (i = 2; p && (i < 22); i++) {
+		p = strchr(p + 1, ' ');
+	}
+	if (p && (sscanf(p, "%llu", &ticks) == 1)) {
+		proc_start_ns = (int64_t)(ticks * (1000000000 / sysconf(_SC_CLK_TCK)));
+	}
+}
+
+/*
+ * a good reading came in: if it's the first one, note how long that took
+ */
+ static void
+first_sample(void)
+{
+	int64_t ns;
+
+	if (__atomic_load_n(&stats.first_sample_ns, __ATOMIC_RELAXED) == 0) {
+		ns = boottime_ns() - proc_start_ns;
+		__atomic_store_n(&stats.first_sample_ns, ns > 0 ? ns : 1,
+			__ATOMIC_RELAXED);
+	}
+}
+
 /*
  * actually read a line of data from the meter
  */
@@ -361,12 +414,25 @@ extech_read(int er_fd, int nbytes)
 
 	ret = select(er_fd + 1, &read_fd, NULL, NULL, &tv);
 	if (ret <= 0) {
+		if (ret == 0) {
+			STAT_INC(timeouts);
+		} else {
+			STAT_INC(read_errors);
+		}
 		return NULL;
 	}
 
 	ret = read(er_fd, &p.buf[0], nbytes);
+	clock_gettime(CLOCK_MONOTONIC, &p.done_ts);
 	debugp("serial read returned %d", ret);
+	/* keep what was read, as read, if it's being captured */
+	capture_put(&p.buf[0], ret);
 	if (ret < 20) {
+		if (ret < 0) {
+			STAT_INC(read_errors);
+		} else {
+			STAT_INC(short_reads);
+		}
 #ifdef DEBUG
 		if (ret > 0) {
 			for (jm = 0; jm < ret; jm += 5) {
@@ -380,12 +446,195 @@ extech_read(int er_fd, int nbytes)
 
 	if (parse_epacket(&p) == 0) {
 		/* success */
+		STAT_INC(frames_ok);
+		first_sample();
 		return &p;
 	}
 
 	return NULL;
 }
 
+/*
+ * read into p until it has all 20 bytes of a reading, or it's end_ns,
+ * CLOCK_MONOTONIC.  whatever is in already is read without waiting, and
+ * anything ahead of the first 02, like the 'fe' the meter has been known
+ * to send first thing, is skipped.  returns how many bytes of the
+ * reading there are, and *waited is set if it had to wait for any.
+ */
+ static int
+read_reading(struct epacket *p, int64_t end_ns, int *waited)
+{
+	struct pollfd pfd;
+	struct timespec now;
+	int64_t wait_ns;
+	int n = 0;
+	int i;
+	int ret;
+
+	*waited = 0;
+	pfd.fd = et.fd;
+	pfd.events = POLLIN;
+	while (n < 20) {
+		ret = read(et.fd, &p->buf[n], sizeof(p->buf) - 1 - n);
+		if (ret > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &p->done_ts);
+			capture_put(&p->buf[n], ret);
+			n += ret;
+			for (i = 0; (i < n) && (p->buf[i] != 2); i++) {
+				;
+			}
+			if (i) {
+				memmove(&p->buf[0], &p->buf[i], n - i);
+				n -= i;
+			}
+			continue;
+		}
+		if ((ret < 0) && (errno == EINTR)) {
+			continue;
+		}
+		if ((ret == 0) || (errno != EAGAIN)) {
+			STAT_INC(read_errors);
+			break;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		wait_ns = end_ns - (((int64_t)now.tv_sec * 1000000000) + now.tv_nsec);
+		if (wait_ns <= 0) {
+			break;
+		}
+		*waited = 1;
+		ret = poll(&pfd, 1, (wait_ns + 999999) / 1000000);
+		if ((ret < 0) && (errno == EINTR)) {
+			continue;
+		}
+		if (ret <= 0) {
+			break;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * sleep until it's ns, CLOCK_MONOTONIC
+ */
+ static void
+sleep_until(int64_t ns)
+{
+	struct timespec t;
+
+	t.tv_sec = ns / 1000000000;
+	t.tv_nsec = ns % 1000000000;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+}
+
+/*
+ * low overhead: a reading that was all in by the time it was read came
+ * in at some point during the sleep, so when it finished isn't known.
+ * it's taken to have been answered straight away, which measured_at()
+ * then puts when the trigger got to the meter.
+ */
+ static void
+answered_at(struct epacket *p, int64_t trig_ns)
+{
+	int64_t ns;
+
+	ns = trig_ns + EXTECH_CHAR_NS + EXTECH_FRAME_NS;
+	p->done_ts.tv_sec = ns / 1000000000;
+	p->done_ts.tv_nsec = ns % 1000000000;
+}
+
+/*
+ * low overhead: rather than select() waking up the sampling thread for
+ * each piece of a reading as it comes in, which it does whatever VMIN
+ * is, sleep until all of it should be in and read it in one go.  only
+ * if it isn't is the rest waited for, and then when the last of it came
+ * in is when it finished, as it is without low overhead.
+ */
+ static struct epacket *
+read_whole(const struct timespec *trig)
+{
+	static struct epacket p;
+	int64_t trig_ns;
+	int n, waited;
+
+	memset(&p, 0, sizeof(p));
+	trig_ns = ((int64_t)trig->tv_sec * 1000000000) + trig->tv_nsec;
+	sleep_until(trig_ns + LO_ANSWER_NS);
+	n = read_reading(&p, trig_ns + LO_READ_NS, &waited);
+	if (n == 0) {
+		STAT_INC(timeouts);
+		return NULL;
+	}
+	if (n < 20) {
+		STAT_INC(short_reads);
+		return NULL;
+	}
+	p.len = 20;
+	if (parse_epacket(&p)) {
+		return NULL;
+	}
+	if (!waited) {
+		answered_at(&p, trig_ns);
+	}
+	STAT_INC(frames_ok);
+	first_sample();
+
+	return &p;
+}
+
+/*
+ * the attach handshake: ask for a reading and wait, not long, for all 20
+ * bytes of it, a few times if need be.  returns the reading, or NULL if
+ * the meter didn't answer with one in time.
+ */
+ static struct epacket *
+attach_probe(void)
+{
+	static struct epacket p;
+	int64_t end_ns;
+	int tries, n, waited;
+
+	for (tries = 0; tries < ATTACH_TRIES; tries++) {
+		memset(&p, 0, sizeof(p));
+		/* leftovers, including a late answer to the last try */
+		tcflush(et.fd, TCIFLUSH);
+		clock_gettime(CLOCK_MONOTONIC, &p.trig_ts);
+		if (write(et.fd, " ", 1) != 1) {
+			return NULL;
+		}
+		STAT_INC(triggers);
+		end_ns = ((int64_t)p.trig_ts.tv_sec * 1000000000) + p.trig_ts.tv_nsec +
+			ATTACH_WAIT_NS;
+
+		if (et.low_overhead) {
+			/* all in one read, like the sampling thread's */
+			sleep_until(end_ns - ATTACH_WAIT_NS + LO_ANSWER_NS);
+		}
+		n = read_reading(&p, end_ns, &waited);
+		if (n == 0) {
+			STAT_INC(timeouts);
+			continue;
+		}
+		if (n < 20) {
+			STAT_INC(short_reads);
+			continue;
+		}
+		p.len = 20;
+		if (parse_epacket(&p) == 0) {
+			if (et.low_overhead && !waited) {
+				answered_at(&p, end_ns - ATTACH_WAIT_NS);
+			}
+			STAT_INC(frames_ok);
+			first_sample();
+			measured_at(&p);
+			return &p;
+		}
+	}
+
+	return NULL;
+}
+
 /*
  * open the device file and initialize the power meter to start getting
  * readings feed
@@ -394,11 +643,11 @@ extech_read(int er_fd, int nbytes)
 extech_power_meter(const char *extech_name)
 {
 	int ret;
-	char date[32];
-	time_t t;
-	struct tm *timem;
 	struct epacket *gp;
 
+	if (proc_start_ns == 0) {
+		note_proc_start();
+	}
 	et.rate = 0.0;
 	strncpy(et.dev_name, extech_name, sizeof(et.dev_name) - 1);
 
@@ -417,15 +666,16 @@ extech_power_meter(const char *extech_name)
 		return ret;
 	}
 
-	t = time(NULL);
-	timem = localtime(&t);
-	strftime(date, sizeof(date), "%D", timem);
-#ifdef EXTECH_DEBUG_PROTO
-	dfile = fopen("extech-proto-debug.dat", "a");
-	fprintf(dfile, "date %s\n", date);
-#endif
-	ret = write(et.fd, " ", 1);
-	gp = extech_read(et.fd, 1); /* try to gobble an 'fe', whatever that means */
+	/*
+	 * make sure there's a meter answering, and keep its answer as the
+	 * first reading, so sampling can start without waiting a period.
+	 * no answer isn't fatal: the sampling thread keeps asking.
+	 */
+	gp = attach_probe();
+	if (gp) {
+		attach_rp = *gp;
+		have_attach_rp = 1;
+	}
 
 	return 0;
 }
@@ -461,27 +711,117 @@ measure(void)
 
 
 /*
- * store the reading in an array
+ * a matched pair of realtime and monotonic clock readings: the realtime
+ * clock read between two monotonic ones, the closest together of a few
+ * tries, with the monotonic time in the middle of them
  */
- void
-store_reading(struct epacket *ep)
+ static void
+clock_anchor(struct timespec *clk, struct timespec *mono)
+{
+	struct timespec m0, m1, c;
+	int64_t d, best = INT64_MAX;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &m0);
+		clock_gettime(CLOCK_REALTIME, &c);
+		clock_gettime(CLOCK_MONOTONIC, &m1);
+		d = ((int64_t)(m1.tv_sec - m0.tv_sec) * 1000000000) +
+			(m1.tv_nsec - m0.tv_nsec);
+		if (d >= best) {
+			continue;
+		}
+		best = d;
+		*clk = c;
+		mono->tv_sec = m0.tv_sec;
+		mono->tv_nsec = m0.tv_nsec + (d / 2);
+		if (mono->tv_nsec >= 1000000000) {
+			mono->tv_nsec -= 1000000000;
+			mono->tv_sec++;
+		}
+	}
+}
+
+/*
+ * usecs from a to b, for the raw records' timing fields
+ */
+ static uint16_t
+ts_us(const struct timespec *a, const struct timespec *b)
+{
+	int64_t us;
+
+	us = (((int64_t)(b->tv_sec - a->tv_sec) * 1000000000) +
+		(b->tv_nsec - a->tv_nsec)) / 1000;
+	if (us < 0) {
+		return 0;
+	}
+	return (us > UINT16_MAX) ? UINT16_MAX : us;
+}
+
+/*
+ * when the meter took the reading.  it answers the trigger with the
+ * reading it has, so that's taken to be when it started sending: a
+ * frame's time on the wire before the read that finished it returned.
+ * but not before the trigger got to it, in case the read was late.
+ */
+ static void
+measured_at(struct epacket *ep)
+{
+	int64_t ns, trig_ns;
+
+	ns = ((int64_t)ep->done_ts.tv_sec * 1000000000) + ep->done_ts.tv_nsec -
+		EXTECH_FRAME_NS;
+	trig_ns = ((int64_t)ep->trig_ts.tv_sec * 1000000000) +
+		ep->trig_ts.tv_nsec + EXTECH_CHAR_NS;
+	if (ns < trig_ns) {
+		ns = trig_ns;
+	}
+	ep->ts.tv_sec = ns / 1000000000;
+	ep->ts.tv_nsec = ns % 1000000000;
+}
+
+/*
+ * store the reading, taken at time now, in an array
+ */
+ static void
+store_at(struct epacket *ep, struct timespec *now)
 {
-	struct timespec res;
+	struct timespec clk = {0, 0}, mono = {0, 0};
+	static uint64_t last_us;
+	uint64_t now_us;
+	int64_t ns;
+	int i;
 	extern struct timespec startclk;
+	extern struct timespec startmono;
 
  	if (rs == 0) {
 		/*
-		 * nacent code used to determine the coarse clock resolution
-		 clock_getres(CLOCK_REALTIME_COARSE, &res);
-		 printf("\nresolution of CLOCK_REALTIME_COARSE is %ld secs %ld (%#lx)
-			nsecs\n", res.tv_sec, res.tv_nsec, res.tv_nsec);
+		 * the realtime clock at the first reading's tstamp, worked out
+		 * from a matched pair of clock readings rather than whatever the
+		 * realtime clock says now, which is later than the reading and
+		 * was only good to 4ms with the coarse clock
 		 */
-		/* which apparently is 4000000 nsecs (4 msecs) */
-
-		clock_gettime(CLOCK_REALTIME_COARSE, &startclk);
+		clock_anchor(&clk, &mono);
+		ns = ((int64_t)(now->tv_sec - mono.tv_sec) * 1000000000) +
+			(now->tv_nsec - mono.tv_nsec) + clk.tv_nsec;
+		startclk.tv_sec = clk.tv_sec + (ns / 1000000000);
+		startclk.tv_nsec = ns % 1000000000;
+		if (startclk.tv_nsec < 0) {
+			startclk.tv_nsec += 1000000000;
+			startclk.tv_sec--;
+		}
+		startmono = *now;
+		last_us = 0;
 	}
 
-	if (rs >= rs_nelems) {
+	/*
+	 * in flight recorder mode the store is a ring, and rs keeps counting.
+	 * rs is bumped with release ordering so whoever reads the ring sees
+	 * the reading before the count that covers it.
+	 */
+	i = et.ring ? (rs % rs_nelems) : rs;
+	if (!et.ring && (rs >= rs_nelems)) {
+		STAT_INC(dropped);
 		//malloc(second store block);
 		//rsp = new readings store address;
 		//continue on
@@ -490,14 +830,175 @@ store_reading(struct epacket *ep)
 		return;
 	}
 
-	clock_gettime(CLOCK_MONOTONIC_COARSE, &rsp[rs].tstamp);
-	rsp[rs].watts = ep->watts;
-	rsp[rs].pf = ep->pf;
-	rsp[rs].volts = ep->volts;
-	rsp[rs].amps = ep->amps;
-	rs++;
+	if (rrp) {
+		/*
+		 * raw: just the wire words and the usecs since the last one.  the
+		 * delta is taken off the running total from startmono so rounding
+		 * to usecs doesn't pile up over a long run.
+		 */
+		now_us = ((uint64_t)(now->tv_sec - startmono.tv_sec) * 1000000) +
+			((now->tv_nsec - startmono.tv_nsec) / 1000);
+		memcpy(rrp[i].word, ep->word, sizeof(rrp[i].word));
+		rrp[i].tdelta = now_us - last_us;
+		rrp[i].trig_us = ts_us(&ep->trig_ts, now);
+		rrp[i].done_us = ts_us(now, &ep->done_ts);
+		last_us = now_us;
+		__atomic_store_n(&rs, rs + 1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	if (rcp) {
+		rcp->ns[i] = ((int64_t)now->tv_sec * 1000000000) + now->tv_nsec;
+		rcp->v[COL_WATTS][i] = ep->watts;
+		rcp->v[COL_PF][i] = ep->pf;
+		rcp->v[COL_VOLTS][i] = ep->volts;
+		rcp->v[COL_AMPS][i] = ep->amps;
+		rcp->n = rs + 1;
+		__atomic_store_n(&rs, rs + 1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	rsp[i].tstamp = *now;
+	rsp[i].watts = ep->watts;
+	rsp[i].pf = ep->pf;
+	rsp[i].volts = ep->volts;
+	rsp[i].amps = ep->amps;
+	__atomic_store_n(&rs, rs + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * deadband storage: the last reading stored, and the last one left out
+ * because it was too close to it, with the times they were taken
+ */
+static struct epacket db_kept, db_held;
+static struct timespec db_kept_ts, db_held_ts;
+static int db_have_held;
+
+ static int
+db_moved(float v, float kept, float tol)
+{
+	return ((v - kept) > tol) || ((kept - v) > tol);
+}
+
+/*
+ * store the reading in an array.  with a deadband, only if some field
+ * moved far enough from the last reading stored, or it's time for a
+ * keyframe.
+ */
+ void
+store_reading(struct epacket *ep)
+{
+	struct timespec now = ep->ts;
+
+	if (et.deadband && rs) {
+		if (!db_moved(ep->watts, db_kept.watts, et.db_tol[0]) &&
+			!db_moved(ep->pf, db_kept.pf, et.db_tol[1]) &&
+			!db_moved(ep->volts, db_kept.volts, et.db_tol[2]) &&
+			!db_moved(ep->amps, db_kept.amps, et.db_tol[3]) &&
+			(now.tv_sec - db_kept_ts.tv_sec < DB_KEYFRAME_SECS)) {
+			db_held = *ep;
+			db_held_ts = now;
+			db_have_held = 1;
+			et.db_dropped++;
+			return;
+		}
+		db_kept = *ep;
+		db_kept_ts = now;
+		db_have_held = 0;
+	} else if (et.deadband) {
+		db_kept = *ep;
+		db_kept_ts = now;
+	}
+	store_at(ep, &now);
+}
+
+/*
+ * the readings after the last one stored with a deadband were left out,
+ * so store the last of them: the stored readings have to reach the end
+ * of the measurement for the energy to come out the same
+ */
+ static void
+store_held(void)
+{
+	if (db_have_held) {
+		store_at(&db_held, &db_held_ts);
+		db_have_held = 0;
+		et.db_dropped--;
+	}
+}
+
+
+/*
+ * with adaptive sampling, pick the period for the next reading given how
+ * much the watts just moved.  any real change goes straight to the fast
+ * rate; after ADAPT_STEADY quiet readings in a row, the period doubles,
+ * up to the slow rate.
+ */
+ static long
+adapt_period(long period, float dwatts)
+{
+	if (dwatts < 0) {
+		dwatts = -dwatts;
+	}
+	if (dwatts > et.adapt_watts) {
+		et.steady = 0;
+		return ADAPT_FAST_NS;
+	}
+	if (++et.steady < ADAPT_STEADY) {
+		return period;
+	}
+	et.steady = 0;
+	period *= 2;
+	return (period > ADAPT_SLOW_NS) ? ADAPT_SLOW_NS : period;
 }
 
+/*
+ * sleep until it's time for the next reading, a period on from the last
+ */
+ static void
+wait_period(struct timespec *deadline, long period)
+{
+	struct timespec tv, now;
+	long late;
+
+	tv.tv_sec = period / 1000000000;
+	tv.tv_nsec = period % 1000000000;
+	if (et.rt_prio || et.low_overhead || et.deadband) {
+		/*
+		 * realtime: sleep to absolute deadlines, so the time spent
+		 * reading doesn't push every later reading back, and keep
+		 * track of how late each period gets going.  low overhead
+		 * sleeps to them too, for the same reason, and so does the
+		 * deadband, since the readings it leaves out are filled back
+		 * in at the period.
+		 */
+		deadline->tv_sec += tv.tv_sec;
+		deadline->tv_nsec += tv.tv_nsec;
+		if (deadline->tv_nsec >= 1000000000) {
+			deadline->tv_nsec -= 1000000000;
+			deadline->tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		late = ((now.tv_sec - deadline->tv_sec) * 1000000000L) +
+			(now.tv_nsec - deadline->tv_nsec);
+		if (et.rt_prio) {
+			et.rt_periods++;
+			if (late > RT_SLACK_NS) {
+				et.rt_misses++;
+			}
+			if (late > et.rt_worst_ns) {
+				et.rt_worst_ns = late;
+			}
+		}
+		if (late > period) {
+			/* a whole period behind, don't try to catch up */
+			*deadline = now;
+		}
+	} else {
+		nanosleep(&tv, NULL);
+	}
+}
 
 /*
  * the function that runs in the readings thread: a loop reading the
@@ -508,48 +1009,134 @@ store_reading(struct epacket *ep)
 sample(void)
 {
 	ssize_t ret;
-	struct timespec tv;
+	struct timespec deadline, now, trig;
+	long period;
+	int n = 0;
+	int64_t now_ns;
+	union sigval sv;
 	struct epacket rp, *pp;
-	double inter;
+	struct reading sr;
 
-	inter = 0.0;
 	/*
-	 * take a reading 2.5 times a second
+	 * take a reading 2.5 times a second, or as fast as the meter can be
+	 * asked while the watts are moving if sampling is adaptive
 	 */
-	tv.tv_sec = 0;
-	tv.tv_nsec = 400000000;
+	period = et.adapt_watts > 0 ? ADAPT_FAST_NS : SAMPLE_PERIOD_NS;
+	et.steady = 0;
+	et.last_ns = -1;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
 	while (!et.end_thread) {
-		nanosleep(&tv, NULL);
-		/* trigger the extech to send data */
-		ret = write(et.fd, " ", 1);
-		if (ret < 0) {
-			continue;
+		/* the first reading is taken right away, not a period in */
+		if (n++) {
+			wait_period(&deadline, period);
 		}
+		if (have_attach_rp) {
+			/* the attach handshake already got it */
+			rp = attach_rp;
+			have_attach_rp = 0;
+		} else {
+			/* trigger the extech to send data */
+			clock_gettime(CLOCK_MONOTONIC, &trig);
+			ret = write(et.fd, " ", 1);
+			if (ret < 0) {
+				continue;
+			}
+			STAT_INC(triggers);
 
-		inter = inter + ((double)tv.tv_nsec / 1000000000.);
+			if (et.low_overhead) {
+				pp = read_whole(&trig);
+			} else {
+				/* why 200?  why not 20? or 250? */
+				pp = extech_read(et.fd, 200);
+			}
+			/*
+			 * if the read/decode failed, then go with the last packet
+			 * again.  if there hasn't been a successful packet yet, it
+			 * will be all zeroes.
+			 */
+			if (pp) {
+				rp = *pp;
+			} else {
+				/*
+				 * possibly some sort of error msg about bad packet index.
+				 * in low overhead mode, a late piece of this one mustn't
+				 * be taken for the start of the next.
+				 */
+				if (et.low_overhead) {
+					tcflush(et.fd, TCIFLUSH);
+				}
+				continue;
+			}
+			rp.trig_ts = trig;
+			measured_at(&rp);
+		}
 
-		pp = extech_read(et.fd, 200);  /* why 200?  why not 20? or 250? */
 		/*
-		 * if the read/decode failed, then go with the last packet again.
-		 * if there hasn't been a successful packet yet, it will be all zeroes.
+		 * et.sum is therefore the running number of joules.  the period
+		 * isn't fixed, so it's the watts of the last reading times the
+		 * time that has actually gone by since it, same as the storefile
+		 * summaries work it out.
 		 */
-		if (pp) {
-			rp = *pp;
-		} else {
-			/* possibly some sort of error msg about bad packet index */
-			continue;
+		now_ns = ((int64_t)rp.ts.tv_sec * 1000000000) + rp.ts.tv_nsec;
+		if (et.last_ns >= 0) {
+			et.sum += (double)et.last_watts * ((now_ns - et.last_ns) / 1e9);
+			if (et.adapt_watts > 0) {
+				period = adapt_period(period, rp.watts - et.last_watts);
+			}
 		}
-
-		/* et.sum is therefore the running number of joules */
-		et.sum += (double)rp.watts * inter;
-		inter = 0.0;
+		et.last_ns = now_ns;
+		et.last_watts = rp.watts;
 		et.samples++;
+		__atomic_store(&stats.watts, &rp.watts, __ATOMIC_RELAXED);
+		__atomic_store(&stats.joules, &et.sum, __ATOMIC_RELAXED);
 
 		/*
 		 * rs will be total number of {read attempts, values} stored; samples
 		 * will be total number of meaningful readings
 		 */
 		store_reading(&rp);
+
+		/*
+		 * and every reading, stored or not, to the sinks.  after it's
+		 * stored, so startclk is set before any sink sees one.
+		 */
+		sr.tstamp = rp.ts;
+		sr.watts = rp.watts;
+		sr.pf = rp.pf;
+		sr.volts = rp.volts;
+		sr.amps = rp.amps;
+		sink_put(&sr);
+		alert_check(&sr);
+
+		/*
+		 * flight recorder: going over the threshold is a trigger, and
+		 * the main line gets told which reading did it
+		 */
+		if (et.trig_watts > 0) {
+			if ((rp.watts >= et.trig_watts) && (et.trig_above == 0)) {
+				sv.sival_int = rs;
+				sigqueue(getpid(), SIGUSR2, sv);
+			}
+			et.trig_above = (rp.watts >= et.trig_watts);
+		}
+
+		/*
+		 * let the main line know a batch of readings has piled up
+		 */
+		if (et.notify_every && (rs - et.notified >= et.notify_every)) {
+			et.notified = rs;
+			sv.sival_int = rs;
+			sigqueue(getpid(), SIGUSR2, sv);
+		}
+	}
+
+	store_held();
+
+	/* the last reading holds until the end of the measurement */
+	if (et.last_ns >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		now_ns = ((int64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+		et.sum += (double)et.last_watts * ((now_ns - et.last_ns) / 1e9);
 	}
 }
 
@@ -559,7 +1146,11 @@ sample(void)
  void *
 thread_proc(void *arg)
 {
+	if (et.low_overhead) {
+		prctl(PR_SET_TIMERSLACK, LO_TIMER_SLACK_NS, 0, 0, 0);
+	}
 	sample();
+	overhead_thread_done("sampler");
 	return 0;
 }
 
@@ -587,11 +1178,6 @@ end_measurement(void)
 		measure();
 	}
 
-#ifdef EXTECH_DEBUG_PROTO
-	fprintf(dfile, "\n");
-	fclose(dfile);
-#endif
-
 	debugp("number of readings saved: %d", rs);
 }
 
@@ -601,12 +1187,158 @@ end_measurement(void)
  void
 start_measurement(void)
 {
+	pthread_attr_t attr;
+	struct sched_param sp;
+	cpu_set_t cpus;
+	int ret;
+
 	et.end_thread = 0;
 	et.sum = et.samples = 0;
 
-	if (pthread_create(&et.thread, NULL, thread_proc, "GO")) {
+	pthread_attr_init(&attr);
+	if (et.rt_prio) {
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		sp.sched_priority = et.rt_prio;
+		pthread_attr_setschedparam(&attr, &sp);
+		if (et.rt_cpu >= 0) {
+			CPU_ZERO(&cpus);
+			CPU_SET(et.rt_cpu, &cpus);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+		}
+	}
+
+	ret = pthread_create(&et.thread, &attr, thread_proc, "GO");
+	if (ret && et.rt_prio) {
+		/*
+		 * most likely EPERM, for not having CAP_SYS_NICE.  a measurement
+		 * with some jitter beats no measurement at all.
+		 */
+		fprintf(stderr, "realtime sampling thread creation failed: %s.  "
+			"sampling without it\n", strerror(ret));
+		et.rt_prio = 0;
+		ret = pthread_create(&et.thread, NULL, thread_proc, "GO");
+	}
+	if (ret) {
 		fprintf(stderr, "ERROR: extech measurement thread creation failed\n");
 	}
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * have the sampling thread run SCHED_FIFO at priority prio, pinned to
+ * cpu if cpu isn't negative.  has to be called before start_measurement().
+ */
+ void
+extech_realtime(int prio, int cpu)
+{
+	et.rt_prio = prio;
+	et.rt_cpu = cpu;
+}
+
+/*
+ * only store readings where watts, pf, volts or amps moved by more than
+ * tol[0..3] since the last one stored, plus a keyframe every
+ * DB_KEYFRAME_SECS.  readings are taken on absolute deadlines, so the
+ * ones left out were SAMPLE_PERIOD_NS apart.  has to be called before
+ * start_measurement().
+ */
+ void
+extech_deadband(const float *tol)
+{
+	memcpy(et.db_tol, tol, sizeof(et.db_tol));
+	et.deadband = 1;
+}
+
+/*
+ * flight recorder mode: the readings store is a ring, overwritten
+ * forever, and when a reading reaches watts (if watts isn't 0) a SIGUSR2
+ * is queued to the process with sival_int set to rs just after storing
+ * it.  SIGUSR2 should be blocked in all threads, and taken with
+ * sigwaitinfo() or the like.  has to be called before start_measurement().
+ */
+ void
+extech_flight(float watts)
+{
+	et.ring = 1;
+	et.trig_watts = watts;
+	et.trig_above = -1;	/* the first reading can't cross over anything */
+}
+
+/*
+ * queue a SIGUSR2 to the process every n readings stored, with sival_int
+ * set to rs, like the flight recorder trigger.  has to be called before
+ * start_measurement().
+ */
+ void
+extech_notify(int n)
+{
+	et.notify_every = n;
+	et.notified = 0;
+}
+
+/*
+ * keep the sampling thread's wakeups down to two a reading, the timer
+ * for the trigger and the timer for the answer to be all in, see
+ * read_whole(), with absolute deadlines and some timer slack.  has to
+ * be called before extech_power_meter().
+ */
+ void
+extech_low_overhead(void)
+{
+	et.low_overhead = 1;
+}
+
+/*
+ * a snapshot of the acquisition counters
+ */
+ void
+ex_get_stats(struct ex_stats *st)
+{
+	st->triggers = __atomic_load_n(&stats.triggers, __ATOMIC_RELAXED);
+	st->frames_ok = __atomic_load_n(&stats.frames_ok, __ATOMIC_RELAXED);
+	st->bad_bookends = __atomic_load_n(&stats.bad_bookends, __ATOMIC_RELAXED);
+	st->bad_digits = __atomic_load_n(&stats.bad_digits, __ATOMIC_RELAXED);
+	st->short_reads = __atomic_load_n(&stats.short_reads, __ATOMIC_RELAXED);
+	st->timeouts = __atomic_load_n(&stats.timeouts, __ATOMIC_RELAXED);
+	st->read_errors = __atomic_load_n(&stats.read_errors, __ATOMIC_RELAXED);
+	st->dropped = __atomic_load_n(&stats.dropped, __ATOMIC_RELAXED);
+	st->first_sample_ns = __atomic_load_n(&stats.first_sample_ns,
+		__ATOMIC_RELAXED);
+	__atomic_load(&stats.watts, &st->watts, __ATOMIC_RELAXED);
+	__atomic_load(&stats.joules, &st->joules, __ATOMIC_RELAXED);
+}
+
+/*
+ * how many readings the deadband left out
+ */
+ long
+ex_deadband_dropped(void)
+{
+	return et.db_dropped;
+}
+
+/*
+ * sample adaptively: fast while the watts move by more than watts from
+ * one reading to the next, backing off to slow when they don't.  0 turns
+ * it off.  has to be called before start_measurement().
+ */
+ void
+extech_adaptive(float watts)
+{
+	et.adapt_watts = watts;
+}
+
+/*
+ * how the realtime sampling thread did keeping to its schedule.  returns
+ * the number of sampling periods that started late.
+ */
+ long
+ex_deadline_misses(long *periods, long *worst_ns)
+{
+	*periods = et.rt_periods;
+	*worst_ns = et.rt_worst_ns;
+	return et.rt_misses;
 }
 
 
@@ -29,13 +29,12 @@
 #define _EXTECH_H
 
 #include <pthread.h>
+#include <stdint.h>
 #include "measurement.h"
 
 
 #define DEBUG
 #undef DEBUG
-#define EXTECH_DEBUG_PROTO 1
-#undef EXTECH_DEBUG_PROTO
 
 #ifdef DEBUG
 # define debugp(A, B...) fprintf(stderr, A "\n", B)
@@ -49,10 +48,43 @@
  */
 #define ISPOINTER(A) ((unsigned long long)(A) > 0x1000ULL)
 
+#define SAMPLE_PERIOD_NS 400000000L	/* sampling period, unless adaptive */
+
+/*
+ * adaptive sampling periods.  a trigger and its 20 byte answer take about
+ * 25ms at 9600 baud, but the meter only updates its readings a few times
+ * a second, so asking faster than the fast period gets repeats.
+ */
+#define ADAPT_FAST_NS 100000000L
+#define ADAPT_SLOW_NS 2000000000L
+#define ADAPT_STEADY 4	/* quiet readings before the period doubles */
+
+/*
+ * time on the wire at 9600 baud, 8N1: ten bits a byte
+ */
+#define EXTECH_CHAR_NS 1041667L
+#define EXTECH_FRAME_NS (20 * EXTECH_CHAR_NS)
+
+#define DB_KEYFRAME_SECS 60	/* deadband: store a reading at least this often */
+
+struct ex_stats;
+
 extern int extech_power_meter(const char *_dev_name);
 extern double ex_joules_consumed(void);
 extern void start_measurement(void);
 extern void end_measurement(void);
+extern void extech_realtime(int prio, int cpu);
+extern long ex_deadline_misses(long *periods, long *worst_ns);
+extern void extech_adaptive(float watts);
+extern void extech_deadband(const float *tol);
+extern long ex_deadband_dropped(void);
+extern void extech_flight(float watts);
+extern void extech_notify(int n);
+extern void extech_low_overhead(void);
+extern void ex_get_stats(struct ex_stats *st);
+
+extern int decode_extech_value(unsigned char byt3, unsigned char byt4, char *a);
+extern int extech_decode_word(unsigned short word, float *val);
 
 struct power_meter {
 	char dev_name[128];
@@ -63,6 +95,53 @@ struct power_meter {
 	int samples;
 	int end_thread;
 	pthread_t thread;
+
+	/* realtime sampling, see extech_realtime() */
+	int rt_prio;
+	int rt_cpu;
+	long rt_periods;
+	long rt_misses;
+	long rt_worst_ns;
+
+	/* adaptive sampling, see extech_adaptive() */
+	float adapt_watts;
+	int steady;			/* quiet readings in a row */
+	int64_t last_ns;	/* monotonic time of the last reading */
+	float last_watts;
+
+	/* deadband storage, see extech_deadband() */
+	int deadband;
+	float db_tol[4];	/* watts, pf, volts, amps */
+	long db_dropped;
+
+	/* flight recorder, see extech_flight() */
+	int ring;
+	float trig_watts;
+	int trig_above;
+
+	/* see extech_notify() */
+	int notify_every;
+	int notified;
+
+	/* see extech_low_overhead() */
+	int low_overhead;
+};
+
+/*
+ * what the sampling thread has been up to, see ex_get_stats()
+ */
+struct ex_stats {
+	unsigned long triggers;		/* spaces sent to the meter */
+	unsigned long frames_ok;	/* readings read and decoded */
+	unsigned long bad_bookends;	/* blocks not 02 .. 03 */
+	unsigned long bad_digits;	/* values that failed conversion */
+	unsigned long short_reads;	/* reads of less than a reading */
+	unsigned long timeouts;		/* no answer from the meter */
+	unsigned long read_errors;
+	unsigned long dropped;		/* readings that didn't fit in the store */
+	int64_t first_sample_ns;	/* process start to the first good reading */
+	float watts;				/* the last reading */
+	double joules;				/* so far */
 };
 
 struct reading {
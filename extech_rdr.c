@@ -36,9 +36,18 @@
 #include <getopt.h>
 #include <string.h>
 #include <signal.h>
+#include <sched.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include "extech.h"
+#include "storefile.h"
+#include "rollup.h"
+#include "capture.h"
+#include "metrics.h"
+#include "sink.h"
+#include "alert.h"
+#include "overhead.h"
 
 #define MAX_MPERIOD 3600 /* maximum number of seconds for a run */
 
@@ -50,6 +59,27 @@ char **argvec;
 int storefile_opt = 0; /* means store readings to a file */
 int maxv = 0; /* process the input file; only output the max's of each field */
 int helpout = 0; /* output basic help text */
+int raw_opt = 0; /* store the raw meter words, in a v2 storefile */
+int rollup_opt = 0; /* write a rollup sidecar next to the storefile */
+int realtime_opt = 0; /* sample from a SCHED_FIFO thread, memory locked */
+int rt_cpu = -1; /* cpu to pin the sampling thread to, if any */
+int adaptive_opt = 0; /* sample fast while the watts move, slow when not */
+float adapt_watts = 0.5; /* how much they have to move */
+int deadband_opt = 0; /* only store readings that changed */
+float db_tol[4]; /* by more than this: watts, pf, volts, amps */
+int flight_opt = 0; /* keep a ring of readings, dump it on a trigger */
+int trigger_opt = 0; /* flight recorder trigger on watts */
+int pre_secs, post_secs; /* how much of the ring goes in a dump */
+float trig_watts;
+int log_opt = 0; /* write the storefile as a checksummed log as we go */
+int log_secs = 5; /* sync the log at least this often */
+int log_batch = 50; /* or every this many readings */
+int capture_opt = 0; /* capture the raw reads from the meter to a file */
+int metrics_opt = 0; /* serve acquisition metrics */
+int columns_opt = 0; /* write the storefile as columns */
+int sink_opt = 0; /* readings go to sinks as they're taken too */
+int alert_opt = 0; /* rules checked against each reading */
+int low_overhead_opt = 0; /* as few wakeups of our own as can be */
 
 struct option er_opts[] = {
 	{
@@ -70,6 +100,90 @@ struct option er_opts[] = {
 		&helpout,
 		1
 	},
+	{
+		"raw",
+		no_argument,
+		&raw_opt,
+		1
+	},
+	{
+		"rollup",
+		no_argument,
+		&rollup_opt,
+		1
+	},
+	{
+		"realtime",
+		optional_argument,
+		&realtime_opt,
+		1
+	},
+	{
+		"adaptive",
+		optional_argument,
+		&adaptive_opt,
+		1
+	},
+	{
+		"deadband",
+		optional_argument,
+		&deadband_opt,
+		1
+	},
+	{
+		"flight",
+		required_argument,
+		&flight_opt,
+		1
+	},
+	{
+		"trigger",
+		required_argument,
+		&trigger_opt,
+		1
+	},
+	{
+		"log",
+		optional_argument,
+		&log_opt,
+		1
+	},
+	{
+		"capture",
+		required_argument,
+		&capture_opt,
+		1
+	},
+	{
+		"metrics",
+		required_argument,
+		&metrics_opt,
+		1
+	},
+	{
+		"columns",
+		no_argument,
+		&columns_opt,
+		1
+	},
+	{
+		"sink",
+		required_argument,
+		&sink_opt,
+		1
+	},
+	{
+		"alert",
+		required_argument,
+		&alert_opt,
+		1
+	},
+	{
+		"low-overhead",
+		no_argument,
+		&low_overhead_opt,
+		1
+	},
 	{}
 };
 
@@ -92,6 +206,106 @@ char *opt_help[] = {
 
 "	Output this help message.",
 
+"	Store the readings as the raw encoded words the meter sent, plus a\n"
+"	32 bit time delta and when the trigger was written and the reading\n"
+"	read, in a version 2 storefile: 16 bytes per reading instead of 32.\n"
+"	The words are decoded when the file is read, so a run can be\n"
+"	decoded again later with a fixed decoder.",
+
+"	Along with the storefile, write <storefile>.rollup: the watts summed\n"
+"	up into 1s, 10s, 1m, 10m and 1h buckets (min/max/mean/energy), for\n"
+"	looking at long runs zoomed out.  See readings-rollup.",
+
+"	Run the sampling thread SCHED_FIFO, on absolute 400ms deadlines, with\n"
+"	all memory locked and the readings store faulted in up front, so page\n"
+"	faults and other processes don't delay readings.  If a cpu number is\n"
+"	given, the sampling thread is pinned to it.  Needs root or\n"
+"	CAP_SYS_NICE and CAP_IPC_LOCK; without them it warns and samples\n"
+"	normally.  Deadline misses are reported at the end.",
+
+"	Instead of a reading every 400ms, take one every 100ms while the watts\n"
+"	change by more than the argument (default 0.5) from one reading to\n"
+"	the next, and back off, doubling the period every 4 quiet readings,\n"
+"	to one every 2s while they hold steady.  Every reading keeps its own\n"
+"	timestamp, so energy comes out right either way.",
+
+"	Only store a reading when watts, pf, volts or amps changed since the\n"
+"	last one stored, plus one a minute regardless and the last one.  The\n"
+"	argument is <watts>[,<pf>[,<volts>[,<amps>]]], how much each has to\n"
+"	change by; by default any change at all.  Each stored reading holds\n"
+"	until the next, so with the default the energy is exactly what it\n"
+"	would have been.  Written as a version 2 storefile, which\n"
+"	readings-dat2ascii expands back out to every reading.",
+
+"	Flight recorder: keep only the last few minutes of readings, in a\n"
+"	ring in memory, and store nothing until triggered, by SIGUSR2 or by\n"
+"	the watts reaching --trigger.  Then <pre> seconds of readings before\n"
+"	the trigger and <post> seconds after it (default the same as pre)\n"
+"	are saved to <storefile>.NNN, a new file for each trigger.  The\n"
+"	argument is <pre>[,<post>].  Not with --raw or --deadband.  With\n"
+"	nseconds 0, runs until SIGUSR1, SIGINT or SIGTERM, however long\n"
+"	that is.",
+
+"	For --flight, trigger whenever the watts go from below this to at\n"
+"	or above it.",
+
+"	Write the storefile while measuring instead of at the end, as a\n"
+"	log of blocks with a CRC32C each, synced to disk every <secs> seconds\n"
+"	or <readings> readings, whichever comes first.  The argument is\n"
+"	<secs>[,<readings>], default 5,50.  After a crash or power cut, the\n"
+"	readings up to the last sync are all there, and a torn block at the\n"
+"	end is ignored; readings-query --index cuts it off for good.",
+
+"	Capture every read from the serial port, byte for byte, with the\n"
+"	time of the read, to the file given, appending to it if it's there.\n"
+"	For figuring out what the meter actually sent when something looks\n"
+"	wrong.  The writing is done off the sampling thread, so it doesn't\n"
+"	get in the way of the readings.  See extech-capture.",
+
+"	Serve metrics in the Prometheus text format over HTTP while\n"
+"	measuring: counts of readings asked for, read ok, bad bookends, bad\n"
+"	digits, short reads, timeouts and readings dropped, plus the current\n"
+"	watts and the joules so far, and with --alert, the alerts gone off\n"
+"	and hooks run and how long the hooks took to start.  The argument\n"
+"	is a port number, to listen on 127.0.0.1, or the path of a unix\n"
+"	socket.",
+
+"	Store the readings in a version 2 storefile laid out as columns:\n"
+"	all the timestamps, then all the watts, and so on, so a program\n"
+"	that only wants one field only reads that field.  Not for --raw,\n"
+"	--flight or --log, which store whole readings as they go.",
+
+"	Send every reading, as it's taken, to a sink as well: stats (min,\n"
+"	mean, max and stddev of the watts, output at the end), display (the\n"
+"	latest reading on stderr), socket:<port|path> (lines of text in a\n"
+"	datagram to a localhost UDP port or a unix socket), file:<path> (a\n"
+"	version 2 storefile written as the readings come in) or\n"
+"	segments[:<watts>] (segments of steady power on stdout as each one\n"
+"	ends, see readings-segments).  Can be given more than once.  The\n"
+"	sinks are fed from their own thread, so they don't slow down the\n"
+"	sampling, whatever they do.",
+
+"	Check a rule against every reading as it's taken, and when it goes\n"
+"	off, say so on stderr and run the command, if there is one, with\n"
+"	/bin/sh.  The argument is <rule>[:<command>], the rule being\n"
+"	<field><op><limit>[/<n>]: field is watts, pf, volts, amps or rate\n"
+"	(watts per second since the last reading), op is > or <, and it\n"
+"	has to hold for n readings in a row, default 1.  E.g.\n"
+"	--alert='watts>1500/3:shed-load' or --alert='rate<-200'.  It goes\n"
+"	off once, then not again until it's stopped holding.  The command\n"
+"	gets EXTECH_ALERT, EXTECH_VALUE, EXTECH_WATTS and EXTECH_TIME in\n"
+"	its environment, and is run by a helper process, so the sampling\n"
+"	never waits on it.  Can be given more than once.",
+
+"	Keep this program's own wakeups, which land in the readings when it\n"
+"	runs on the machine being measured, to about two a reading: the\n"
+"	timer to ask for the next one and the timer for the meter's answer\n"
+"	to be all in, read in one go instead of as it trickles in.  The\n"
+"	sinks and the capture writer wake every 2s instead of a few times a\n"
+"	second, so --sink=display lags that much.  What the program cost in\n"
+"	CPU time and wakeups, thread by thread, is output at the end either\n"
+"	way.",
+
 	NULL,
 };
 
@@ -174,11 +388,23 @@ is_rdev(char *dname)
 struct reading *rsp;
 
 struct reading readings_store[RS_NELEMENTS];
+struct sf_rawrec raw_store[RS_NELEMENTS]; /* used instead with --raw */
+extern struct sf_rawrec *rrp;
+
+/*
+ * and as columns when whole readings aren't needed as they come in,
+ * which is when they aren't going into a --flight ring or a --log
+ */
+int64_t col_ns_store[RS_NELEMENTS];
+float col_store[COL_NFIELDS][RS_NELEMENTS];
+struct columns col_rs;
+extern struct columns *rcp;
 
 int rs_nelems;
 extern int rs;  /* write index into the readings_store array */
 
 struct timespec startclk;
+struct timespec startmono;
 
 int usr1sigrcv = 0;
 
@@ -200,6 +426,323 @@ struct sigaction usr1sigact = {
 	sa_flags : SA_SIGINFO
 };
 
+/*
+ * the signals the flight and log recorders take with sigtimedwait().  they're
+ * blocked in main() before any other thread is started, so every thread
+ * has them blocked, or one of them could get a SIGUSR2 from the
+ * sampling thread and die of it.
+ */
+sigset_t rec_sigs;
+
+
+/*
+ * how long it took from starting up to having a reading
+ */
+ static void
+report_first_sample(void)
+{
+	struct ex_stats st;
+
+	ex_get_stats(&st);
+	if (st.first_sample_ns) {
+		printf("first reading %.1fms after start\n", st.first_sample_ns / 1e6);
+	} else {
+		printf("no good readings from the meter\n");
+	}
+}
+
+
+/*
+ * flight recorder
+ */
+#define FLIGHT_SLACK_SECS 60 /* ring beyond the pre and post windows */
+
+ static int64_t
+ts_ns(const struct timespec *ts)
+{
+	return ((int64_t)ts->tv_sec * 1000000000) + ts->tv_nsec;
+}
+
+/*
+ * save the readings in the ring from pre_secs before trig_ns to post_secs
+ * after it to a new storefile
+ */
+ static int
+flight_dump(const char *base, int n, int64_t trig_ns)
+{
+	struct sf_writer sw;
+	char path[1100];
+	int end, first, start, stop, x, len;
+	int rc;
+
+	/*
+	 * readings up to end are all in.  the oldest ones could be getting
+	 * overwritten, but the ring has FLIGHT_SLACK_SECS more in it than
+	 * the windows, so the ones wanted aren't.
+	 */
+	end = __atomic_load_n(&rs, __ATOMIC_ACQUIRE);
+	first = (end > rs_nelems) ? end - rs_nelems : 0;
+	for (start = end; start > first; start--) {
+		if (ts_ns(&rsp[(start - 1) % rs_nelems].tstamp) <
+			trig_ns - (pre_secs * 1000000000LL)) {
+			break;
+		}
+	}
+
+	for (stop = start; stop < end; stop++) {
+		if (ts_ns(&rsp[stop % rs_nelems].tstamp) >
+			trig_ns + (post_secs * 1000000000LL)) {
+			break;
+		}
+	}
+
+	/* the window can wrap around the end of the ring */
+	snprintf(path, sizeof(path), "%s.%03d", base, n);
+	rc = sf_create(&sw, path, SF_LAYOUT_READING, &startclk, &startmono);
+	for (x = start; (rc == 0) && (x < stop); x += len) {
+		len = rs_nelems - (x % rs_nelems);
+		if (len > stop - x) {
+			len = stop - x;
+		}
+		rc = sf_append(&sw, &rsp[x % rs_nelems], len);
+	}
+	if (sw.fd >= 0) {
+		rc = sf_finish(&sw) ?: rc;
+	}
+	if (rc) {
+		fprintf(stderr, "saving readings to '%s' failed.  errno=%d\n", path,
+			rc);
+	} else {
+		printf("saved %ld readings to %s\n", sw.nrecs, path);
+	}
+
+	return rc;
+}
+
+/*
+ * run the measurement as a flight recorder: nothing is stored but the
+ * ring until a trigger, then once the post trigger window has gone by,
+ * the readings around the trigger are dumped.  triggers that come while
+ * a dump is pending are part of that dump.  the signals are all taken
+ * here with sigtimedwait(), see rec_sigs.
+ */
+ static int
+flight_recorder(const char *base, int mperiod)
+{
+	siginfo_t si;
+	struct timespec now, tmo;
+	int64_t end_ns = INT64_MAX;
+	int64_t trig_ns = 0;
+	int64_t wait_ns;
+	int pending = 0;
+	int ndumps = 0;
+	int sig;
+
+	printf("flight recorder running, %ds before and %ds after a trigger",
+		pre_secs, post_secs);
+	if (mperiod) {
+		printf(", for %ds", mperiod);
+	}
+	printf("...\n");
+	fflush(stdout);
+
+	start_measurement();
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	if (mperiod) {
+		end_ns = ts_ns(&now) + (mperiod * 1000000000LL);
+	}
+
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+		if (pending && (ts_ns(&now) >= trig_ns + (post_secs * 1000000000LL))) {
+			flight_dump(base, ++ndumps, trig_ns);
+			pending = 0;
+		}
+		if (ts_ns(&now) >= end_ns) {
+			break;
+		}
+		wait_ns = pending ? trig_ns + (post_secs * 1000000000LL) : end_ns;
+		wait_ns = (wait_ns < end_ns ? wait_ns : end_ns) - ts_ns(&now);
+		if (wait_ns > 3600 * 1000000000LL) {
+			wait_ns = 3600 * 1000000000LL;
+		}
+		tmo.tv_sec = wait_ns / 1000000000;
+		tmo.tv_nsec = wait_ns % 1000000000;
+		sig = sigtimedwait(&rec_sigs, &si, &tmo);
+		if ((sig == SIGUSR1) || (sig == SIGINT) || (sig == SIGTERM)) {
+			break;
+		}
+		if ((sig != SIGUSR2) || pending) {
+			continue;
+		}
+		/*
+		 * the sampling thread says which reading went over the
+		 * threshold; a SIGUSR2 from outside is a trigger right now
+		 */
+		if ((si.si_code == SI_QUEUE) && (si.si_value.sival_int > 0)) {
+			trig_ns = ts_ns(&rsp[(si.si_value.sival_int - 1) % rs_nelems].tstamp);
+			printf("triggered at %g watts\n",
+				rsp[(si.si_value.sival_int - 1) % rs_nelems].watts);
+		} else {
+			clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+			trig_ns = ts_ns(&now);
+			printf("triggered by signal\n");
+		}
+		fflush(stdout);
+		pending = 1;
+	}
+
+	/* a trigger right before the end gets whatever post window there is */
+	if (pending) {
+		flight_dump(base, ++ndumps, trig_ns);
+	}
+	end_measurement();
+
+	printf("watt-hours consumed: %g\n", ex_joules_consumed());
+	report_first_sample();
+	printf("%d triggers dumped\n", ndumps);
+
+	return 0;
+}
+
+
+/*
+ * log storefile
+ */
+struct sf_writer log_w;
+const char *log_path;
+int log_done; /* readings written to the log so far */
+
+/*
+ * write whatever readings have come in since last time as a block, and
+ * sync it, header and all, in one go
+ */
+ static int
+log_commit(void)
+{
+	int end;
+	int rc;
+
+	end = __atomic_load_n(&rs, __ATOMIC_ACQUIRE);
+	if (end == log_done) {
+		return 0;
+	}
+	if (log_done == 0) {
+		/* the sampling thread set these when it stored the first one */
+		log_w.hdr.startclk = startclk;
+		log_w.hdr.startmono = startmono;
+	}
+	rc = sf_append(&log_w, raw_opt ? (void *)&rrp[log_done] :
+		(void *)&rsp[log_done], end - log_done);
+	if (rc == 0) {
+		rc = sf_log_sync(&log_w);
+	}
+	if (rc) {
+		fprintf(stderr, "writing log '%s' failed.  errno=%d\n", log_path, rc);
+		return rc;
+	}
+	log_done = end;
+
+	return 0;
+}
+
+/*
+ * measure for mperiod seconds, or until SIGUSR1/SIGINT/SIGTERM, committing
+ * the readings to the log every log_secs seconds, or sooner when the
+ * sampling thread says log_batch of them have piled up
+ */
+ static int
+log_recorder(int mperiod)
+{
+	struct timespec now, tmo;
+	int64_t end_ns, next_ns, wait_ns;
+	int sig;
+	int rc = 0;
+
+	extech_notify(log_batch);
+	start_measurement();
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	end_ns = ts_ns(&now) + (mperiod * 1000000000LL);
+	next_ns = ts_ns(&now) + (log_secs * 1000000000LL);
+
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+		if (ts_ns(&now) >= end_ns) {
+			break;
+		}
+		wait_ns = ((next_ns < end_ns) ? next_ns : end_ns) - ts_ns(&now);
+		if (wait_ns > 0) {
+			tmo.tv_sec = wait_ns / 1000000000;
+			tmo.tv_nsec = wait_ns % 1000000000;
+			sig = sigtimedwait(&rec_sigs, NULL, &tmo);
+			if ((sig == SIGUSR1) || (sig == SIGINT) || (sig == SIGTERM)) {
+				printf("stopped by signal\n");
+				break;
+			}
+		}
+		rc = log_commit() ?: rc;
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+		next_ns = ts_ns(&now) + (log_secs * 1000000000LL);
+	}
+
+	end_measurement();
+	rc = log_commit() ?: rc;
+
+	return rc;
+}
+
+/*
+ * the column store's readings as struct readings, a chunk at a time,
+ * for the storefile layouts that want them that way.  returns 0 on
+ * success, or the first error put returns.
+ */
+ static int
+put_rows(int (*put)(void *arg, const struct reading *r, long n), void *arg)
+{
+	static struct reading buf[1024];
+	long i, n, rx;
+	int rc;
+
+	for (i = 0; i < rs; i += n) {
+		n = (rs - i < 1024) ? rs - i : 1024;
+		for (rx = 0; rx < n; rx++) {
+			col_get(rcp, i + rx, &buf[rx]);
+		}
+		rc = put(arg, buf, n);
+		if (rc) {
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+ static int
+append_rows(void *arg, const struct reading *r, long n)
+{
+	return sf_append(arg, r, n);
+}
+
+ static int
+write_rows(void *arg, const struct reading *r, long n)
+{
+	return sf_write_all(*(int *)arg, r, n * sizeof(*r));
+}
+
+/*
+ * let the sinks finish up, and say if they missed any readings
+ */
+ static void
+stop_sinks(void)
+{
+	unsigned long n;
+
+	n = sink_stop();
+	if (n) {
+		printf("sinks missed %lu readings, they couldn't keep up\n", n);
+	}
+}
+
 
  int
 main(int argc, char **argv) {
@@ -208,9 +751,13 @@ main(int argc, char **argv) {
 	char storefile[1024];
 	int argx;
 	char *serialp;
+	char *capture_path = NULL;
+	char *metrics_where = NULL;
 	int mperiod;
+	int f;
 
 	argvec = argv;
+	overhead_start();
 
 	/*
 	 * process args
@@ -237,8 +784,61 @@ main(int argc, char **argv) {
 								" that's a no-no\n", storefile);
 						exit(1);
 					}
+				} else if (!strcmp(er_opts[argx].name, "flight")) {
+					rc = sscanf(optarg, "%d,%d", &pre_secs, &post_secs);
+					if (rc == 1) {
+						post_secs = pre_secs;
+					}
+					if ((rc < 1) || (pre_secs < 0) || (post_secs < 0) ||
+						(pre_secs + post_secs > MAX_MPERIOD)) {
+						usage(argx, "invalid pre/post trigger seconds");
+						exit(1);
+					}
+				} else if (!strcmp(er_opts[argx].name, "alert")) {
+					if (alert_add(optarg)) {
+						usage(argx, "can't make sense of the rule, or too many");
+						exit(1);
+					}
+				} else if (!strcmp(er_opts[argx].name, "sink")) {
+					if (sink_add(optarg)) {
+						usage(argx, "unknown sink, or too many of them");
+						exit(1);
+					}
+				} else if (!strcmp(er_opts[argx].name, "metrics")) {
+					metrics_where = optarg;
+				} else if (!strcmp(er_opts[argx].name, "capture")) {
+					capture_path = optarg;
+				} else if (!strcmp(er_opts[argx].name, "log") && optarg) {
+					if ((sscanf(optarg, "%d,%d", &log_secs, &log_batch) < 1) ||
+						(log_secs <= 0) || (log_batch <= 0)) {
+						usage(argx, "invalid sync seconds/readings");
+						exit(1);
+					}
+				} else if (!strcmp(er_opts[argx].name, "trigger")) {
+					trig_watts = strtof(optarg, NULL);
+					if (trig_watts <= 0) {
+						usage(argx, "watts must be a positive number");
+						exit(1);
+					}
+				} else if (!strcmp(er_opts[argx].name, "deadband") && optarg) {
+					if (sscanf(optarg, "%f,%f,%f,%f", &db_tol[0], &db_tol[1],
+						&db_tol[2], &db_tol[3]) < 1) {
+						usage(argx, "tolerances must be numbers");
+						exit(1);
+					}
+				} else if (!strcmp(er_opts[argx].name, "adaptive") && optarg) {
+					adapt_watts = strtof(optarg, NULL);
+					if (adapt_watts <= 0) {
+						usage(argx, "watts must be a positive number");
+						exit(1);
+					}
+				} else if (!strcmp(er_opts[argx].name, "realtime") && optarg) {
+					rt_cpu = (int)strtol(optarg, NULL, 0);
+					if ((rt_cpu < 0) || (rt_cpu >= sysconf(_SC_NPROCESSORS_CONF))) {
+						usage(argx, "invalid cpu number");
+						exit(1);
+					}
 				}
-				/* else if {} */
 				break;
 		}
 	} while (rc != -1);
@@ -260,6 +860,25 @@ main(int argc, char **argv) {
 		exit(1);
 	}
 
+	if (flight_opt && (!storefile_opt || raw_opt || deadband_opt)) {
+		printf("error: --flight needs --storefile, and can't be used with "
+			"--raw or --deadband\n");
+		exit(1);
+	}
+	if (log_opt && (!storefile_opt || flight_opt)) {
+		printf("error: --log needs --storefile, and isn't for --flight\n");
+		exit(1);
+	}
+	if (trigger_opt && !flight_opt) {
+		printf("error: --trigger is for --flight\n");
+		exit(1);
+	}
+	if (columns_opt && (!storefile_opt || raw_opt || flight_opt || log_opt)) {
+		printf("error: --columns needs --storefile, and can't be used with "
+			"--raw, --flight or --log\n");
+		exit(1);
+	}
+
 	/*
 	 * get the serial port
 	 */
@@ -273,13 +892,23 @@ main(int argc, char **argv) {
 	 * get the measurement period
 	 */
 	mperiod = (int)strtol(argv[optind + 1], NULL, 0);
-	if ((mperiod > MAX_MPERIOD) || (mperiod < 0)) {
+	if (((mperiod > MAX_MPERIOD) && !flight_opt) || (mperiod < 0)) {
 		printf("measurement period '%d' outside allowable range of 0 - %d seconds\n"
 			"0 means measure until SIGUSR1 signal received (max %ds)\n",
 			MAX_MPERIOD, mperiod, MAX_MPERIOD);
 		exit(1);
 	}
-	if (mperiod == 0) {
+	if (flight_opt || log_opt) {
+		sigemptyset(&rec_sigs);
+		sigaddset(&rec_sigs, SIGUSR1);
+		sigaddset(&rec_sigs, SIGUSR2);
+		sigaddset(&rec_sigs, SIGINT);
+		sigaddset(&rec_sigs, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &rec_sigs, NULL);
+	}
+	if (flight_opt) {
+		/* flight_recorder() takes its signals, see rec_sigs */
+	} else if (mperiod == 0) {
 		mperiod = MAX_MPERIOD; /* 1 hour */
 		/*
 		 * probably easier to just use siginterrupt(3) instead
@@ -297,10 +926,126 @@ main(int argc, char **argv) {
 	 */
 	rsp = &readings_store[0];
 	rs_nelems = RS_NELEMENTS;
+	if (flight_opt) {
+		/*
+		 * enough ring for the pre and post windows and then some, at
+		 * the fastest rate readings can come in
+		 */
+		rs_nelems = (pre_secs + post_secs + FLIGHT_SLACK_SECS) *
+			(1000000000 / ADAPT_FAST_NS);
+		rsp = malloc(rs_nelems * sizeof(*rsp));
+		if (rsp == NULL) {
+			fprintf(stderr, "out of memory for %d readings\n", rs_nelems);
+			exit(1);
+		}
+		extech_flight(trig_watts);
+		if (adaptive_opt) {
+			extech_adaptive(adapt_watts);
+		}
+	} else if (adaptive_opt) {
+		/*
+		 * at the fast rate the static stores only last 15 minutes, so
+		 * make room for a whole MAX_MPERIOD of fast readings
+		 */
+		rs_nelems = MAX_MPERIOD * (1000000000 / ADAPT_FAST_NS);
+		if (raw_opt) {
+			rrp = malloc(rs_nelems * sizeof(*rrp));
+		} else if (log_opt) {
+			rsp = malloc(rs_nelems * sizeof(*rsp));
+		} else if (col_init(&col_rs, rs_nelems) == 0) {
+			rcp = &col_rs;
+		}
+		if ((rsp == NULL) || (raw_opt && (rrp == NULL)) ||
+			(!raw_opt && !log_opt && (rcp == NULL))) {
+			fprintf(stderr, "out of memory for %d readings\n", rs_nelems);
+			exit(1);
+		}
+		extech_adaptive(adapt_watts);
+	} else if (raw_opt) {
+		rrp = &raw_store[0];
+	} else if (!log_opt) {
+		col_rs.ns = &col_ns_store[0];
+		for (f = 0; f < COL_NFIELDS; f++) {
+			col_rs.v[f] = &col_store[f][0];
+		}
+		col_rs.size = RS_NELEMENTS;
+		rcp = &col_rs;
+	}
+	if (deadband_opt) {
+		extech_deadband(db_tol);
+	}
 
 	debugp("size of readings_store: %ld\n", sizeof(readings_store));
 	// for RS_NELEMENTS=9000, this is 288000, or 281.25 KiB
 
+	if (realtime_opt) {
+		/*
+		 * lock everything in, and touch the stores now so the sampling
+		 * thread never takes a page fault on them mid-measurement
+		 */
+		if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+			fprintf(stderr, "warning: mlockall failed.  errno=%d\n", errno);
+		}
+		if (raw_opt) {
+			memset(rrp, 0, rs_nelems * sizeof(*rrp));
+		} else if (rcp) {
+			memset(rcp->ns, 0, rs_nelems * sizeof(*rcp->ns));
+			for (f = 0; f < COL_NFIELDS; f++) {
+				memset(rcp->v[f], 0, rs_nelems * sizeof(*rcp->v[f]));
+			}
+		} else {
+			memset(rsp, 0, rs_nelems * sizeof(*rsp));
+		}
+		extech_realtime(sched_get_priority_max(SCHED_FIFO) - 1, rt_cpu);
+	}
+
+	if (low_overhead_opt) {
+		extech_low_overhead();
+		sink_low_overhead();
+		capture_low_overhead();
+	}
+
+	/*
+	 * the alert helper has to be forked before there are any other
+	 * threads, or files open that its hooks shouldn't have
+	 */
+	if (alert_opt) {
+		rc = alert_start();
+		if (rc) {
+			fprintf(stderr, "starting the alert helper failed.  errno=%d\n",
+				rc);
+			exit(1);
+		}
+	}
+
+	if (capture_opt) {
+		rc = capture_open(capture_path);
+		if (rc) {
+			fprintf(stderr, "open capture file '%s' failed.  errno=%d\n",
+				capture_path, rc);
+			exit(1);
+		}
+	}
+
+	if (metrics_opt) {
+		rc = metrics_start(metrics_where);
+		if (rc) {
+			fprintf(stderr, "serving metrics on '%s' failed.  errno=%d\n",
+				metrics_where, rc);
+			exit(1);
+		}
+	}
+
+	if (sink_opt) {
+		const char *which = NULL;
+
+		rc = sink_start(&which);
+		if (rc) {
+			fprintf(stderr, "starting %s sink failed.  errno=%d\n", which, rc);
+			exit(1);
+		}
+	}
+
 	/*
 	 * open the device and initialize the power meter
 	 */
@@ -309,28 +1054,76 @@ main(int argc, char **argv) {
 		fprintf(stderr, "extech_power_meter returned errno '%d'\n", rc);
 		exit(1);
 	}
+	if (flight_opt) {
+		rc = flight_recorder(storefile, mperiod);
+		capture_close();
+		metrics_stop();
+		stop_sinks();
+		alert_stop();
+		alert_report();
+		overhead_report(stdout);
+		return rc;
+	}
+	if (log_opt) {
+		log_path = storefile;
+		rc = sf_log_create(&log_w, storefile,
+			raw_opt ? SF_LAYOUT_RAW : SF_LAYOUT_READING);
+		if (rc) {
+			fprintf(stderr, "create log '%s' failed.  errno=%d\n", storefile,
+				rc);
+			exit(1);
+		}
+		if (deadband_opt) {
+			log_w.hdr.flags |= SF_FLAG_DEADBAND;
+			log_w.hdr.period_us = adaptive_opt ? 0 : SAMPLE_PERIOD_NS / 1000;
+		}
+	}
 	printf("starting measurement process and sleeping for %ds...\n", mperiod);
 
-	/* starts the measurement reading thread */
-	start_measurement();
+	if (log_opt) {
+		/* measures, writing the log as it goes */
+		log_recorder(mperiod);
+	} else {
+		/* starts the measurement reading thread */
+		start_measurement();
 
-	/* sleep for the number of seconds the readings are to be collected */
-	rc = sleep(mperiod);
-	debugp("sleep returned %d, errno = %d", rc, errno);
-	if ((rc > 0) && (errno == EINTR) && (usr1sigrcv)) {
-		printf("sigusr1 rec'v after %d seconds\n", mperiod - rc);
-	}
+		/* sleep for the number of seconds the readings are to be collected */
+		rc = sleep(mperiod);
+		debugp("sleep returned %d, errno = %d", rc, errno);
+		if ((rc > 0) && (errno == EINTR) && (usr1sigrcv)) {
+			printf("sigusr1 rec'v after %d seconds\n", mperiod - rc);
+		}
 
-	/* reap the thread and clean up */
-	end_measurement();
+		/* reap the thread and clean up */
+		end_measurement();
+	}
+	capture_close();
+	metrics_stop();
+	stop_sinks();
+	alert_stop();
 
 	printf("watt-hours consumed: %g\n", ex_joules_consumed());
+	report_first_sample();
+	alert_report();
+	overhead_report(stdout);
+	if (realtime_opt) {
+		long periods, worst_ns, misses;
+
+		misses = ex_deadline_misses(&periods, &worst_ns);
+		printf("sampling periods: %ld, %ld started late, worst by %.3fms\n",
+			periods, misses, worst_ns / 1e6);
+	}
 
 	/*
 	 * compute and print out the max values
 	 */
 	if (maxv) {
 		struct reading m = {{0, 0}, 0, 0, 0, 0};
+		struct reading *r;
+		struct reading dr, peak;
+		int64_t ns;
+		uint64_t t_us = 0;
+		long px = -1;
 		int rx = 0;
 
 		/*
@@ -338,20 +1131,50 @@ main(int argc, char **argv) {
 		 * to find the max watts, then take the other readings for that
 		 * index as the other maxes.  that way, the amps, volts
 		 * and pf would properly compute out to the watts number,
-		 * whereas this way, they won't.
+		 * whereas this way, they won't.  so both: the max of each field,
+		 * and the whole reading at the max watts.
 		 */
-		for (rx = 0; rx < rs; rx++) {
-			if (readings_store[rx].watts > m.watts) {
-				m.watts = readings_store[rx].watts;
+		if (rcp && rs) {
+			/*
+			 * the column store: a pass over each field on its own.  no
+			 * readings leaves m all 0 and no peak, same as the loop.
+			 */
+			m.watts = col_max(rcp->v[COL_WATTS], rs);
+			m.pf = col_max(rcp->v[COL_PF], rs);
+			m.volts = col_max(rcp->v[COL_VOLTS], rs);
+			m.amps = col_max(rcp->v[COL_AMPS], rs);
+			px = col_argmax(rcp->v[COL_WATTS], rs);
+			if (px >= 0) {
+				col_get(rcp, px, &peak);
 			}
-			if (readings_store[rx].pf > m.pf) {
-				m.pf = readings_store[rx].pf;
+		}
+		for (rx = 0; !rcp && (rx < rs); rx++) {
+			r = &rsp[rx];
+			if (raw_opt) {
+				r = &dr;
+				t_us += rrp[rx].tdelta;
+				ns = startmono.tv_nsec + (t_us * 1000);
+				dr.tstamp.tv_sec = startmono.tv_sec + (ns / 1000000000);
+				dr.tstamp.tv_nsec = ns % 1000000000;
+				if (sf_decode_rawrec(&rrp[rx], r)) {
+					continue;
+				}
+			}
+			if ((px < 0) || (r->watts > peak.watts)) {
+				peak = *r;
+				px = rx;
+			}
+			if (r->watts > m.watts) {
+				m.watts = r->watts;
+			}
+			if (r->pf > m.pf) {
+				m.pf = r->pf;
 			}
-			if (readings_store[rx].volts > m.volts) {
-				m.volts = readings_store[rx].volts;
+			if (r->volts > m.volts) {
+				m.volts = r->volts;
 			}
-			if (readings_store[rx].amps > m.amps) {
-				m.amps = readings_store[rx].amps;
+			if (r->amps > m.amps) {
+				m.amps = r->amps;
 			}
 		}
 		/*
@@ -361,9 +1184,56 @@ main(int argc, char **argv) {
 		 */
 		printf("max: %7.3f watts %7.3f pf %7.3f volts %7.3f amps\n", m.watts,
 			m.pf, m.volts, m.amps);
+		if (px >= 0) {
+			ns = ((int64_t)startclk.tv_sec * 1000000000) + startclk.tv_nsec +
+				((int64_t)(peak.tstamp.tv_sec - startmono.tv_sec) * 1000000000) +
+				(peak.tstamp.tv_nsec - startmono.tv_nsec);
+			printf("peak: %7.3f watts %7.3f pf %7.3f volts %7.3f amps at "
+				"%ld.%.3ld\n", peak.watts, peak.pf, peak.volts, peak.amps,
+				ns / 1000000000, (ns % 1000000000) / 1000000);
+		}
 	}
 
-	if (storefile_opt) {
+	if (log_opt) {
+		rc = sf_finish(&log_w);
+		if (rc) {
+			fprintf(stderr, "finishing log '%s' failed.  errno=%d\n",
+				storefile, rc);
+		} else {
+			printf("saved %d %sreadings to %s, in %lu blocks\n", log_done,
+				raw_opt ? "raw " : "", storefile, log_w.seq);
+		}
+	} else if (storefile_opt && (raw_opt || deadband_opt || columns_opt)) {
+		struct sf_writer sw;
+
+		rc = sf_create(&sw, storefile, raw_opt ? SF_LAYOUT_RAW :
+			columns_opt ? SF_LAYOUT_COLUMNS : SF_LAYOUT_READING, &startclk,
+			&startmono);
+		if (rc == 0) {
+			if (deadband_opt) {
+				sw.hdr.flags |= SF_FLAG_DEADBAND;
+				sw.hdr.period_us = adaptive_opt ? 0 : SAMPLE_PERIOD_NS / 1000;
+			}
+			if (raw_opt) {
+				rc = sf_append(&sw, rrp, rs);
+			} else if (columns_opt) {
+				rc = sf_write_columns(&sw, rcp);
+			} else {
+				rc = put_rows(append_rows, &sw);
+			}
+			rc = sf_finish(&sw) ?: rc;
+		}
+		if (rc) {
+			fprintf(stderr, "saving readings to '%s' failed.  errno=%d\n",
+				storefile, rc);
+		} else {
+			printf("saved %d %sreadings to %s\n", rs, raw_opt ? "raw " : "",
+				storefile);
+		}
+		if (deadband_opt) {
+			printf("left out %ld unchanged readings\n", ex_deadband_dropped());
+		}
+	} else if (storefile_opt) {
 		/*
 		 * save the readings to a file, binary.  not tested
 		 * trying to save to stdout, therefore that won't work.
@@ -374,13 +1244,60 @@ main(int argc, char **argv) {
 			"open storefile '%s' failed.  open returned '%d' errno=%d\n",
 			storefile, storefile_fd, errno);
 		} else {
-			rc = write(storefile_fd, &startclk, sizeof(struct timespec));
-			rc = write(storefile_fd, &readings_store[0],
-				sizeof(struct reading) * rs);
+			rc = sf_write_all(storefile_fd, &startclk, sizeof(struct timespec))
+				?: put_rows(write_rows, &storefile_fd);
 			close(storefile_fd);
-			printf("saved %d readings to %s\n",
-				rc / (int)sizeof(struct reading), storefile);
+			if (rc) {
+				fprintf(stderr, "saving readings to '%s' failed.  errno=%d\n",
+					storefile, rc);
+			} else {
+				printf("saved %d readings to %s\n", rs, storefile);
+			}
 		}
 	}
-}
+	/*
+	 * roll the readings up straight from the store, rather than reading
+	 * the storefile back in
+	 */
+	if (storefile_opt && rollup_opt) {
+		struct rollup ru;
+		struct reading dr;
+		char rpath[sizeof(storefile) + sizeof(RU_SUFFIX)];
+		int64_t base_ns;
+		int64_t ns;
+		uint64_t t_us = 0;
+		int rx;
 
+		base_ns = ((int64_t)startclk.tv_sec * 1000000000) + startclk.tv_nsec;
+		rollup_init(&ru);
+		for (rx = 0, rc = 0; (rx < rs) && (rc == 0); rx++) {
+			if (raw_opt) {
+				t_us += rrp[rx].tdelta;
+				if (sf_decode_rawrec(&rrp[rx], &dr)) {
+					continue;
+				}
+				ns = base_ns + (t_us * 1000);
+			} else {
+				if (rcp) {
+					col_get(rcp, rx, &dr);
+				} else {
+					dr = rsp[rx];
+				}
+				ns = base_ns +
+					((int64_t)(dr.tstamp.tv_sec - startmono.tv_sec) * 1000000000) +
+					(dr.tstamp.tv_nsec - startmono.tv_nsec);
+			}
+			rc = rollup_add(&ru, ns, dr.watts);
+		}
+
+		snprintf(rpath, sizeof(rpath), "%s%s", storefile, RU_SUFFIX);
+		if (rc == 0) {
+			rc = rollup_write(&ru, rpath);
+		}
+		if (rc) {
+			fprintf(stderr, "writing rollup '%s' failed.  errno=%d\n", rpath,
+				rc);
+		}
+		rollup_free(&ru);
+	}
+}
@@ -0,0 +1,264 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Compiling and running filter expressions.  see filter.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include "filter.h"
+
+static const char *fields[] = {"watts", "pf", "volts", "amps", NULL};
+
+/*
+ * longest first, so "<=" isn't taken for "<"
+ */
+static const struct {
+	const char *s;
+	int cmp;
+} cmps[] = {
+	{"<=", COL_LE},
+	{">=", COL_GE},
+	{"==", COL_EQ},
+	{"!=", COL_NE},
+	{"<", COL_LT},
+	{">", COL_GT},
+	{"=", COL_EQ},
+	{NULL, 0}
+};
+
+struct parser {
+	const char *p;
+	struct filter *f;
+	int depth;		/* bitmaps on the stack, running the plan so far */
+	const char *err;
+};
+
+static int or_expr(struct parser *ps);
+
+ static void
+skip_space(struct parser *ps)
+{
+	while (isspace((unsigned char)*ps->p)) {
+		ps->p++;
+	}
+}
+
+/*
+ * a word, not just the start of one
+ */
+ static int
+accept_word(struct parser *ps, const char *w)
+{
+	size_t len = strlen(w);
+
+	skip_space(ps);
+	if (strncmp(ps->p, w, len) || isalnum((unsigned char)ps->p[len])) {
+		return 0;
+	}
+	ps->p += len;
+	return 1;
+}
+
+ static int
+accept(struct parser *ps, const char *sym)
+{
+	size_t len = strlen(sym);
+
+	skip_space(ps);
+	if (strncmp(ps->p, sym, len)) {
+		return 0;
+	}
+	ps->p += len;
+	return 1;
+}
+
+ static int
+emit(struct parser *ps, int op, int field, int cmp, float k)
+{
+	struct flt_op *o;
+
+	if (ps->f->n >= FLT_MAXOPS) {
+		ps->err = "expression too long";
+		return EINVAL;
+	}
+	ps->depth += (op == FLT_CMP) ? 1 : (op == FLT_NOT) ? 0 : -1;
+	if (ps->depth > FLT_MAXDEPTH) {
+		ps->err = "expression nested too deep";
+		return EINVAL;
+	}
+	o = &ps->f->ops[ps->f->n++];
+	o->op = op;
+	o->field = field;
+	o->cmp = cmp;
+	o->k = k;
+	if (op == FLT_CMP) {
+		ps->f->uses[field] = 1;
+	}
+
+	return 0;
+}
+
+/*
+ * <field> <cmp> <number>
+ */
+ static int
+comparison(struct parser *ps)
+{
+	char *end;
+	float k;
+	int field, i;
+
+	for (field = 0; fields[field]; field++) {
+		if (accept_word(ps, fields[field])) {
+			break;
+		}
+	}
+	if (fields[field] == NULL) {
+		ps->err = "expected watts, pf, volts or amps";
+		return EINVAL;
+	}
+	for (i = 0; cmps[i].s; i++) {
+		if (accept(ps, cmps[i].s)) {
+			break;
+		}
+	}
+	if (cmps[i].s == NULL) {
+		ps->err = "expected <, <=, >, >=, == or !=";
+		return EINVAL;
+	}
+	skip_space(ps);
+	k = strtof(ps->p, &end);
+	if (end == ps->p) {
+		ps->err = "expected a number";
+		return EINVAL;
+	}
+	ps->p = end;
+
+	return emit(ps, FLT_CMP, field, cmps[i].cmp, k);
+}
+
+ static int
+unary(struct parser *ps)
+{
+	int ret;
+
+	if (accept_word(ps, "not") || accept(ps, "!")) {
+		return unary(ps) ?: emit(ps, FLT_NOT, 0, 0, 0);
+	}
+	if (accept(ps, "(")) {
+		ret = or_expr(ps);
+		if (ret) {
+			return ret;
+		}
+		if (!accept(ps, ")")) {
+			ps->err = "expected )";
+			return EINVAL;
+		}
+		return 0;
+	}
+	return comparison(ps);
+}
+
+ static int
+and_expr(struct parser *ps)
+{
+	int ret;
+
+	ret = unary(ps);
+	while ((ret == 0) && (accept_word(ps, "and") || accept(ps, "&&"))) {
+		ret = unary(ps) ?: emit(ps, FLT_AND, 0, 0, 0);
+	}
+	return ret;
+}
+
+ static int
+or_expr(struct parser *ps)
+{
+	int ret;
+
+	ret = and_expr(ps);
+	while ((ret == 0) && (accept_word(ps, "or") || accept(ps, "||"))) {
+		ret = and_expr(ps) ?: emit(ps, FLT_OR, 0, 0, 0);
+	}
+	return ret;
+}
+
+/*
+ * compile expr into f.  returns 0 on success, or EINVAL with *err saying
+ * what was wrong with it.
+ */
+ int
+flt_compile(struct filter *f, const char *expr, const char **err)
+{
+	struct parser ps;
+	int ret;
+
+	memset(f, 0, sizeof(*f));
+	ps.p = expr;
+	ps.f = f;
+	ps.depth = 0;
+	ps.err = NULL;
+	ret = or_expr(&ps);
+	skip_space(&ps);
+	if ((ret == 0) && *ps.p) {
+		ps.err = "junk at the end";
+		ret = EINVAL;
+	}
+	if (ret) {
+		*err = ps.err;
+	}
+
+	return ret;
+}
+
+/*
+ * run the plan over n readings, n no more than FLT_BLOCK, whose fields
+ * are in columns v[COL_WATTS] .. v[COL_AMPS].  only the fields the
+ * filter uses have to be there.  bit i % 64 of sel[i / 64] is set if
+ * reading i passes.
+ */
+ void
+flt_eval(const struct filter *f, const float *const *v, long n, uint64_t *sel)
+{
+	uint64_t stack[FLT_MAXDEPTH][FLT_WORDS];
+	const struct flt_op *o;
+	long nw = (n + 63) / 64;
+	long w;
+	int sp = 0;
+	int i;
+
+	for (i = 0; i < f->n; i++) {
+		o = &f->ops[i];
+		switch (o->op) {
+			case FLT_CMP:
+				col_cmp(v[o->field], n, o->cmp, o->k, stack[sp++]);
+				break;
+			case FLT_AND:
+				sp--;
+				for (w = 0; w < nw; w++) {
+					stack[sp - 1][w] &= stack[sp][w];
+				}
+				break;
+			case FLT_OR:
+				sp--;
+				for (w = 0; w < nw; w++) {
+					stack[sp - 1][w] |= stack[sp][w];
+				}
+				break;
+			case FLT_NOT:
+				for (w = 0; w < nw; w++) {
+					stack[sp - 1][w] = ~stack[sp - 1][w];
+				}
+				/* readings past n stay out */
+				if (n % 64) {
+					stack[sp - 1][nw - 1] &= (1ULL << (n % 64)) - 1;
+				}
+				break;
+		}
+	}
+	memcpy(sel, stack[0], nw * sizeof(*sel));
+}
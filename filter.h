@@ -0,0 +1,54 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Filter expressions over readings, like "watts > 150 and pf < 0.85".
+ *
+ * An expression is comparisons of a field (watts, pf, volts, amps) to a
+ * number with <, <=, >, >=, == (or =) and !=, put together with and,
+ * or, not (or &&, ||, !) and parentheses.  It's compiled to a plan: the
+ * comparisons and the ands, ors and nots in postfix order.
+ *
+ * The plan is run over a block of readings at a time, laid out as
+ * columns.  Each comparison makes a bitmap of the block, a bit a
+ * reading, straight off its field's column with col_cmp(), and the ands,
+ * ors and nots are done a word of 64 readings at a time on the bitmaps.
+ * So a field that isn't in the expression is never looked at.
+ */
+#ifndef _FILTER_H
+#define _FILTER_H
+
+#include <stdint.h>
+#include "columns.h"
+
+#define FLT_BLOCK 4096		/* readings evaluated at a time */
+#define FLT_WORDS (FLT_BLOCK / 64)
+#define FLT_MAXOPS 64
+#define FLT_MAXDEPTH 16		/* bitmaps on the stack at once */
+
+/*
+ * plan steps
+ */
+#define FLT_CMP	0
+#define FLT_AND	1
+#define FLT_OR	2
+#define FLT_NOT	3
+
+struct flt_op {
+	int op;
+	int field;		/* FLT_CMP: COL_WATTS .. COL_AMPS */
+	int cmp;		/* FLT_CMP: COL_LT .. COL_NE */
+	float k;
+};
+
+struct filter {
+	int n;
+	struct flt_op ops[FLT_MAXOPS];
+	int uses[COL_NFIELDS];	/* which fields it looks at */
+};
+
+extern int flt_compile(struct filter *f, const char *expr, const char **err);
+extern void flt_eval(const struct filter *f, const float *const *v, long n,
+	uint64_t *sel);
+
+#endif
@@ -0,0 +1,318 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Serving the metrics.  see metrics.h.
+ *
+ * One thread does it all, one connection at a time: accept, read the
+ * request (whatever it is), write the metrics, close.  Scrapes come every
+ * few seconds at most, so there's no call for anything fancier.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "extech.h"
+#include "alert.h"
+#include "metrics.h"
+#include "overhead.h"
+
+static int listen_fd = -1;
+static int stop_pipe[2] = {-1, -1};
+static pthread_t metrics_thread;
+static char sock_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+struct metric {
+	const char *name;
+	const char *type;
+	const char *help;
+};
+
+/*
+ * in struct ex_stats order
+ */
+static const struct metric counters[] = {
+	{"extech_triggers_total", "counter", "Readings asked of the meter."},
+	{"extech_frames_ok_total", "counter", "Readings read and decoded."},
+	{"extech_bad_bookends_total", "counter",
+		"Readings with a block not framed by 02 and 03."},
+	{"extech_bad_digits_total", "counter",
+		"Readings with a value that failed conversion."},
+	{"extech_short_reads_total", "counter",
+		"Reads that came back with less than a whole reading."},
+	{"extech_timeouts_total", "counter", "Times the meter didn't answer."},
+	{"extech_read_errors_total", "counter", "Serial port read errors."},
+	{"extech_dropped_readings_total", "counter",
+		"Readings that didn't fit in the readings store."},
+};
+
+/*
+ * the metrics, in the Prometheus text exposition format
+ */
+ static int
+render(char *buf, size_t size)
+{
+	struct ex_stats st;
+	struct alert_stats as;
+	unsigned long v[8];
+	size_t n = 0;
+	int i;
+
+	ex_get_stats(&st);
+	v[0] = st.triggers;
+	v[1] = st.frames_ok;
+	v[2] = st.bad_bookends;
+	v[3] = st.bad_digits;
+	v[4] = st.short_reads;
+	v[5] = st.timeouts;
+	v[6] = st.read_errors;
+	v[7] = st.dropped;
+
+	for (i = 0; i < 8; i++) {
+		n += snprintf(buf + n, size - n, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n",
+			counters[i].name, counters[i].help, counters[i].name,
+			counters[i].type, counters[i].name, v[i]);
+	}
+	n += snprintf(buf + n, size - n,
+		"# HELP extech_watts Watts of the last reading.\n"
+		"# TYPE extech_watts gauge\n"
+		"extech_watts %g\n"
+		"# HELP extech_energy_joules Energy used since the measurement "
+		"started.\n"
+		"# TYPE extech_energy_joules gauge\n"
+		"extech_energy_joules %.3f\n", st.watts, st.joules);
+	if (st.first_sample_ns) {
+		n += snprintf(buf + n, size - n,
+			"# HELP extech_first_sample_seconds Time from the process "
+			"starting to the first good reading.\n"
+			"# TYPE extech_first_sample_seconds gauge\n"
+			"extech_first_sample_seconds %.3f\n", st.first_sample_ns / 1e9);
+	}
+	/* the alerts, if there are any, with how long their hooks took */
+	if (alert_get_stats(&as) == 0) {
+		n += snprintf(buf + n, size - n,
+			"# HELP extech_alerts_fired_total Alert rules that went off.\n"
+			"# TYPE extech_alerts_fired_total counter\n"
+			"extech_alerts_fired_total %lu\n"
+			"# HELP extech_alerts_lost_total Alerts that went off with the "
+			"helper too far behind to be told.\n"
+			"# TYPE extech_alerts_lost_total counter\n"
+			"extech_alerts_lost_total %lu\n"
+			"# HELP extech_alert_hooks_total Alert commands run.\n"
+			"# TYPE extech_alert_hooks_total counter\n"
+			"extech_alert_hooks_total %lu\n"
+			"# HELP extech_alert_hook_failures_total Alert commands that "
+			"couldn't be forked.\n"
+			"# TYPE extech_alert_hook_failures_total counter\n"
+			"extech_alert_hook_failures_total %lu\n",
+			as.fired, as.lost, as.hooks, as.failed);
+		if (as.hooks) {
+			n += snprintf(buf + n, size - n,
+				"# HELP extech_alert_exec_seconds_mean Mean time from an "
+				"alert going off to its command being exec'd.\n"
+				"# TYPE extech_alert_exec_seconds_mean gauge\n"
+				"extech_alert_exec_seconds_mean %.6f\n"
+				"# HELP extech_alert_exec_seconds_max Longest time from an "
+				"alert going off to its command being exec'd.\n"
+				"# TYPE extech_alert_exec_seconds_max gauge\n"
+				"extech_alert_exec_seconds_max %.6f\n",
+				as.lat_sum_ns / 1e9 / as.hooks, as.lat_max_ns / 1e9);
+		}
+	}
+
+	return (n < size) ? n : size - 1;
+}
+
+/*
+ * like sf_write_all(), but a client that has gone away is EPIPE, not a
+ * SIGPIPE that takes the whole measurement down with it
+ */
+ static int
+send_all(int fd, const void *buf, size_t len)
+{
+	const char *b = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = send(fd, b, len, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno;
+		}
+		b += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+ static void
+serve(int fd)
+{
+	char req[1024];
+	char body[4096];
+	char hdr[256];
+	struct pollfd pfd;
+	int hlen, blen;
+
+	/*
+	 * don't wait long on a client that connects and says nothing, and
+	 * don't care what it asked for; there's only the one thing here
+	 */
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if ((poll(&pfd, 1, 1000) == 1) && (read(fd, req, sizeof(req)) < 0)) {
+		return;
+	}
+
+	blen = render(body, sizeof(body));
+	hlen = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %d\r\n"
+		"Connection: close\r\n\r\n", blen);
+	/* if it hung up already, that's its loss; it's closed either way */
+	if (send_all(fd, hdr, hlen) == 0) {
+		send_all(fd, body, blen);
+	}
+}
+
+ static void *
+metrics_proc(void *arg)
+{
+	struct pollfd pfd[2];
+	int fd;
+
+	pfd[0].fd = listen_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = stop_pipe[0];
+	pfd[1].events = POLLIN;
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (pfd[1].revents) {
+			break;
+		}
+		if (pfd[0].revents & POLLIN) {
+			fd = accept(listen_fd, NULL, NULL);
+			if (fd >= 0) {
+				serve(fd);
+				close(fd);
+			}
+		}
+	}
+	overhead_thread_done("metrics");
+
+	return NULL;
+}
+
+/*
+ * start serving metrics.  where is a port number, to listen on
+ * 127.0.0.1, or else the path of a unix socket to create.
+ * returns 0 on success, errno on failure.
+ */
+ int
+metrics_start(const char *where)
+{
+	struct sockaddr_in sin;
+	struct sockaddr_un sun;
+	char *end;
+	long port;
+	int one = 1;
+	int ret;
+
+	port = strtol(where, &end, 10);
+	if ((*end == '\0') && (end != where)) {
+		if ((port <= 0) || (port > 65535)) {
+			return EINVAL;
+		}
+		listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (listen_fd < 0) {
+			return errno;
+		}
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(port);
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (bind(listen_fd, (struct sockaddr *)&sin, sizeof(sin))) {
+			goto error_exit;
+		}
+	} else {
+		if (strlen(where) >= sizeof(sun.sun_path)) {
+			return ENAMETOOLONG;
+		}
+		listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (listen_fd < 0) {
+			return errno;
+		}
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, where);
+		/* one left over from a run that didn't clean up after itself */
+		unlink(where);
+		if (bind(listen_fd, (struct sockaddr *)&sun, sizeof(sun))) {
+			goto error_exit;
+		}
+		strcpy(sock_path, where);
+	}
+	if (listen(listen_fd, 8) || pipe(stop_pipe)) {
+		goto error_exit;
+	}
+
+	ret = pthread_create(&metrics_thread, NULL, metrics_proc, NULL);
+	if (ret) {
+		errno = ret;
+		goto error_exit;
+	}
+
+	return 0;
+
+error_exit:
+	ret = errno;
+	close(listen_fd);
+	listen_fd = -1;
+	if (stop_pipe[0] >= 0) {
+		close(stop_pipe[0]);
+		close(stop_pipe[1]);
+		stop_pipe[0] = stop_pipe[1] = -1;
+	}
+	if (sock_path[0]) {
+		unlink(sock_path);
+		sock_path[0] = '\0';
+	}
+	return ret;
+}
+
+ void
+metrics_stop(void)
+{
+	if (listen_fd < 0) {
+		return;
+	}
+	if (write(stop_pipe[1], "", 1) == 1) {
+		pthread_join(metrics_thread, NULL);
+	}
+	close(stop_pipe[0]);
+	close(stop_pipe[1]);
+	close(listen_fd);
+	listen_fd = -1;
+	if (sock_path[0]) {
+		unlink(sock_path);
+		sock_path[0] = '\0';
+	}
+}
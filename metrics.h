@@ -0,0 +1,16 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Metrics: the acquisition counters (struct ex_stats) and the alerts'
+ * (struct alert_stats), served in the Prometheus text format over HTTP,
+ * on a unix socket or a localhost port, so the health of a meter can be
+ * scraped without anybody having to pick through stderr.
+ */
+#ifndef _METRICS_H
+#define _METRICS_H
+
+extern int metrics_start(const char *where);
+extern void metrics_stop(void);
+
+#endif
@@ -0,0 +1,142 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Accounting for extech_rdr's own overhead.  see overhead.h.
+ */
+
+#define _GNU_SOURCE /* for RUSAGE_THREAD */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "overhead.h"
+
+struct oh_thread {
+	const char *name;
+	int64_t cpu_ns;
+	long wakeups;	/* voluntary context switches */
+	long preempted;	/* involuntary ones */
+};
+
+static struct oh_thread threads[OH_MAXTHREADS];
+static int nthreads;
+static int64_t start_ns;
+
+ static int64_t
+tv_ns(const struct timeval *tv)
+{
+	return ((int64_t)tv->tv_sec * 1000000000) + (tv->tv_usec * 1000);
+}
+
+ static int64_t
+mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/*
+ * the calling thread's numbers.  schedstat has the CPU time to the nsec,
+ * where getrusage's can be to the tick, but it isn't in every kernel.
+ */
+ static void
+sample_thread(struct oh_thread *t, const char *name)
+{
+	struct rusage ru;
+	unsigned long long run_ns;
+	FILE *f;
+
+	memset(t, 0, sizeof(*t));
+	t->name = name;
+	if (getrusage(RUSAGE_THREAD, &ru) == 0) {
+		t->cpu_ns = tv_ns(&ru.ru_utime) + tv_ns(&ru.ru_stime);
+		t->wakeups = ru.ru_nvcsw;
+		t->preempted = ru.ru_nivcsw;
+	}
+
+	f = fopen("/proc/thread-self/schedstat", "r");
+	if (f == NULL) {
+		return;
+	}
+	if (fscanf(f, "%llu", &run_ns) == 1) {
+		t->cpu_ns = run_ns;
+	}
+	fclose(f);
+}
+
+/*
+ * note when the run started, for the rates
+ */
+ void
+overhead_start(void)
+{
+	start_ns = mono_ns();
+}
+
+/*
+ * keep the calling thread's numbers, as the last thing it does
+ */
+ void
+overhead_thread_done(const char *name)
+{
+	int i;
+
+	i = __atomic_fetch_add(&nthreads, 1, __ATOMIC_RELAXED);
+	if (i < OH_MAXTHREADS) {
+		sample_thread(&threads[i], name);
+	}
+}
+
+ static void
+put_line(FILE *f, const char *name, int64_t cpu_ns, long wakeups,
+	long preempted, double secs)
+{
+	fprintf(f, "  %-9s %9.3f %6.3f %8ld %7.2f %9ld\n", name, cpu_ns / 1e6,
+		(secs > 0) ? cpu_ns / (secs * 1e7) : 0., wakeups,
+		(secs > 0) ? wakeups / secs : 0., preempted);
+}
+
+/*
+ * output what each thread that's done cost, the main thread (the
+ * caller) and the whole process.  the other threads should all have
+ * been joined by now.
+ */
+ void
+overhead_report(FILE *f)
+{
+	struct oh_thread main_t;
+	struct rusage ru;
+	double secs;
+	int n, i;
+
+	secs = (mono_ns() - start_ns) / 1e9;
+	sample_thread(&main_t, "main");
+	n = __atomic_load_n(&nthreads, __ATOMIC_RELAXED);
+	if (n > OH_MAXTHREADS) {
+		n = OH_MAXTHREADS;
+	}
+
+	fprintf(f, "overhead over %.1fs:\n", secs);
+	fprintf(f, "  thread       cpu ms   cpu%%  wakeups    /sec preempted\n");
+	put_line(f, main_t.name, main_t.cpu_ns, main_t.wakeups, main_t.preempted,
+		secs);
+	for (i = 0; i < n; i++) {
+		put_line(f, threads[i].name, threads[i].cpu_ns, threads[i].wakeups,
+			threads[i].preempted, secs);
+	}
+	if (getrusage(RUSAGE_SELF, &ru) == 0) {
+		put_line(f, "all", tv_ns(&ru.ru_utime) + tv_ns(&ru.ru_stime),
+			ru.ru_nvcsw, ru.ru_nivcsw, secs);
+	}
+	/* the alert helper and its hooks, once they've been waited for */
+	if ((getrusage(RUSAGE_CHILDREN, &ru) == 0) &&
+		(ru.ru_nvcsw || ru.ru_nivcsw)) {
+		put_line(f, "children", tv_ns(&ru.ru_utime) + tv_ns(&ru.ru_stime),
+			ru.ru_nvcsw, ru.ru_nivcsw, secs);
+	}
+}
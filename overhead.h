@@ -0,0 +1,34 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * What extech_rdr itself costs the machine it's measuring: the CPU time,
+ * wakeups and preemptions of each of its threads, and of the process as
+ * a whole, for the report at the end of a run.
+ *
+ * A thread's numbers are gone once it's joined, so each thread calls
+ * overhead_thread_done() on its way out, which takes its CPU time from
+ * /proc/thread-self/schedstat and its context switches from
+ * getrusage(RUSAGE_THREAD).  Every voluntary switch is a sleep, so a
+ * wakeup to follow it.  overhead_report() adds the main
+ * thread, and the process totals from getrusage(RUSAGE_SELF), plus the
+ * alert helper and its hooks if there were any.
+ */
+#ifndef _OVERHEAD_H
+#define _OVERHEAD_H
+
+#include <stdio.h>
+
+#define OH_MAXTHREADS 8
+
+/*
+ * in low overhead mode, the timer slack of the threads that only move
+ * readings along, the sinks' and the capture's, which can be late
+ */
+#define OH_LAZY_SLACK_NS 100000000L
+
+extern void overhead_start(void);
+extern void overhead_thread_done(const char *name);
+extern void overhead_report(FILE *f);
+
+#endif
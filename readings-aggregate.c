@@ -0,0 +1,255 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Program to add up the watts of several meters, one storefile each, at
+ * the same instants.
+ *
+ * Each extech_rdr samples on its own clock, so the readings of two meters
+ * never line up and can't just be added row by row.  Instead each meter's
+ * watts are interpolated onto a common grid, every --step seconds (1 by
+ * default), and the sum and each meter's watts are output for each grid
+ * time.  A meter whose readings are more than --gap seconds apart around
+ * a grid time (2 by default) has no value there, shown as '-', and isn't
+ * in the sum; the count column says how many meters are.  Deadband
+ * storefiles only have a reading when the watts changed, or at least
+ * every DB_KEYFRAME_SECS, so their gap is that much longer.
+ *
+ * The files are read a little of each at a time, in step with the grid,
+ * so it's one pass however long the files are.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include "extech.h"
+#include "storefile.h"
+#include "aggregate.h"
+
+/*
+ * argument specification
+ */
+int step_opt = 0;
+int gap_opt = 0;
+int from_opt = 0;
+int to_opt = 0;
+
+struct option ra_opts[] = {
+	{
+		"step",
+		required_argument,
+		&step_opt,
+		1
+	},
+	{
+		"gap",
+		required_argument,
+		&gap_opt,
+		1
+	},
+	{
+		"from",
+		required_argument,
+		&from_opt,
+		1
+	},
+	{
+		"to",
+		required_argument,
+		&to_opt,
+		1
+	},
+	{}
+};
+
+int64_t step_ns = 1000000000;
+int64_t gap_ns = 2000000000;
+int64_t win_from = INT64_MIN;
+int64_t win_to = INT64_MAX;
+
+struct storefile *inputs;
+long nbad;
+
+ void
+usage(char **args)
+{
+	printf("usage: %s [--step=<secs>] [--gap=<secs>] [--from=<time>] "
+		"[--to=<time>] <storefile> ...\n", args[0]);
+	printf("Times are local 'YYYY-MM-DD HH:MM:SS[.fff]' or seconds since "
+		"the epoch.\n");
+}
+
+ static void
+row(void *arg, int64_t ns, double total, int present, const float *watts)
+{
+	int n = *(int *)arg;
+	int i;
+
+	if ((ns < win_from) || (ns >= win_to)) {
+		return;
+	}
+	printf("%ld.%.3ld %8.3f %2d", ns / 1000000000,
+		(ns % 1000000000) / 1000000, total, present);
+	for (i = 0; i < n; i++) {
+		if (isnan(watts[i])) {
+			printf("        -");
+		} else {
+			printf(" %8.3f", watts[i]);
+		}
+	}
+	printf("\n");
+}
+
+/*
+ * give the aggregator readings from meter i until it doesn't need any
+ * more for now.  returns 0 on success, errno on failure.
+ */
+ static int
+feed(struct aggregate *a, int i)
+{
+	struct reading r;
+	int64_t ns;
+	int rc;
+
+	while (agg_needs(a, i)) {
+		rc = sf_read(&inputs[i], &r);
+		if (rc == 0) {
+			agg_end(a, i);
+			break;
+		}
+		if (rc < 0) {
+			nbad++;
+			continue;
+		}
+		ns = sf_realtime_ns(&inputs[i], &r.tstamp);
+		if ((win_to != INT64_MAX) && (ns >= win_to + gap_ns)) {
+			/* nothing past here can be used */
+			agg_end(a, i);
+			break;
+		}
+		rc = agg_push(a, i, ns, r.watts);
+		if (rc) {
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+ static int
+secs_arg(const char *s, int64_t *ns)
+{
+	*ns = (int64_t)(strtod(s, NULL) * 1e9);
+	return *ns <= 0;
+}
+
+
+ int
+main(int argc, char **argv) {
+	struct aggregate a;
+	char label[16];
+	int rc;
+	int argx;
+	int n, i;
+	int busy;
+
+	do {
+		rc = getopt_long(argc, argv, "", &ra_opts[0], &argx);
+		if ((rc == ':') || (rc == '?')) {
+			usage(argv);
+			exit(1);
+		}
+		if (rc != 0) {
+			continue;
+		}
+		if (ra_opts[argx].flag == &step_opt) {
+			if (secs_arg(optarg, &step_ns)) {
+				printf("step must be a positive number of seconds\n");
+				exit(1);
+			}
+		} else if (ra_opts[argx].flag == &gap_opt) {
+			if (secs_arg(optarg, &gap_ns)) {
+				printf("gap must be a positive number of seconds\n");
+				exit(1);
+			}
+		} else if (sf_parse_time(optarg, (ra_opts[argx].flag == &from_opt) ?
+			&win_from : &win_to)) {
+			printf("can't make sense of time '%s'\n", optarg);
+			usage(argv);
+			exit(1);
+		}
+	} while (rc != -1);
+
+	if (optind >= argc) {
+		usage(argv);
+		exit(1);
+	}
+
+	n = argc - optind;
+	inputs = calloc(n, sizeof(*inputs));
+	if (inputs == NULL) {
+		fprintf(stderr, "no memory for %d inputs\n", n);
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		rc = sf_open(&inputs[i], argv[optind + i]);
+		if (rc) {
+			fprintf(stderr, "open storefile '%s' failed.  errno=%d\n",
+				argv[optind + i], rc);
+			exit(1);
+		}
+		if (win_from != INT64_MIN) {
+			sf_seek_ns(&inputs[i], win_from - gap_ns);
+		}
+	}
+
+	rc = agg_init(&a, n, step_ns, gap_ns, row, &n);
+	if (rc) {
+		fprintf(stderr, "aggregator setup failed.  errno=%d\n", rc);
+		exit(1);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (inputs[i].flags & SF_FLAG_DEADBAND) {
+			agg_set_gap(&a, i, gap_ns + (DB_KEYFRAME_SECS * 1000000000L));
+		}
+		printf("# %d: %s\n", i, argv[optind + i]);
+	}
+	printf("     timestamp    total  n");
+	for (i = 0; i < n; i++) {
+		snprintf(label, sizeof(label), "watts%d", i);
+		printf(" %8s", label);
+	}
+	printf("\n");
+
+	/* the grid doesn't start until some meter has a reading */
+	do {
+		busy = 0;
+		for (i = 0; i < n; i++) {
+			if (agg_needs(&a, i)) {
+				rc = feed(&a, i);
+				if (rc) {
+					fprintf(stderr, "aggregating failed.  errno=%d\n", rc);
+					exit(1);
+				}
+				busy = 1;
+			}
+		}
+	} while (busy);
+
+	if (nbad) {
+		fprintf(stderr, "%ld readings failed conversion and were skipped\n",
+			nbad);
+	}
+	agg_free(&a);
+	for (i = 0; i < n; i++) {
+		sf_close(&inputs[i]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,388 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Program to work out the energy used by each event in an event log,
+ * say the requests or jobs a service logged, from a storefile of the
+ * readings taken while they ran.
+ *
+ * The event log is text, one event per line:
+ *
+ *	<start> <end> <label>
+ *
+ * with the times as seconds since the epoch or local
+ * 'YYYY-MM-DDTHH:MM:SS[.fff]', and the label the rest of the line.  Blank
+ * lines and lines starting with '#' are skipped.  Events can overlap, and
+ * each gets all the energy used during it.
+ *
+ * The readings are loaded once, with a running total of the energy up to
+ * each one, each reading's watts held until the next, same as everywhere
+ * else.  Then the energy of an event is the running total at its end less
+ * the running total at its start, each found with a binary search, so
+ * millions of events against a week of readings take seconds, and the
+ * event log is read as it goes rather than loaded.  Time outside the
+ * readings counts for nothing, and the coverage column says how much of
+ * the event the readings cover.
+ *
+ * Each event's energy is output as it's read, then the totals for each
+ * label.  With --labels, just the label totals.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+#include <getopt.h>
+#include "extech.h"
+#include "storefile.h"
+
+#define LABEL_MAX 128
+
+/*
+ * the readings: wall clock times, watts, and the energy from the first
+ * reading up to each one
+ */
+int64_t *r_ns;
+float *r_watts;
+double *r_joules;
+long nr;
+
+/*
+ * totals for each label, in an open addressed hash table that doubles
+ * when it's half full
+ */
+struct label {
+	char name[LABEL_MAX];
+	long count;
+	double joules;
+	double secs;
+};
+
+struct label *labels;
+unsigned long nlabels;
+unsigned long labels_size;
+
+/*
+ * argument specification
+ */
+int labels_opt = 0; /* only output the label totals */
+
+struct option ra_opts[] = {
+	{
+		"labels",
+		no_argument,
+		&labels_opt,
+		1
+	},
+	{}
+};
+
+ void
+usage(char **args)
+{
+	printf("usage: %s [--labels] <storefile> <event-log|->\n", args[0]);
+	printf("Each line of the event log is '<start> <end> <label>', times are "
+		"seconds since\nthe epoch or local 'YYYY-MM-DDTHH:MM:SS[.fff]'.\n");
+}
+
+/*
+ * load the readings and total up the energy as it goes.  returns 0 on
+ * success, errno on failure.
+ */
+ static int
+load(const char *path)
+{
+	struct storefile sf;
+	struct reading r;
+	long size = 0;
+	void *p;
+	int rc;
+
+	rc = sf_open(&sf, path);
+	if (rc) {
+		fprintf(stderr, "open storefile '%s' failed.  errno=%d\n", path, rc);
+		return rc;
+	}
+	while ((rc = sf_read(&sf, &r)) != 0) {
+		if (rc < 0) {
+			continue;
+		}
+		if (nr == size) {
+			size = size ? size * 2 : 4096;
+			if ((p = realloc(r_ns, size * sizeof(*r_ns))) == NULL) {
+				goto nomem;
+			}
+			r_ns = p;
+			if ((p = realloc(r_watts, size * sizeof(*r_watts))) == NULL) {
+				goto nomem;
+			}
+			r_watts = p;
+			if ((p = realloc(r_joules, size * sizeof(*r_joules))) == NULL) {
+				goto nomem;
+			}
+			r_joules = p;
+		}
+		r_ns[nr] = sf_realtime_ns(&sf, &r.tstamp);
+		if (nr && (r_ns[nr] < r_ns[nr - 1])) {
+			/* out of order, can't happen with extech_rdr's files */
+			continue;
+		}
+		r_watts[nr] = r.watts;
+		r_joules[nr] = nr ? r_joules[nr - 1] +
+			((double)r_watts[nr - 1] * ((r_ns[nr] - r_ns[nr - 1]) / 1e9)) : 0;
+		nr++;
+	}
+	sf_close(&sf);
+
+	return 0;
+
+nomem:
+	sf_close(&sf);
+	fprintf(stderr, "no memory for the readings of '%s'\n", path);
+	return ENOMEM;
+}
+
+/*
+ * the energy from the first reading up to time ns
+ */
+ static double
+joules_to(int64_t ns)
+{
+	long lo, hi, mid;
+
+	if ((nr == 0) || (ns <= r_ns[0])) {
+		return 0;
+	}
+	if (ns >= r_ns[nr - 1]) {
+		return r_joules[nr - 1];
+	}
+
+	/* the last reading at or before ns */
+	lo = 0;
+	hi = nr - 1;
+	while (hi - lo > 1) {
+		mid = lo + ((hi - lo) / 2);
+		if (r_ns[mid] <= ns) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return r_joules[lo] + ((double)r_watts[lo] * ((ns - r_ns[lo]) / 1e9));
+}
+
+ static unsigned long
+hash(const char *s)
+{
+	unsigned long h = 5381;
+
+	while (*s) {
+		h = (h * 33) ^ (unsigned char)*s++;
+	}
+	return h;
+}
+
+/*
+ * returns the totals for label name, adding it if it's not there yet, or
+ * NULL if there's no memory for it.  a name too long for the table is
+ * cut down before it's looked for, so it's still the one entry.
+ */
+ static struct label *
+find_label(const char *name)
+{
+	struct label *old = labels;
+	unsigned long old_size = labels_size;
+	unsigned long i, j;
+	char key[LABEL_MAX];
+
+	if ((nlabels + 1) * 2 > labels_size) {
+		labels_size = labels_size ? labels_size * 2 : 1024;
+		labels = calloc(labels_size, sizeof(*labels));
+		if (labels == NULL) {
+			return NULL;
+		}
+		for (i = 0; i < old_size; i++) {
+			if (old[i].count) {
+				j = hash(old[i].name) & (labels_size - 1);
+				while (labels[j].count) {
+					j = (j + 1) & (labels_size - 1);
+				}
+				labels[j] = old[i];
+			}
+		}
+		free(old);
+	}
+
+	snprintf(key, sizeof(key), "%s", name);
+	j = hash(key) & (labels_size - 1);
+	while (labels[j].count && strcmp(labels[j].name, key)) {
+		j = (j + 1) & (labels_size - 1);
+	}
+	if (labels[j].count == 0) {
+		strcpy(labels[j].name, key);
+		nlabels++;
+	}
+
+	return &labels[j];
+}
+
+ static int
+by_joules(const void *a, const void *b)
+{
+	const struct label *la = a;
+	const struct label *lb = b;
+
+	return (la->joules < lb->joules) - (la->joules > lb->joules);
+}
+
+/*
+ * one line of the event log.  returns 0 if it's fine or there's nothing
+ * on it, -1 if it can't be made sense of, or errno.
+ */
+ static int
+event(char *line)
+{
+	struct label *l;
+	char *start, *end, *name;
+	int64_t a, b, ca, cb;
+	double j, secs, cover;
+
+	start = strtok(line, " \t\n");
+	if ((start == NULL) || (*start == '#')) {
+		return 0;
+	}
+	end = strtok(NULL, " \t\n");
+	name = strtok(NULL, "\n");
+	if ((end == NULL) || sf_parse_time(start, &a) || sf_parse_time(end, &b) ||
+		(b < a)) {
+		return -1;
+	}
+	while (name && isspace((unsigned char)*name)) {
+		name++;
+	}
+	if ((name == NULL) || (*name == 0)) {
+		name = "-";
+	}
+
+	j = joules_to(b) - joules_to(a);
+	secs = (b - a) / 1e9;
+	cover = 1.0;
+	if (b > a) {
+		ca = (nr && (a < r_ns[0])) ? r_ns[0] : a;
+		cb = (nr && (b > r_ns[nr - 1])) ? r_ns[nr - 1] : b;
+		cover = (nr && (cb > ca)) ? (double)(cb - ca) / (b - a) : 0;
+	}
+
+	if (!labels_opt) {
+		printf("%ld.%.3ld %10.3f %12.3f %10.6f %5.1f%% %s\n",
+			a / 1000000000, (a % 1000000000) / 1000000, secs, j, j / 3600.,
+			cover * 100, name);
+	}
+
+	l = find_label(name);
+	if (l == NULL) {
+		return ENOMEM;
+	}
+	l->count++;
+	l->joules += j;
+	l->secs += secs;
+
+	return 0;
+}
+
+
+ int
+main(int argc, char **argv) {
+	FILE *f;
+	char line[1024];
+	struct label *sorted;
+	unsigned long i, n;
+	long lineno = 0;
+	long nbad = 0;
+	int rc;
+
+	do {
+		rc = getopt_long(argc, argv, "", &ra_opts[0], NULL);
+		if ((rc == ':') || (rc == '?')) {
+			usage(argv);
+			exit(1);
+		}
+	} while (rc != -1);
+
+	if (optind + 2 != argc) {
+		usage(argv);
+		exit(1);
+	}
+
+	if (load(argv[optind])) {
+		exit(1);
+	}
+	if (nr == 0) {
+		fprintf(stderr, "no readings in '%s'\n", argv[optind]);
+		exit(1);
+	}
+
+	if (!strcmp(argv[optind + 1], "-")) {
+		f = stdin;
+	} else {
+		f = fopen(argv[optind + 1], "r");
+		if (f == NULL) {
+			fprintf(stderr, "open event log '%s' failed.  errno=%d\n",
+				argv[optind + 1], errno);
+			exit(1);
+		}
+	}
+
+	if (!labels_opt) {
+		printf("         start    seconds       joules watt-hours  cover "
+			"label\n");
+	}
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		rc = event(line);
+		if (rc > 0) {
+			fprintf(stderr, "no memory for more labels\n");
+			exit(1);
+		}
+		if (rc < 0) {
+			if (nbad++ < 10) {
+				fprintf(stderr, "line %ld: can't make sense of it\n", lineno);
+			}
+		}
+	}
+	if (f != stdin) {
+		fclose(f);
+	}
+	if (nbad) {
+		fprintf(stderr, "%ld lines of the event log skipped\n", nbad);
+	}
+
+	/* the label totals, biggest first */
+	sorted = malloc((nlabels ? nlabels : 1) * sizeof(*sorted));
+	if (sorted == NULL) {
+		fprintf(stderr, "no memory to sort the labels\n");
+		exit(1);
+	}
+	for (i = n = 0; i < labels_size; i++) {
+		if (labels[i].count) {
+			sorted[n++] = labels[i];
+		}
+	}
+	qsort(sorted, n, sizeof(*sorted), by_joules);
+
+	if (!labels_opt) {
+		printf("\n");
+	}
+	printf("  events      seconds       joules  watt-hours label\n");
+	for (i = 0; i < n; i++) {
+		printf("%8ld %12.3f %12.3f %11.6f %s\n", sorted[i].count,
+			sorted[i].secs, sorted[i].joules, sorted[i].joules / 3600.,
+			sorted[i].name);
+	}
+
+	return 0;
+}
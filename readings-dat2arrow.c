@@ -0,0 +1,547 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Program to convert a power meter binary readings store to an Apache
+ * Arrow IPC file, so pandas/polars/duckdb and friends can load readings
+ * straight off the disk instead of parsing readings-dat2ascii text.
+ *
+ * The columns are timestamp (nsecs since the epoch, UTC), watts, pf,
+ * volts and amps (32 bit floats, exactly as stored).  The storefile is
+ * mmapped and converted a record batch at a time, so memory use doesn't
+ * depend on the size of the capture.
+ *
+ * There's no Arrow library involved; the little bit of flatbuffers the
+ * IPC metadata needs is built by hand below.  Field and table ids come
+ * from Arrow's format/Schema.fbs, Message.fbs and File.fbs.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include "extech.h"
+#include "storefile.h"
+
+#define BATCH_ROWS 65536 /* default number of rows in a record batch */
+
+#define ARROW_MAGIC "ARROW1\0\0"
+#define ARROW_V5 4			/* MetadataVersion */
+#define ARROW_HDR_SCHEMA 1	/* MessageHeader union */
+#define ARROW_HDR_BATCH 3
+#define ARROW_TYPE_FLOAT 3	/* Type union */
+#define ARROW_TYPE_TIMESTAMP 10
+#define ARROW_SINGLE 1		/* Precision */
+#define ARROW_NANOSECOND 3	/* TimeUnit */
+
+#define NCOLS 5
+
+/*
+ * a flatbuffer, built front to back.  offsets in a flatbuffer can only
+ * point forward, so a table's offset fields are left as placeholders
+ * (fb_field.at says where) and patched once the child is written after it.
+ */
+struct fbb {
+	unsigned char *buf;
+	size_t len;
+	size_t size;
+};
+
+#define FB_OFFSET 0	/* fb_field.size for an offset to a child */
+
+struct fb_field {
+	int id;
+	int size;
+	uint64_t val;
+	size_t at;
+};
+
+/*
+ * Block, from File.fbs
+ */
+struct arrow_block {
+	int64_t offset;
+	int32_t meta_len;
+	int32_t pad;
+	int64_t body_len;
+};
+
+/*
+ * FieldNode and Buffer, from Message.fbs
+ */
+struct arrow_pair {
+	int64_t a;
+	int64_t b;
+};
+
+const char *col_names[NCOLS] = {"timestamp", "watts", "pf", "volts", "amps"};
+
+/*
+ * argument specification
+ */
+int batch_opt = 0;
+
+struct option da_opts[] = {
+	{
+		"batch",
+		required_argument,
+		&batch_opt,
+		1
+	},
+	{}
+};
+
+ void
+usage(char **args)
+{
+	printf("usage: %s [--batch=<rows>] <storefile> <arrow-file>\n", args[0]);
+}
+
+
+ static size_t
+fb_put(struct fbb *b, const void *p, size_t n)
+{
+	size_t pos;
+
+	if (b->len + n > b->size) {
+		b->size = (b->len + n) * 2;
+		b->buf = realloc(b->buf, b->size);
+		if (b->buf == NULL) {
+			fprintf(stderr, "out of memory building arrow metadata\n");
+			exit(1);
+		}
+	}
+	pos = b->len;
+	if (p) {
+		memcpy(b->buf + pos, p, n);
+	} else {
+		memset(b->buf + pos, 0, n);
+	}
+	b->len += n;
+
+	return pos;
+}
+
+ static size_t
+fb_pad(struct fbb *b, size_t align)
+{
+	while (b->len % align) {
+		fb_put(b, NULL, 1);
+	}
+	return b->len;
+}
+
+/*
+ * point the offset at 'at' to whatever is at 'target'
+ */
+ static void
+fb_patch(struct fbb *b, size_t at, size_t target)
+{
+	uint32_t o = target - at;
+
+	memcpy(b->buf + at, &o, sizeof(o));
+}
+
+/*
+ * write a vtable and a table.  fields are laid out in the order given,
+ * each aligned to its size.  returns the position of the table.
+ */
+ static size_t
+fb_table(struct fbb *b, struct fb_field *f, int n)
+{
+	uint16_t vt[2 + 16];
+	size_t vpos, tpos;
+	int32_t soff;
+	int i, sz, nids;
+	unsigned int pos;
+
+	memset(vt, 0, sizeof(vt));
+	nids = 0;
+	pos = sizeof(soff);
+	for (i = 0; i < n; i++) {
+		sz = f[i].size ?: sizeof(uint32_t);
+		pos = (pos + sz - 1) & ~(sz - 1);
+		f[i].at = pos;
+		vt[2 + f[i].id] = pos;
+		pos += sz;
+		if (f[i].id >= nids) {
+			nids = f[i].id + 1;
+		}
+	}
+	vt[0] = sizeof(uint16_t) * (2 + nids);
+	vt[1] = pos;
+
+	fb_pad(b, sizeof(uint16_t));
+	vpos = fb_put(b, vt, vt[0]);
+	tpos = fb_pad(b, 8);
+	fb_put(b, NULL, pos);
+
+	soff = tpos - vpos;
+	memcpy(b->buf + tpos, &soff, sizeof(soff));
+	for (i = 0; i < n; i++) {
+		f[i].at += tpos;
+		if (f[i].size) {
+			/* little endian, so the low bytes are the value */
+			memcpy(b->buf + f[i].at, &f[i].val, f[i].size);
+		}
+	}
+
+	return tpos;
+}
+
+/*
+ * a vector of scalars or structs.  if elems is NULL the elements are
+ * zeroed, which is how a vector of offsets to be patched is made.
+ * returns the position of the length, which is what offsets point at.
+ */
+ static size_t
+fb_vector(struct fbb *b, const void *elems, uint32_t n, size_t elsize,
+	size_t align)
+{
+	size_t pos;
+
+	/* the elements, not the length in front of them, need the alignment */
+	while ((b->len + sizeof(n)) % align) {
+		fb_put(b, NULL, 1);
+	}
+	pos = fb_put(b, &n, sizeof(n));
+	fb_put(b, elems, n * elsize);
+
+	return pos;
+}
+
+ static size_t
+fb_string(struct fbb *b, const char *s)
+{
+	uint32_t n = strlen(s);
+	size_t pos;
+
+	fb_pad(b, sizeof(n));
+	pos = fb_put(b, &n, sizeof(n));
+	fb_put(b, s, n + 1);
+
+	return pos;
+}
+
+/*
+ * the Schema table: a UTC nsec timestamp and four 32 bit floats, none
+ * of them nullable
+ */
+ static size_t
+fb_schema(struct fbb *b)
+{
+	struct fb_field sch[] = {{1, FB_OFFSET}};
+	struct fb_field fld[] = {
+		{0, FB_OFFSET},		/* name */
+		{1, 1, 0},			/* nullable */
+		{2, 1, 0},			/* type_type */
+		{3, FB_OFFSET},		/* type */
+		{5, FB_OFFSET},		/* children */
+	};
+	struct fb_field ts[] = {{0, 2, ARROW_NANOSECOND}, {1, FB_OFFSET}};
+	struct fb_field fp[] = {{0, 2, ARROW_SINGLE}};
+	size_t tpos, vpos, pos;
+	int c;
+
+	tpos = fb_table(b, sch, 1);
+	vpos = fb_vector(b, NULL, NCOLS, sizeof(uint32_t), sizeof(uint32_t));
+	fb_patch(b, sch[0].at, vpos);
+
+	for (c = 0; c < NCOLS; c++) {
+		fld[2].val = c ? ARROW_TYPE_FLOAT : ARROW_TYPE_TIMESTAMP;
+		pos = fb_table(b, fld, 5);
+		fb_patch(b, vpos + sizeof(uint32_t) * (c + 1), pos);
+		fb_patch(b, fld[0].at, fb_string(b, col_names[c]));
+		if (c == 0) {
+			fb_patch(b, fld[3].at, fb_table(b, ts, 2));
+			fb_patch(b, ts[1].at, fb_string(b, "UTC"));
+		} else {
+			fb_patch(b, fld[3].at, fb_table(b, fp, 1));
+		}
+		fb_patch(b, fld[4].at, fb_vector(b, NULL, 0, sizeof(uint32_t),
+			sizeof(uint32_t)));
+	}
+
+	return tpos;
+}
+
+/*
+ * a Message table with the given header type, at the root of a fresh
+ * flatbuffer.  the header table itself has to be written next, and
+ * patched in at msg->at.
+ */
+ static void
+fb_message(struct fbb *b, struct fb_field *msg, int hdr_type, int64_t body_len)
+{
+	struct fb_field m[] = {
+		{3, 8, body_len},	/* bodyLength */
+		{0, 2, ARROW_V5},	/* version */
+		{1, 1, hdr_type},	/* header_type */
+		{2, FB_OFFSET},		/* header */
+	};
+
+	b->len = 0;
+	fb_put(b, NULL, sizeof(uint32_t));	/* root offset */
+	fb_patch(b, 0, fb_table(b, m, 4));
+	*msg = m[3];
+}
+
+/*
+ * write an encapsulated IPC message: continuation marker, metadata
+ * length, the flatbuffer padded out to 8 bytes.  the body, if any, is
+ * up to the caller.  returns 0 or errno.
+ */
+ static int
+write_message(int fd, struct fbb *b, int64_t *fpos, int32_t *meta_len)
+{
+	uint32_t pfx[2];
+	int ret;
+
+	fb_pad(b, 8);
+	pfx[0] = 0xffffffff;
+	pfx[1] = b->len;
+	ret = sf_write_all(fd, pfx, sizeof(pfx));
+	if (ret == 0) {
+		ret = sf_write_all(fd, b->buf, b->len);
+	}
+	*meta_len = sizeof(pfx) + b->len;
+	*fpos += *meta_len;
+
+	return ret;
+}
+
+/*
+ * the columns of the record batch being built
+ */
+int64_t *c_ts;
+float *c_val[NCOLS - 1];
+long c_rows;
+
+struct arrow_block *blocks;
+int nblocks;
+
+/*
+ * write the rows collected so far as a record batch
+ */
+ static int
+write_batch(int fd, struct fbb *b, int64_t *fpos)
+{
+	static const char zeros[64];
+	struct fb_field msg;
+	struct fb_field rb[] = {
+		{0, 8, 0},			/* length */
+		{1, FB_OFFSET},		/* nodes */
+		{2, FB_OFFSET},		/* buffers */
+	};
+	struct arrow_pair nodes[NCOLS];
+	struct arrow_pair bufs[NCOLS * 2];
+	const void *data[NCOLS];
+	int64_t len[NCOLS];
+	int64_t body_len;
+	int64_t start;
+	int ret;
+	int c;
+
+	/*
+	 * each column is an empty validity bitmap and the values, padded
+	 * to 64 bytes
+	 */
+	body_len = 0;
+	for (c = 0; c < NCOLS; c++) {
+		data[c] = c ? (void *)c_val[c - 1] : (void *)c_ts;
+		len[c] = c_rows * (c ? sizeof(float) : sizeof(int64_t));
+		nodes[c].a = c_rows;
+		nodes[c].b = 0;
+		bufs[c * 2].a = body_len;
+		bufs[c * 2].b = 0;
+		bufs[(c * 2) + 1].a = body_len;
+		bufs[(c * 2) + 1].b = len[c];
+		body_len += (len[c] + 63) & ~63;
+	}
+
+	rb[0].val = c_rows;
+	fb_message(b, &msg, ARROW_HDR_BATCH, body_len);
+	fb_patch(b, msg.at, fb_table(b, rb, 3));
+	fb_patch(b, rb[1].at, fb_vector(b, nodes, NCOLS, sizeof(nodes[0]), 8));
+	fb_patch(b, rb[2].at, fb_vector(b, bufs, NCOLS * 2, sizeof(bufs[0]), 8));
+
+	blocks = realloc(blocks, (nblocks + 1) * sizeof(*blocks));
+	if (blocks == NULL) {
+		return ENOMEM;
+	}
+	start = *fpos;
+	ret = write_message(fd, b, fpos, &blocks[nblocks].meta_len);
+	for (c = 0; (c < NCOLS) && (ret == 0); c++) {
+		ret = sf_write_all(fd, data[c], len[c]);
+		if (ret == 0) {
+			ret = sf_write_all(fd, zeros, ((len[c] + 63) & ~63) - len[c]);
+		}
+	}
+	blocks[nblocks].offset = start;
+	blocks[nblocks].pad = 0;
+	blocks[nblocks].body_len = body_len;
+	nblocks++;
+	*fpos += body_len;
+	c_rows = 0;
+
+	return ret;
+}
+
+/*
+ * the end of stream marker, then the footer, which is how readers find
+ * the schema and all the record batches without scanning the file
+ */
+ static int
+write_footer(int fd, struct fbb *b)
+{
+	uint32_t eos[2] = {0xffffffff, 0};
+	struct fb_field ft[] = {
+		{0, 2, ARROW_V5},	/* version */
+		{1, FB_OFFSET},		/* schema */
+		{3, FB_OFFSET},		/* recordBatches */
+	};
+	int32_t flen;
+	int ret;
+
+	b->len = 0;
+	fb_put(b, NULL, sizeof(uint32_t));
+	fb_patch(b, 0, fb_table(b, ft, 3));
+	fb_patch(b, ft[1].at, fb_schema(b));
+	fb_patch(b, ft[2].at, fb_vector(b, blocks, nblocks, sizeof(*blocks), 8));
+	fb_pad(b, 8);
+	flen = b->len;
+
+	ret = sf_write_all(fd, eos, sizeof(eos));
+	if (ret == 0) {
+		ret = sf_write_all(fd, b->buf, b->len);
+	}
+	if (ret == 0) {
+		ret = sf_write_all(fd, &flen, sizeof(flen));
+	}
+	if (ret == 0) {
+		ret = sf_write_all(fd, ARROW_MAGIC, 6);
+	}
+
+	return ret;
+}
+
+
+ int
+main(int argc, char **argv) {
+	int rc;
+	int argx;
+	int outfd;
+	long batch = BATCH_ROWS;
+	long nrows = 0;
+	long nbad = 0;
+	int64_t fpos;
+	int32_t meta_len;
+	struct storefile sf;
+	struct reading reading;
+	struct fbb b = {};
+	struct fb_field msg;
+	int c;
+
+	do {
+		rc = getopt_long(argc, argv, "", &da_opts[0], &argx);
+		if ((rc == ':') || (rc == '?')) {
+				usage(argv);
+				exit(1);
+		}
+		if ((rc == 0) && (da_opts[argx].flag == &batch_opt)) {
+			batch = strtol(optarg, NULL, 0);
+			if (batch <= 0) {
+				printf("batch size must be a positive number of rows\n");
+				exit(1);
+			}
+		}
+	} while (rc != -1);
+
+	if ((argv[optind] == NULL) || (argv[optind + 1] == NULL)) {
+		usage(argv);
+		exit(1);
+	}
+
+	rc = sf_open(&sf, argv[optind]);
+	if (rc) {
+		fprintf(stderr, "open storefile '%s' failed.  errno=%d\n",
+			argv[optind], rc);
+		exit(1);
+	}
+
+	outfd = open(argv[optind + 1], O_CREAT | O_EXCL | O_WRONLY, 0644);
+	if (outfd < 0) {
+		fprintf(stderr, "create arrow file '%s' failed.  errno=%d\n",
+			argv[optind + 1], errno);
+		exit(1);
+	}
+
+	c_ts = malloc(batch * sizeof(*c_ts));
+	rc = (c_ts == NULL);
+	for (c = 0; c < NCOLS - 1; c++) {
+		c_val[c] = malloc(batch * sizeof(float));
+		rc |= (c_val[c] == NULL);
+	}
+	if (rc) {
+		fprintf(stderr, "no memory for a %ld row batch\n", batch);
+		exit(1);
+	}
+
+	/*
+	 * file magic, then the schema message, then the batches
+	 */
+	rc = sf_write_all(outfd, ARROW_MAGIC, 8);
+	fpos = 8;
+	if (rc == 0) {
+		fb_message(&b, &msg, ARROW_HDR_SCHEMA, 0);
+		fb_patch(&b, msg.at, fb_schema(&b));
+		rc = write_message(outfd, &b, &fpos, &meta_len);
+	}
+
+	while ((rc == 0) && ((c = sf_read(&sf, &reading)) != 0)) {
+		if (c < 0) {
+			nbad++;
+			continue;
+		}
+		c_ts[c_rows] = sf_realtime_ns(&sf, &reading.tstamp);
+		c_val[0][c_rows] = reading.watts;
+		c_val[1][c_rows] = reading.pf;
+		c_val[2][c_rows] = reading.volts;
+		c_val[3][c_rows] = reading.amps;
+		c_rows++;
+		nrows++;
+		if (c_rows == batch) {
+			rc = write_batch(outfd, &b, &fpos);
+		}
+	}
+	if ((rc == 0) && c_rows) {
+		rc = write_batch(outfd, &b, &fpos);
+	}
+	if (rc == 0) {
+		rc = write_footer(outfd, &b);
+	}
+	sf_close(&sf);
+
+	if (close(outfd) && (rc == 0)) {
+		rc = errno;
+	}
+	if (rc) {
+		fprintf(stderr, "writing '%s' failed.  errno=%d\n", argv[optind + 1],
+			rc);
+		unlink(argv[optind + 1]);
+		exit(1);
+	}
+
+	if (nbad) {
+		fprintf(stderr, "%ld readings failed conversion and were left out\n",
+			nbad);
+	}
+	printf("wrote %ld readings in %d record batches to %s\n", nrows, nblocks,
+		argv[optind + 1]);
+
+	return 0;
+}
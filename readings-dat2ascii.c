@@ -3,11 +3,29 @@
  * Copyright 2017, Andrew Sharp
  *
  * Program to convert power meter binary readings store to ascii
+ *
+ * Reads either version of storefile.  Raw meter words in a version 2
+ * storefile are decoded here, with the same decoder extech_rdr uses.
+ *
+ * A storefile written with extech_rdr --deadband only has the readings
+ * that changed.  Each of those held until the next one, so the readings
+ * left out are put back as copies of the one before them, one per
+ * sampling period, unless --changes is given.
+ *
+ * --top=K and --bottom=K output just the K readings with the highest or
+ * lowest watts (or pf, volts or amps, with --by), highest or lowest
+ * first, and --rank outputs all of them, highest first.  Whole readings
+ * are output, so the fields that go with the watts stay with them.  Top
+ * and bottom keep a heap of K readings as they go, so any size of file
+ * takes no more memory than K readings; ranking them all radix sorts the
+ * bits of the field.  Deadband files are ranked on the stored readings
+ * only.
  */
 
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <time.h>
 #include <sys/time.h>
@@ -15,45 +33,18 @@
 #include <string.h>
 #include <getopt.h>
 #include "extech.h"
+#include "storefile.h"
 
-struct timespec startclk;
+struct storefile sf;
 
 /*
- * function to FUNCTIONALLY subtract a monotonic timespec value from
- * a realtime clock timespec value.  using the first monotonic value
- * it's called with as a base, and all the rest considered as a delta
- * from that one.
+ * a reading, and its sort key: the bits of the field it's ranked by,
+ * turned into an unsigned integer that sorts the same way
  */
- void
-correct_tstamp(struct timespec stmp, struct timeval *r)
-{
-	static struct timespec s1;
-	static unsigned long wrap;
-
-	stmp.tv_nsec = (stmp.tv_nsec / 4000000) * 4000; /* accur. is 4ms */
-	r->tv_sec = startclk.tv_sec;
-	r->tv_usec = (startclk.tv_nsec / 4000000) * 4000;
-
-	/*
-	 * everything is in msecs from here on
-	 */
-	if (s1.tv_sec == s1.tv_nsec == 0L) {
-		s1 = stmp;
-		wrap = 1000000 - s1.tv_nsec;
-	} else {
-		r->tv_sec = r->tv_sec + (stmp.tv_sec - s1.tv_sec);
-		if (stmp.tv_nsec < s1.tv_nsec) {
-			r->tv_usec = r->tv_usec + (wrap + stmp.tv_nsec);
-			r->tv_sec--;
-		} else {
-			r->tv_usec = r->tv_usec + (stmp.tv_nsec - s1.tv_nsec);
-		}
-		if (r->tv_usec > 1000000) {
-			r->tv_usec -= 1000000;
-			r->tv_sec++;
-		}
-	}
-}
+struct ranked {
+	uint32_t key;
+	struct reading r;
+};
 
 /*
  * argument specification
@@ -61,6 +52,15 @@ correct_tstamp(struct timespec stmp, struct timeval *r)
 int raw = 0; /* means output raw timestamp rather than ascii date/time */
 int processed = 1; /* means output ascii date/time timestamp */
 int maxv = 0; /* process the input file; only output the max's of each field */
+int changes = 0; /* deadband storefile: only output the stored readings */
+int timing = 0; /* raw storefile: output the trigger and read times too */
+int top_opt = 0; /* only the K highest readings */
+int bottom_opt = 0; /* only the K lowest readings */
+int rank_opt = 0; /* all the readings, highest first */
+int by_opt = 0;
+
+long rank_k;
+int rank_field; /* 0-3: watts, pf, volts, amps */
 
 struct option da_opts[] = {
 	{
@@ -81,6 +81,42 @@ struct option da_opts[] = {
 		&maxv,
 		1
 	},
+	{
+		"changes",
+		no_argument,
+		&changes,
+		1
+	},
+	{
+		"timing",
+		no_argument,
+		&timing,
+		1
+	},
+	{
+		"top",
+		required_argument,
+		&top_opt,
+		1
+	},
+	{
+		"bottom",
+		required_argument,
+		&bottom_opt,
+		1
+	},
+	{
+		"rank",
+		no_argument,
+		&rank_opt,
+		1
+	},
+	{
+		"by",
+		required_argument,
+		&by_opt,
+		1
+	},
 	{}
 };
 
@@ -98,17 +134,247 @@ usage(char **args)
 }
 
 
+/*
+ * output one reading.  with --timing, a raw storefile's reading is
+ * followed by how many msecs before the time it was taken the trigger
+ * was written, and how many after it the reading had been read.
+ */
+ static void
+output(struct reading *r)
+{
+	struct tm tm;
+	char tst[128];
+	int64_t ns;
+	time_t t;
+
+	ns = sf_realtime_ns(&sf, &r->tstamp);
+	t = ns / 1000000000;
+	if (raw) {
+		printf("%ld.%.3ld ", (long)t, (long)(ns % 1000000000) / 1000000);
+	}
+	if (processed) {
+		localtime_r(&t, &tm);
+		strftime(tst, sizeof(tst), "%a %b %e %H:%M:%S", &tm);
+		printf("%s.%.3ld %d ", tst, (long)(ns % 1000000000) / 1000000,
+			tm.tm_year + 1900);
+	}
+	printf("%7.3f %7.3f %7.3f %7.3f", r->watts, r->pf, r->volts, r->amps);
+	if (timing) {
+		printf(" %6.3f %6.3f", sf.trig_us / 1000., sf.done_us / 1000.);
+	}
+	printf("\n");
+}
+/*
+ * floats sort the same as these: positive ones with the sign bit set, so
+ * they come after the negatives, and negative ones with all the bits
+ * flipped, so bigger magnitudes come first
+ */
+ static uint32_t
+rank_key(const struct reading *r)
+{
+	uint32_t u;
+	float f;
+
+	switch (rank_field) {
+		case 1:
+			f = r->pf;
+			break;
+		case 2:
+			f = r->volts;
+			break;
+		case 3:
+			f = r->amps;
+			break;
+		default:
+			f = r->watts;
+			break;
+	}
+	memcpy(&u, &f, sizeof(u));
+
+	return (u & 0x80000000) ? ~u : (u | 0x80000000);
+}
+
+/*
+ * a min heap on key: the smallest of the readings kept is at the top,
+ * ready to be pushed out by a bigger one
+ */
+ static void
+heap_down(struct ranked *h, long n, long i)
+{
+	struct ranked t;
+	long c;
+
+	while ((c = (2 * i) + 1) < n) {
+		if ((c + 1 < n) && (h[c + 1].key < h[c].key)) {
+			c++;
+		}
+		if (h[i].key <= h[c].key) {
+			break;
+		}
+		t = h[i];
+		h[i] = h[c];
+		h[c] = t;
+		i = c;
+	}
+}
+
+/*
+ * the K highest (or with --bottom, lowest, by ranking on the key turned
+ * upside down) readings.  returns 0 on success, errno on failure.
+ */
+ static int
+top_k(void)
+{
+	struct ranked *h;
+	struct ranked t;
+	struct reading r;
+	long n = 0;
+	long i;
+	uint32_t key;
+	int rc;
+
+	h = malloc(rank_k * sizeof(*h));
+	if (h == NULL) {
+		return ENOMEM;
+	}
+	while ((rc = sf_read(&sf, &r)) != 0) {
+		if (rc < 0) {
+			fprintf(stderr, "reading %ld failed conversion\n", sf.next - 1);
+			continue;
+		}
+		key = bottom_opt ? ~rank_key(&r) : rank_key(&r);
+		if (n < rank_k) {
+			/* not full yet: add it at the bottom and sift it up */
+			i = n++;
+			h[i].key = key;
+			h[i].r = r;
+			while ((i > 0) && (h[(i - 1) / 2].key > h[i].key)) {
+				t = h[i];
+				h[i] = h[(i - 1) / 2];
+				h[(i - 1) / 2] = t;
+				i = (i - 1) / 2;
+			}
+		} else if (key > h[0].key) {
+			h[0].key = key;
+			h[0].r = r;
+			heap_down(h, n, 0);
+		}
+	}
+
+	/* taking the top off each time leaves them biggest first at the end */
+	for (i = n - 1; i > 0; i--) {
+		t = h[0];
+		h[0] = h[i];
+		h[i] = t;
+		heap_down(h, i, 0);
+	}
+	for (i = 0; i < n; i++) {
+		output(&h[i].r);
+	}
+	free(h);
+
+	return 0;
+}
+
+/*
+ * all the readings, highest first: an LSD radix sort, a byte at a time,
+ * of the keys with the readings' indexes, then the readings in that order.
+ * it's stable, so equal readings stay in time order.  returns 0 on
+ * success, errno on failure.
+ */
+ static int
+rank_all(void)
+{
+	struct reading *rd = NULL;
+	uint64_t *a = NULL, *b = NULL, *t;
+	struct reading r;
+	long count[256];
+	long n = 0, size = 0;
+	long i, sum, c;
+	void *p;
+	int shift;
+	int rc;
+
+	while ((rc = sf_read(&sf, &r)) != 0) {
+		if (rc < 0) {
+			fprintf(stderr, "reading %ld failed conversion\n", sf.next - 1);
+			continue;
+		}
+		if (n == size) {
+			size = size ? size * 2 : 65536;
+			if ((p = realloc(rd, size * sizeof(*rd))) == NULL) {
+				goto nomem;
+			}
+			rd = p;
+			if ((p = realloc(a, size * sizeof(*a))) == NULL) {
+				goto nomem;
+			}
+			a = p;
+		}
+		rd[n] = r;
+		/* the key turned upside down, so ascending order is highest first */
+		a[n] = ((uint64_t)~rank_key(&r) << 32) | (uint32_t)n;
+		n++;
+	}
+	b = malloc((n ? n : 1) * sizeof(*b));
+	if (b == NULL) {
+		goto nomem;
+	}
+
+	for (shift = 32; (shift < 64) && n; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++) {
+			count[(a[i] >> shift) & 0xff]++;
+		}
+		if (count[(a[0] >> shift) & 0xff] == n) {
+			/* they all have the same byte here */
+			continue;
+		}
+		for (i = sum = 0; i < 256; i++) {
+			c = count[i];
+			count[i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++) {
+			b[count[(a[i] >> shift) & 0xff]++] = a[i];
+		}
+		t = a;
+		a = b;
+		b = t;
+	}
+
+	for (i = 0; i < n; i++) {
+		output(&rd[(uint32_t)a[i]]);
+	}
+	free(rd);
+	free(a);
+	free(b);
+
+	return 0;
+
+nomem:
+	free(rd);
+	free(a);
+	free(b);
+	return ENOMEM;
+}
+
+
  int
 main(int argc, char **argv) {
 	int rc;
-	int storefile;
 	struct reading reading;
-	struct reading m;
-	struct timeval tvstamp;
-	char tst[128];
+	struct reading m = {{0, 0}, 0, 0, 0, 0};
+	struct reading prev;
+	struct reading peak;
+	int have_prev = 0;
+	int have_peak = 0;
+	long fill_ns = 0;
+	int argx;
+	static const char *fields[] = { "watts", "pf", "volts", "amps" };
 
 	do {
-		rc = getopt_long(argc, argv, "", &da_opts[0], NULL);
+		rc = getopt_long(argc, argv, "", &da_opts[0], &argx);
 		if ((rc == ':') || (rc == '?')) {
 				usage(argv);
 				exit(1);
@@ -116,8 +382,31 @@ main(int argc, char **argv) {
 		if (rc == -1) {
 			break;
 		}
+		if ((rc == 0) && (da_opts[argx].flag == &by_opt)) {
+			for (rank_field = 3; rank_field > 0; rank_field--) {
+				if (!strcmp(optarg, fields[rank_field])) {
+					break;
+				}
+			}
+			if (strcmp(optarg, fields[rank_field])) {
+				printf("--by takes watts, pf, volts or amps\n");
+				exit(1);
+			}
+		} else if ((rc == 0) && (da_opts[argx].has_arg == required_argument)) {
+			rank_k = atol(optarg);
+			if (rank_k <= 0) {
+				printf("--%s takes a positive number of readings\n",
+					da_opts[argx].name);
+				exit(1);
+			}
+		}
 	} while (1);
 
+	if (top_opt + bottom_opt + rank_opt + maxv > 1) {
+		printf("only one of --top, --bottom, --rank and --max at a time\n");
+		exit(1);
+	}
+
 	if ((argv[optind] == NULL) || (strlen(argv[optind]) == 0)) {
 		printf("first argument must be name of file to read\n");
 		exit(1);
@@ -128,66 +417,108 @@ main(int argc, char **argv) {
 	}
 
 	/*
-	 * save the readings in a binary file
+	 * read the readings from the binary file
 	 */
-	storefile = open(argv[optind], O_RDONLY);
-	if (storefile < 0 ) {
-		fprintf(stderr, "open storefile failed.  open returned '%d' errno=%d\n",
-		storefile, errno);
-	} else {
-		rc = read(storefile, &startclk, sizeof(struct timespec));
-		if (rc != sizeof(struct timespec)) {
-			printf("failed to read start clock value from storefile - %d\n",
-				rc);
-		} else {
-			if (!maxv) {
-				if (raw) {
-					printf("     timestamp   watts      pf   volts    amps\n");
-				}
-				if (processed) {
-					printf("                   timestamp   watts      pf   volts    amps\n");
-				}
-			}
-			while ((rc = read(storefile, &reading, sizeof(struct reading))) ==
-				sizeof(struct reading)) {
+	rc = sf_open(&sf, argv[optind]);
+	if (rc) {
+		fprintf(stderr, "open storefile '%s' failed.  errno=%d\n",
+			argv[optind], rc);
+		exit(1);
+	}
+	if ((sf.flags & SF_FLAG_DEADBAND) && !changes) {
+		fill_ns = sf.period_us * 1000L;
+	}
+	if ((sf.layout != SF_LAYOUT_RAW) || top_opt || bottom_opt || rank_opt) {
+		timing = 0;
+	}
 
-				correct_tstamp((struct timespec)reading.tstamp, &tvstamp);
-				if (raw & (!maxv)) {
-					printf("%ld.%.3ld ",
-						tvstamp.tv_sec, tvstamp.tv_usec / 1000);
-				}
-				if (processed & (!maxv)) {
-					asctime_r(localtime((time_t *)&tvstamp.tv_sec), tst);
-					sprintf(&tst[strlen(tst) - 6], ".%.3ld 2017",
-						tvstamp.tv_usec / 1000);
-					printf("%s ", tst);
-				}
-				if (!maxv) {
-					printf("%7.3f %7.3f %7.3f %7.3f\n", reading.watts,
-						reading.pf, reading.volts, reading.amps);
-				} else {
-					if (reading.watts > m.watts) {
-						m.watts = reading.watts;
-					}
-					if (reading.pf > m.pf) {
-						m.pf = reading.pf;
-					}
-					if (reading.volts > m.volts) {
-						m.volts = reading.volts;
+	if (!maxv) {
+		if (raw) {
+			printf("     timestamp   watts      pf   volts    amps%s\n",
+				timing ? "   trig   done" : "");
+		}
+		if (processed) {
+			printf("                   timestamp   watts      pf   volts"
+				"    amps%s\n", timing ? "   trig   done" : "");
+		}
+	}
+	if (maxv && (sf.layout == SF_LAYOUT_COLUMNS)) {
+		/*
+		 * straight off the mapped columns, a field at a time, and then
+		 * there's nothing left for the loop below to read
+		 */
+		m.watts = sf.nrecs ? col_max(sf.col[COL_WATTS], sf.nrecs) : 0;
+		m.pf = sf.nrecs ? col_max(sf.col[COL_PF], sf.nrecs) : 0;
+		m.volts = sf.nrecs ? col_max(sf.col[COL_VOLTS], sf.nrecs) : 0;
+		m.amps = sf.nrecs ? col_max(sf.col[COL_AMPS], sf.nrecs) : 0;
+		sf.next = col_argmax(sf.col[COL_WATTS], sf.nrecs);
+		have_peak = (sf.next >= 0) && (sf_read(&sf, &peak) > 0);
+		sf.next = sf.nrecs;
+	}
+	if (top_opt || bottom_opt || rank_opt) {
+		rc = rank_opt ? rank_all() : top_k();
+		if (rc) {
+			fprintf(stderr, "no memory for the readings\n");
+			exit(1);
+		}
+		sf_close(&sf);
+		return 0;
+	}
+	while ((rc = sf_read(&sf, &reading)) != 0) {
+		if (rc < 0) {
+			fprintf(stderr, "reading %ld failed conversion\n", sf.next - 1);
+			continue;
+		}
+		if (!maxv) {
+			/*
+			 * fill in what the deadband left out before this reading
+			 */
+			if (have_prev && fill_ns) {
+				for (;;) {
+					prev.tstamp.tv_nsec += fill_ns;
+					if (prev.tstamp.tv_nsec >= 1000000000) {
+						prev.tstamp.tv_nsec -= 1000000000;
+						prev.tstamp.tv_sec++;
 					}
-					if (reading.amps > m.amps) {
-						m.amps = reading.amps;
+					if (((reading.tstamp.tv_sec - prev.tstamp.tv_sec) *
+						1000000000L) + (reading.tstamp.tv_nsec -
+						prev.tstamp.tv_nsec) < fill_ns / 2) {
+						break;
 					}
+					output(&prev);
 				}
 			}
-
-			if (maxv) {
-				printf("  watts      pf   volts    amps\n");
-				printf("%7.3f %7.3f %7.3f %7.3f\n", m.watts, m.pf, m.volts,
-					m.amps);
+			prev = reading;
+			have_prev = 1;
+			output(&reading);
+		} else {
+			if (!have_peak || (reading.watts > peak.watts)) {
+				peak = reading;
+				have_peak = 1;
+			}
+			if (reading.watts > m.watts) {
+				m.watts = reading.watts;
+			}
+			if (reading.pf > m.pf) {
+				m.pf = reading.pf;
+			}
+			if (reading.volts > m.volts) {
+				m.volts = reading.volts;
+			}
+			if (reading.amps > m.amps) {
+				m.amps = reading.amps;
 			}
 		}
-		close(storefile);
 	}
-}
 
+	if (maxv) {
+		printf("  watts      pf   volts    amps\n");
+		printf("%7.3f %7.3f %7.3f %7.3f\n", m.watts, m.pf, m.volts,
+			m.amps);
+		if (have_peak) {
+			printf("reading at peak watts:\n");
+			output(&peak);
+		}
+	}
+	sf_close(&sf);
+}
@@ -0,0 +1,337 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Program to pick the readings out of storefiles that match an
+ * expression, like
+ *
+ *	readings-filter --where='watts > 150 and pf < 0.85' \
+ *		--from='2019-03-01 09:00:00' --to='2019-03-01 17:00:00' run.dat
+ *
+ * and output them, or just how many there are (--count), or the min,
+ * mean and max of each field over them (--stats).  See filter.h for
+ * what an expression can be.
+ *
+ * The expression is run over a block of readings at a time as columns,
+ * a field at a time, with vector compares making bitmaps of which
+ * readings pass.  A storefile written with extech_rdr --columns is that
+ * already, straight out of the mapped file, so only the fields in the
+ * expression get read at all; the other layouts are put into columns a
+ * block at a time first.  Deadband storefiles are filtered on the
+ * readings stored, without the copies readings-dat2ascii fills in.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <float.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include "extech.h"
+#include "storefile.h"
+#include "filter.h"
+
+/*
+ * argument specification
+ */
+int where_opt = 0;
+int from_opt = 0;
+int to_opt = 0;
+int count_opt = 0; /* only how many passed */
+int stats_opt = 0; /* only the min/mean/max of what passed */
+
+struct option rf_opts[] = {
+	{
+		"where",
+		required_argument,
+		&where_opt,
+		1
+	},
+	{
+		"from",
+		required_argument,
+		&from_opt,
+		1
+	},
+	{
+		"to",
+		required_argument,
+		&to_opt,
+		1
+	},
+	{
+		"count",
+		no_argument,
+		&count_opt,
+		1
+	},
+	{
+		"stats",
+		no_argument,
+		&stats_opt,
+		1
+	},
+	{}
+};
+
+struct filter flt;
+int64_t win_from = INT64_MIN;
+int64_t win_to = INT64_MAX;
+
+/*
+ * what's passed so far, over all the files
+ */
+long nseen;
+long npassed;
+double sum[COL_NFIELDS];
+float min[COL_NFIELDS] = {FLT_MAX, FLT_MAX, FLT_MAX, FLT_MAX};
+float max[COL_NFIELDS] = {-FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX};
+
+/*
+ * a block of readings put into columns, for the layouts that aren't
+ */
+int64_t blk_ns[FLT_BLOCK];
+float blk_v[COL_NFIELDS][FLT_BLOCK];
+
+ void
+usage(char **args)
+{
+	printf("usage: %s --where=<expression> [--from=<time>] [--to=<time>] "
+		"[--count|--stats] <storefile> ...\n", args[0]);
+	printf("An expression compares watts, pf, volts or amps to numbers with "
+		"<, <=, >, >=, ==\nand !=, put together with and, or, not and "
+		"parentheses.\n");
+	printf("Times are local 'YYYY-MM-DD HH:MM:SS[.fff]' or seconds since "
+		"the epoch.\n");
+}
+
+/*
+ * the readings of a block that passed: ns[i] + off is reading i's
+ * realtime, in nsecs, and v its fields
+ */
+ static void
+take(const int64_t *ns, int64_t off, const float *const *v, long n,
+	const uint64_t *sel)
+{
+	uint64_t bits;
+	int64_t t;
+	long w, i;
+	int f;
+
+	nseen += n;
+	for (w = 0; w < (n + 63) / 64; w++) {
+		npassed += __builtin_popcountll(sel[w]);
+	}
+	if (count_opt) {
+		return;
+	}
+
+	for (w = 0; w < (n + 63) / 64; w++) {
+		for (bits = sel[w]; bits; bits &= bits - 1) {
+			i = (w * 64) + __builtin_ctzll(bits);
+			if (stats_opt) {
+				for (f = 0; f < COL_NFIELDS; f++) {
+					sum[f] += v[f][i];
+					if (v[f][i] < min[f]) {
+						min[f] = v[f][i];
+					}
+					if (v[f][i] > max[f]) {
+						max[f] = v[f][i];
+					}
+				}
+				continue;
+			}
+			t = ns[i] + off;
+			printf("%ld.%.3ld %7.3f %7.3f %7.3f %7.3f\n", t / 1000000000,
+				(t % 1000000000) / 1000000, v[COL_WATTS][i], v[COL_PF][i],
+				v[COL_VOLTS][i], v[COL_AMPS][i]);
+		}
+	}
+}
+
+/*
+ * a columns storefile: the expression runs right on the mapped columns
+ */
+ static void
+filter_columns(struct storefile *sf)
+{
+	static uint64_t sel[FLT_WORDS];
+	const float *v[COL_NFIELDS];
+	struct timespec zero = {0, 0};
+	int64_t off;
+	long i, n, lo, hi, mid;
+	int f;
+
+	/* the columns are monotonic time; this makes them realtime */
+	off = sf_realtime_ns(sf, &zero);
+
+	sf_seek_ns(sf, win_from);
+	for (i = sf->next; (i < sf->nrecs) && (sf->col_ns[i] + off < win_from);
+		i++) {
+		;
+	}
+	for (; i < sf->nrecs; i += n) {
+		n = (sf->nrecs - i < FLT_BLOCK) ? sf->nrecs - i : FLT_BLOCK;
+		if (sf->col_ns[i + n - 1] + off >= win_to) {
+			/* the end of the window is in this block */
+			lo = i;
+			hi = i + n;
+			while (lo < hi) {
+				mid = lo + ((hi - lo) / 2);
+				if (sf->col_ns[mid] + off < win_to) {
+					lo = mid + 1;
+				} else {
+					hi = mid;
+				}
+			}
+			n = lo - i;
+			if (n == 0) {
+				break;
+			}
+		}
+		for (f = 0; f < COL_NFIELDS; f++) {
+			v[f] = sf->col[f] + i;
+		}
+		flt_eval(&flt, v, n, sel);
+		take(&sf->col_ns[i], off, v, n, sel);
+	}
+}
+
+/*
+ * any other storefile: read a block of readings into columns, run the
+ * expression on them, and so on
+ */
+ static void
+filter_rows(struct storefile *sf)
+{
+	static uint64_t sel[FLT_WORDS];
+	const float *v[COL_NFIELDS];
+	struct reading r;
+	int64_t ns;
+	long n = 0;
+	int done = 0;
+	int rc;
+	int f;
+
+	for (f = 0; f < COL_NFIELDS; f++) {
+		v[f] = blk_v[f];
+	}
+	sf_seek_ns(sf, win_from);
+	while (!done) {
+		rc = sf_read(sf, &r);
+		if (rc < 0) {
+			continue;
+		}
+		if (rc > 0) {
+			ns = sf_realtime_ns(sf, &r.tstamp);
+			if (ns < win_from) {
+				continue;
+			}
+			if (ns >= win_to) {
+				rc = 0;
+			}
+		}
+		if (rc > 0) {
+			blk_ns[n] = ns;
+			blk_v[COL_WATTS][n] = r.watts;
+			blk_v[COL_PF][n] = r.pf;
+			blk_v[COL_VOLTS][n] = r.volts;
+			blk_v[COL_AMPS][n] = r.amps;
+			n++;
+		} else {
+			done = 1;
+		}
+		if ((n == FLT_BLOCK) || (done && n)) {
+			flt_eval(&flt, v, n, sel);
+			take(blk_ns, 0, v, n, sel);
+			n = 0;
+		}
+	}
+}
+
+ static int
+filter_file(const char *path)
+{
+	struct storefile sf;
+	int rc;
+
+	rc = sf_open(&sf, path);
+	if (rc) {
+		fprintf(stderr, "open storefile '%s' failed.  errno=%d\n", path, rc);
+		return rc;
+	}
+	if (sf.layout == SF_LAYOUT_COLUMNS) {
+		filter_columns(&sf);
+	} else {
+		filter_rows(&sf);
+	}
+	sf_close(&sf);
+
+	return 0;
+}
+
+
+ int
+main(int argc, char **argv) {
+	const char *where = NULL;
+	const char *err;
+	int rc;
+	int argx;
+	int i;
+	int f;
+	int ret = 0;
+	static const char *names[] = {"watts", "pf", "volts", "amps"};
+
+	do {
+		rc = getopt_long(argc, argv, "", &rf_opts[0], &argx);
+		if ((rc == ':') || (rc == '?')) {
+			usage(argv);
+			exit(1);
+		}
+		if (rc != 0) {
+			continue;
+		}
+		if (rf_opts[argx].flag == &where_opt) {
+			where = optarg;
+		} else if ((rf_opts[argx].has_arg == required_argument) &&
+			sf_parse_time(optarg, (rf_opts[argx].flag == &from_opt) ?
+			&win_from : &win_to)) {
+			printf("can't make sense of time '%s'\n", optarg);
+			usage(argv);
+			exit(1);
+		}
+	} while (rc != -1);
+
+	if ((where == NULL) || (optind >= argc) || (count_opt && stats_opt)) {
+		usage(argv);
+		exit(1);
+	}
+	if (flt_compile(&flt, where, &err)) {
+		printf("can't make sense of '%s': %s\n", where, err);
+		exit(1);
+	}
+
+	if (!count_opt && !stats_opt) {
+		printf("     timestamp   watts      pf   volts    amps\n");
+	}
+	for (i = optind; i < argc; i++) {
+		if (filter_file(argv[i])) {
+			ret = 1;
+		}
+	}
+
+	if (count_opt || stats_opt) {
+		printf("%ld of %ld readings\n", npassed, nseen);
+	}
+	if (stats_opt && npassed) {
+		printf("          min     mean      max\n");
+		for (f = 0; f < COL_NFIELDS; f++) {
+			printf("%-5s %7.3f  %7.3f  %7.3f\n", names[f], min[f],
+				sum[f] / npassed, max[f]);
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,265 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Program to merge any number of readings storefiles into one stream
+ * of readings in time order.
+ *
+ * Every storefile has its own start clock, so the readings are merged
+ * on their wall clock times, not on the monotonic tstamps stored in the
+ * files.  All the input files are mmapped, and a heap with the next
+ * reading of each file picks the earliest one, so the merge is done in
+ * one pass and memory use is the same whether the files hold a minute
+ * of readings or a week.
+ *
+ * The output is a version 1 or version 2 storefile, or text.  In a
+ * storefile the tstamps are the wall clock times themselves, and the
+ * start clock is the time of the first reading.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include "extech.h"
+#include "storefile.h"
+
+#define OUT_NELEMS 4096 /* readings buffered up per write */
+
+/*
+ * the next reading from one of the input files
+ */
+struct head {
+	int64_t ns;		/* wall clock time */
+	int src;		/* which input file */
+	struct reading r;
+};
+
+struct storefile *inputs;
+struct head *heap;
+int nheap;
+long nbad;
+
+/*
+ * argument specification
+ */
+int v1_opt = 0; /* write a version 1 storefile */
+int v2_opt = 0; /* write a version 2 storefile */
+
+struct option rm_opts[] = {
+	{
+		"v1",
+		required_argument,
+		&v1_opt,
+		1
+	},
+	{
+		"v2",
+		required_argument,
+		&v2_opt,
+		1
+	},
+	{}
+};
+
+ void
+usage(char **args)
+{
+	printf("usage: %s [--v1=<outfile> | --v2=<outfile>] <storefile> ...\n",
+		args[0]);
+	printf("Without --v1 or --v2, the merged readings are output as text.\n");
+}
+
+
+ static int
+head_before(struct head *a, struct head *b)
+{
+	if (a->ns != b->ns) {
+		return a->ns < b->ns;
+	}
+	return a->src < b->src;
+}
+
+ static void
+sift_down(int i)
+{
+	struct head t;
+	int c;
+
+	for (;;) {
+		c = (2 * i) + 1;
+		if (c >= nheap) {
+			break;
+		}
+		if ((c + 1 < nheap) && head_before(&heap[c + 1], &heap[c])) {
+			c++;
+		}
+		if (!head_before(&heap[c], &heap[i])) {
+			break;
+		}
+		t = heap[i];
+		heap[i] = heap[c];
+		heap[c] = t;
+		i = c;
+	}
+}
+
+/*
+ * read the next good reading of input file src into *h.
+ * returns 0 if there isn't one.
+ */
+ static int
+next_reading(int src, struct head *h)
+{
+	int rc;
+
+	while ((rc = sf_read(&inputs[src], &h->r)) != 0) {
+		if (rc > 0) {
+			h->src = src;
+			h->ns = sf_realtime_ns(&inputs[src], &h->r.tstamp);
+			return 1;
+		}
+		nbad++;
+	}
+	return 0;
+}
+
+
+ int
+main(int argc, char **argv) {
+	int rc;
+	int argx;
+	int i;
+	int nin;
+	int outfd = -1;
+	char *outfile = NULL;
+	struct sf_writer sw;
+	struct reading *out;
+	int nout = 0;
+	long total = 0;
+	struct timespec startclk;
+	struct reading *r;
+
+	do {
+		rc = getopt_long(argc, argv, "", &rm_opts[0], &argx);
+		if ((rc == ':') || (rc == '?')) {
+			usage(argv);
+			exit(1);
+		}
+		if (rc == 0) {
+			outfile = optarg;
+		}
+	} while (rc != -1);
+
+	nin = argc - optind;
+	if ((nin <= 0) || (v1_opt && v2_opt)) {
+		usage(argv);
+		exit(1);
+	}
+
+	inputs = calloc(nin, sizeof(*inputs));
+	heap = calloc(nin, sizeof(*heap));
+	out = malloc(OUT_NELEMS * sizeof(*out));
+	if ((inputs == NULL) || (heap == NULL) || (out == NULL)) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < nin; i++) {
+		rc = sf_open(&inputs[i], argv[optind + i]);
+		if (rc) {
+			fprintf(stderr, "open storefile '%s' failed.  errno=%d\n",
+				argv[optind + i], rc);
+			exit(1);
+		}
+		if (next_reading(i, &heap[nheap])) {
+			nheap++;
+		}
+	}
+	for (i = (nheap / 2) - 1; i >= 0; i--) {
+		sift_down(i);
+	}
+
+	/*
+	 * the first reading out of the heap is the earliest of all of them,
+	 * so it's the start clock of the merged file
+	 */
+	startclk.tv_sec = nheap ? heap[0].ns / 1000000000 : 0;
+	startclk.tv_nsec = nheap ? heap[0].ns % 1000000000 : 0;
+
+	rc = 0;
+	if (v1_opt) {
+		outfd = open(outfile, O_CREAT | O_EXCL | O_WRONLY, 0644);
+		rc = (outfd < 0) ? errno : sf_write_all(outfd, &startclk,
+			sizeof(startclk));
+	} else if (v2_opt) {
+		rc = sf_create(&sw, outfile, SF_LAYOUT_READING, &startclk, &startclk);
+		outfd = sw.fd;
+	} else {
+		printf("     timestamp src   watts      pf   volts    amps\n");
+	}
+	if (rc) {
+		fprintf(stderr, "create '%s' failed.  errno=%d\n", outfile, rc);
+		exit(1);
+	}
+
+	while (nheap) {
+		r = &out[nout++];
+		*r = heap[0].r;
+		r->tstamp.tv_sec = heap[0].ns / 1000000000;
+		r->tstamp.tv_nsec = heap[0].ns % 1000000000;
+
+		if (outfd < 0) {
+			printf("%ld.%.3ld %3d %7.3f %7.3f %7.3f %7.3f\n", r->tstamp.tv_sec,
+				r->tstamp.tv_nsec / 1000000, heap[0].src, r->watts, r->pf,
+				r->volts, r->amps);
+			nout = 0;
+		} else if (nout == OUT_NELEMS) {
+			rc = v2_opt ? sf_append(&sw, out, nout) :
+				sf_write_all(outfd, out, nout * sizeof(*out));
+			nout = 0;
+			if (rc) {
+				break;
+			}
+		}
+		total++;
+
+		if (!next_reading(heap[0].src, &heap[0])) {
+			heap[0] = heap[--nheap];
+		}
+		sift_down(0);
+	}
+
+	if ((outfd >= 0) && (rc == 0) && nout) {
+		rc = v2_opt ? sf_append(&sw, out, nout) :
+			sf_write_all(outfd, out, nout * sizeof(*out));
+	}
+	if (v2_opt) {
+		rc = sf_finish(&sw) ?: rc;
+	} else if (v1_opt && close(outfd) && (rc == 0)) {
+		rc = errno;
+	}
+	if (rc) {
+		fprintf(stderr, "writing '%s' failed.  errno=%d\n", outfile, rc);
+		exit(1);
+	}
+
+	for (i = 0; i < nin; i++) {
+		sf_close(&inputs[i]);
+	}
+
+	if (nbad) {
+		fprintf(stderr, "%ld readings failed conversion and were left out\n",
+			nbad);
+	}
+	if (outfd >= 0) {
+		printf("merged %ld readings from %d files into %s\n", total, nin,
+			outfile);
+	}
+
+	return 0;
+}
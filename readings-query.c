@@ -0,0 +1,271 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Program to answer "how much energy between this time and that time"
+ * over any number of storefiles, or directories full of them.
+ *
+ * The summary footer of each storefile says what time range it covers
+ * and how much energy is in it, so files outside the time window are
+ * skipped without looking at a single reading, and files entirely inside
+ * it just contribute their footer's energy.  Only the files that straddle
+ * the start or the end of the window get their readings scanned.
+ *
+ * Files without a footer have to be scanned all the way through; the
+ * --index option writes a footer onto them while it's at it, so the
+ * next query doesn't have to.  A log storefile without a footer is from
+ * a run that didn't finish, so --index first cuts off any torn block at
+ * its end.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <float.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "extech.h"
+#include "storefile.h"
+#include "rollup.h"
+
+/*
+ * what's been found in the window so far
+ */
+int64_t win_from = INT64_MIN;
+int64_t win_to = INT64_MAX;
+double joules;
+long nreadings;
+float max_watts = -FLT_MAX;
+float min_watts = FLT_MAX;
+
+int nfiles;
+int nskipped;
+int nsummary;
+int nscanned;
+int nindexed;
+
+/*
+ * argument specification
+ */
+int from_opt = 0;
+int to_opt = 0;
+int index_opt = 0; /* add summary footers to files that don't have one */
+
+struct option rq_opts[] = {
+	{
+		"from",
+		required_argument,
+		&from_opt,
+		1
+	},
+	{
+		"to",
+		required_argument,
+		&to_opt,
+		1
+	},
+	{
+		"index",
+		no_argument,
+		&index_opt,
+		1
+	},
+	{}
+};
+
+ void
+usage(char **args)
+{
+	printf("usage: %s [--from=<time>] [--to=<time>] [--index] "
+		"<storefile|directory> ...\n", args[0]);
+	printf("Times are local 'YYYY-MM-DD HH:MM:SS[.fff]' or seconds since "
+		"the epoch.\n");
+}
+
+/*
+ * the window cuts through this file, so go through its readings.  each
+ * reading's watts are held until the next one, same as the footer's
+ * energy integral, and only the part of that inside the window counts.
+ */
+ static void
+scan_window(struct storefile *sf)
+{
+	struct reading r;
+	int64_t ns, prev_ns = 0;
+	int64_t a, b;
+	float prev_watts = 0;
+	int have_prev = 0;
+	int rc;
+
+	sf_seek_ns(sf, win_from);
+	while ((rc = sf_read(sf, &r)) != 0) {
+		if (rc < 0) {
+			continue;
+		}
+		ns = sf_realtime_ns(sf, &r.tstamp);
+		if (have_prev) {
+			a = (prev_ns > win_from) ? prev_ns : win_from;
+			b = (ns < win_to) ? ns : win_to;
+			if (b > a) {
+				joules += (double)prev_watts * ((b - a) / 1e9);
+			}
+		}
+		if (ns >= win_to) {
+			break;
+		}
+		if (ns >= win_from) {
+			nreadings++;
+			if (r.watts > max_watts) {
+				max_watts = r.watts;
+			}
+			if (r.watts < min_watts) {
+				min_watts = r.watts;
+			}
+		}
+		prev_ns = ns;
+		prev_watts = r.watts;
+		have_prev = 1;
+	}
+}
+
+ static void
+query_file(const char *path)
+{
+	struct storefile sf;
+	struct sf_summary s;
+	int rc;
+
+	rc = sf_open(&sf, path);
+	if (rc) {
+		fprintf(stderr, "open storefile '%s' failed.  errno=%d\n", path, rc);
+		return;
+	}
+	nfiles++;
+
+	if (sf.has_summary) {
+		s = sf.summary;
+	} else {
+		nscanned++;
+		if (sf_summarize(&sf, &s)) {
+			fprintf(stderr, "'%s' has readings that failed conversion\n", path);
+		}
+		if (index_opt) {
+			long n;
+
+			rc = sf_log_recover(path, &n) ?: sf_add_summary(path, &s);
+			if (rc) {
+				fprintf(stderr, "adding summary to '%s' failed.  errno=%d\n",
+					path, rc);
+			} else {
+				nindexed++;
+			}
+		}
+	}
+
+	if ((s.count == 0) || (s.last_ns < win_from) || (s.first_ns >= win_to)) {
+		nskipped += sf.has_summary;
+	} else if ((s.first_ns >= win_from) && (s.last_ns < win_to)) {
+		joules += s.joules;
+		nreadings += s.count;
+		if (s.max[0] > max_watts) {
+			max_watts = s.max[0];
+		}
+		if (s.min[0] < min_watts) {
+			min_watts = s.min[0];
+		}
+		nsummary += sf.has_summary;
+	} else {
+		scan_window(&sf);
+		nscanned += sf.has_summary;
+	}
+
+	sf_close(&sf);
+}
+
+ static void
+query_dir(const char *dname)
+{
+	DIR *d;
+	struct dirent *de;
+	struct stat st;
+	char path[4096];
+	size_t len;
+
+	d = opendir(dname);
+	if (d == NULL) {
+		fprintf(stderr, "open directory '%s' failed.  errno=%d\n", dname,
+			errno);
+		return;
+	}
+	while ((de = readdir(d)) != NULL) {
+		/* rollup sidecars live next to their storefiles, but aren't any */
+		len = strlen(de->d_name);
+		if ((de->d_name[0] == '.') || ((len > strlen(RU_SUFFIX)) &&
+			!strcmp(&de->d_name[len - strlen(RU_SUFFIX)], RU_SUFFIX))) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", dname, de->d_name);
+		if (!stat(path, &st) && S_ISREG(st.st_mode)) {
+			query_file(path);
+		}
+	}
+	closedir(d);
+}
+
+
+ int
+main(int argc, char **argv) {
+	int rc;
+	int argx;
+	int i;
+	struct stat st;
+
+	do {
+		rc = getopt_long(argc, argv, "", &rq_opts[0], &argx);
+		if ((rc == ':') || (rc == '?')) {
+			usage(argv);
+			exit(1);
+		}
+		if ((rc == 0) && (rq_opts[argx].has_arg == required_argument)) {
+			if (sf_parse_time(optarg, (rq_opts[argx].flag == &from_opt) ?
+				&win_from : &win_to)) {
+				printf("can't make sense of time '%s'\n", optarg);
+				usage(argv);
+				exit(1);
+			}
+		}
+	} while (rc != -1);
+
+	if (optind >= argc) {
+		usage(argv);
+		exit(1);
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (!stat(argv[i], &st) && S_ISDIR(st.st_mode)) {
+			query_dir(argv[i]);
+		} else {
+			query_file(argv[i]);
+		}
+	}
+
+	printf("watt-hours consumed: %g\n", joules / 3600.);
+	printf("joules: %g\n", joules);
+	printf("readings: %ld\n", nreadings);
+	if (nreadings) {
+		printf("min: %7.3f watts  max: %7.3f watts\n", min_watts, max_watts);
+	}
+	printf("files: %d, %d skipped, %d from summary, %d scanned",
+		nfiles, nskipped, nsummary, nscanned);
+	if (nindexed) {
+		printf(", %d indexed", nindexed);
+	}
+	printf("\n");
+
+	return 0;
+}
@@ -0,0 +1,234 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Program to build rollup sidecar files for storefiles, and to show the
+ * watts of a storefile at a given resolution using its rollup.
+ *
+ * With no --resolution, a <storefile>.rollup is (re)built for each
+ * storefile given.  extech_rdr --rollup builds one when it saves its
+ * readings, so this is mostly for storefiles from before that, or from
+ * readings-merge.
+ *
+ * With --resolution=<secs>, the buckets of the coarsest rollup level
+ * that's no coarser than that are output, between --from and --to if
+ * given.  So a zoomed out look at a week long capture reads a few
+ * thousand buckets instead of every reading.  Resolutions under a second
+ * get the readings themselves.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include "extech.h"
+#include "storefile.h"
+#include "rollup.h"
+
+/*
+ * argument specification
+ */
+int res_opt = 0;
+int from_opt = 0;
+int to_opt = 0;
+
+struct option rr_opts[] = {
+	{
+		"resolution",
+		required_argument,
+		&res_opt,
+		1
+	},
+	{
+		"from",
+		required_argument,
+		&from_opt,
+		1
+	},
+	{
+		"to",
+		required_argument,
+		&to_opt,
+		1
+	},
+	{}
+};
+
+int64_t resolution;
+int64_t win_from = INT64_MIN;
+int64_t win_to = INT64_MAX;
+
+ void
+usage(char **args)
+{
+	printf("usage: %s <storefile> ...\n", args[0]);
+	printf("       %s --resolution=<secs> [--from=<time>] [--to=<time>] "
+		"<storefile>\n", args[0]);
+	printf("Times are local 'YYYY-MM-DD HH:MM:SS[.fff]' or seconds since "
+		"the epoch.\n");
+}
+
+/*
+ * build the rollup of a storefile and write it next to it
+ */
+ static int
+build(const char *path)
+{
+	struct storefile sf;
+	struct rollup ru;
+	char rpath[4096];
+	int rc;
+
+	rc = sf_open(&sf, path);
+	if (rc) {
+		fprintf(stderr, "open storefile '%s' failed.  errno=%d\n", path, rc);
+		return rc;
+	}
+
+	snprintf(rpath, sizeof(rpath), "%s%s", path, RU_SUFFIX);
+	rollup_init(&ru);
+	rc = rollup_storefile(&ru, &sf);
+	if (rc == 0) {
+		rc = rollup_write(&ru, rpath);
+	}
+	if (rc) {
+		fprintf(stderr, "rolling up '%s' failed.  errno=%d\n", path, rc);
+	} else {
+		printf("%s: %lu/%lu/%lu/%lu/%lu buckets\n", rpath, ru.n[0], ru.n[1],
+			ru.n[2], ru.n[3], ru.n[4]);
+	}
+	rollup_free(&ru);
+	sf_close(&sf);
+
+	return rc;
+}
+
+/*
+ * too fine for any rollup level, so it's the readings
+ */
+ static int
+show_readings(const char *path)
+{
+	struct storefile sf;
+	struct reading r;
+	int64_t ns;
+	int rc;
+
+	rc = sf_open(&sf, path);
+	if (rc) {
+		fprintf(stderr, "open storefile '%s' failed.  errno=%d\n", path, rc);
+		return rc;
+	}
+
+	printf("     timestamp   watts      pf   volts    amps\n");
+	sf_seek_ns(&sf, win_from);
+	while ((rc = sf_read(&sf, &r)) != 0) {
+		ns = sf_realtime_ns(&sf, &r.tstamp);
+		if ((rc < 0) || (ns < win_from)) {
+			continue;
+		}
+		if (ns >= win_to) {
+			break;
+		}
+		printf("%ld.%.3ld %7.3f %7.3f %7.3f %7.3f\n", ns / 1000000000,
+			(ns % 1000000000) / 1000000, r.watts, r.pf, r.volts, r.amps);
+	}
+	sf_close(&sf);
+
+	return 0;
+}
+
+ static int
+show(const char *path)
+{
+	struct rollup_file rf;
+	const struct ru_bucket *b;
+	char rpath[4096];
+	uint64_t n, i;
+	int level;
+	int rc;
+
+	level = rollup_pick_level(resolution);
+	if (level < 0) {
+		return show_readings(path);
+	}
+
+	snprintf(rpath, sizeof(rpath), "%s%s", path, RU_SUFFIX);
+	rc = rollup_open(&rf, rpath);
+	if (rc == ENOENT) {
+		rc = build(path) ?: rollup_open(&rf, rpath);
+	}
+	if (rc) {
+		fprintf(stderr, "open rollup '%s' failed.  errno=%d\n", rpath, rc);
+		return rc;
+	}
+
+	b = rollup_level(&rf, level, &n);
+	printf("%lds buckets\n", ru_widths[level] / 1000000000);
+	printf("     timestamp count     min     max    mean  watt-hours\n");
+	i = 0;
+	if (win_from != INT64_MIN) {
+		i = rollup_find(b, n, win_from - (win_from % ru_widths[level]));
+	}
+	for (; (i < n) && (b[i].start_ns < win_to); i++) {
+		printf("%ld.%.3ld %5u %7.3f %7.3f %7.3f %11.6f\n",
+			b[i].start_ns / 1000000000, (b[i].start_ns % 1000000000) / 1000000,
+			b[i].count, b[i].min_watts, b[i].max_watts, b[i].mean_watts,
+			b[i].joules / 3600.);
+	}
+	rollup_close(&rf);
+
+	return 0;
+}
+
+
+ int
+main(int argc, char **argv) {
+	int rc;
+	int argx;
+	int i;
+	int ret = 0;
+
+	do {
+		rc = getopt_long(argc, argv, "", &rr_opts[0], &argx);
+		if ((rc == ':') || (rc == '?')) {
+			usage(argv);
+			exit(1);
+		}
+		if (rc != 0) {
+			continue;
+		}
+		if (rr_opts[argx].flag == &res_opt) {
+			resolution = (int64_t)(strtod(optarg, NULL) * 1e9);
+			if (resolution <= 0) {
+				printf("resolution must be a positive number of seconds\n");
+				exit(1);
+			}
+		} else if (sf_parse_time(optarg, (rr_opts[argx].flag == &from_opt) ?
+			&win_from : &win_to)) {
+			printf("can't make sense of time '%s'\n", optarg);
+			usage(argv);
+			exit(1);
+		}
+	} while (rc != -1);
+
+	if ((optind >= argc) || (res_opt && (optind + 1 != argc))) {
+		usage(argv);
+		exit(1);
+	}
+
+	if (res_opt) {
+		return show(argv[optind]) ? 1 : 0;
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (build(argv[i])) {
+			ret = 1;
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Program to split the readings of storefiles into segments of steady
+ * power, like the phases of a benchmark run, without having to eyeball
+ * a plot for where they start and stop.
+ *
+ * Each segment is output with its start and end, how many readings are
+ * in it, its mean watts and their stddev, its energy, and the confidence
+ * that its mean is different from the segment before it.  It's one pass
+ * through the readings, a few adds and compares each, with segments
+ * output as soon as they're over.  See segment.h for how.
+ *
+ * extech_rdr --sink=segments does the same while measuring.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include "extech.h"
+#include "storefile.h"
+#include "segment.h"
+
+/*
+ * argument specification
+ */
+int min_shift_opt = 0;
+float min_shift = 1.0; /* watts: the smallest change worth a new segment */
+
+struct option rs_opts[] = {
+	{
+		"min-shift",
+		required_argument,
+		&min_shift_opt,
+		1
+	},
+	{}
+};
+
+ void
+usage(char **args)
+{
+	printf("usage: %s [--min-shift=<watts>] <storefile> ...\n", args[0]);
+	printf("Changes in the watts smaller than --min-shift (default 1) don't "
+		"start a new\nsegment, however steady the power is on either side "
+		"of them.\n");
+}
+
+ static void
+put_segment(const struct seg_result *r, void *arg)
+{
+	seg_print(stdout, r);
+}
+
+ static int
+segment_file(const char *path)
+{
+	struct storefile sf;
+	struct segmenter seg;
+	struct reading r;
+	int64_t ns, last_ns = INT64_MIN;
+	int rc;
+
+	rc = sf_open(&sf, path);
+	if (rc) {
+		fprintf(stderr, "open storefile '%s' failed.  errno=%d\n", path, rc);
+		return rc;
+	}
+
+	seg_init(&seg, min_shift, put_segment, NULL);
+	while ((rc = sf_read(&sf, &r)) != 0) {
+		if (rc < 0) {
+			continue;
+		}
+		ns = sf_realtime_ns(&sf, &r.tstamp);
+		if (ns < last_ns) {
+			fprintf(stderr, "'%s' goes back in time, stopping there\n", path);
+			break;
+		}
+		seg_push(&seg, ns, r.watts);
+		last_ns = ns;
+	}
+	seg_end(&seg, last_ns);
+	sf_close(&sf);
+
+	return 0;
+}
+
+
+ int
+main(int argc, char **argv) {
+	int rc;
+	int argx;
+	int i;
+	int ret = 0;
+
+	do {
+		rc = getopt_long(argc, argv, "", &rs_opts[0], &argx);
+		if ((rc == ':') || (rc == '?')) {
+			usage(argv);
+			exit(1);
+		}
+		if ((rc == 0) && (rs_opts[argx].flag == &min_shift_opt)) {
+			min_shift = strtof(optarg, NULL);
+			if (min_shift <= 0) {
+				printf("min-shift must be a positive number of watts\n");
+				exit(1);
+			}
+		}
+	} while (rc != -1);
+
+	if (optind >= argc) {
+		usage(argv);
+		exit(1);
+	}
+
+	seg_print_header(stdout);
+	for (i = optind; i < argc; i++) {
+		if (argc - optind > 1) {
+			printf("%s:\n", argv[i]);
+		}
+		if (segment_file(argv[i])) {
+			ret = 1;
+		}
+	}
+
+	return ret;
+}
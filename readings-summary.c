@@ -0,0 +1,433 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Program to summarize a batch of storefiles, say a night's worth of
+ * readings.dat.NN files from run-reader, in one table: a row for each
+ * file with its energy, how long it ran, the mean, min, max and 95th
+ * percentile watts, and its coverage, then a totals row.
+ *
+ * Files are given by name or by the directory they're in (the shell does
+ * globs).  They're summarized in parallel by a pool of threads, one per
+ * CPU unless --threads says otherwise, each taking the next file off a
+ * shared list as soon as it's done with one, biggest files first, so the
+ * run isn't left waiting on one big file at the end.  Every reading has
+ * to be looked at for the percentile, so the summary footers don't help.
+ *
+ * The mean is the energy over the duration, so a reading counts for as
+ * long as it held.  Coverage is how much of the duration had readings
+ * no more than --gap seconds apart (2 by default, the slowest adaptive
+ * sampling period; a deadband file gets DB_KEYFRAME_SECS more), so runs
+ * that lost the meter for a while stand out.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "extech.h"
+#include "storefile.h"
+#include "rollup.h"
+
+/*
+ * one file, and its summary once it's been done
+ */
+struct job {
+	char *path;
+	off_t size;
+	int rc;
+	long count;
+	long nbad;
+	int64_t first_ns;
+	int64_t last_ns;
+	double joules;
+	double covered_secs;
+	float min;
+	float max;
+	float p95;
+};
+
+struct job *jobs;
+int njobs;
+int jobs_size;
+struct job **order;	/* the jobs, biggest first */
+int next_job;
+
+int64_t gap_ns = ADAPT_SLOW_NS;
+
+/*
+ * argument specification
+ */
+int threads_opt = 0;
+int gap_opt = 0;
+
+struct option rs_opts[] = {
+	{
+		"threads",
+		required_argument,
+		&threads_opt,
+		1
+	},
+	{
+		"gap",
+		required_argument,
+		&gap_opt,
+		1
+	},
+	{}
+};
+
+ void
+usage(char **args)
+{
+	printf("usage: %s [--threads=<n>] [--gap=<secs>] "
+		"<storefile|directory> ...\n", args[0]);
+}
+
+ static int
+add_job(const char *path)
+{
+	struct stat st;
+	struct job *p;
+
+	if (stat(path, &st)) {
+		fprintf(stderr, "'%s': errno=%d\n", path, errno);
+		return 0;
+	}
+	if (njobs == jobs_size) {
+		jobs_size = jobs_size ? jobs_size * 2 : 256;
+		p = realloc(jobs, jobs_size * sizeof(*jobs));
+		if (p == NULL) {
+			return ENOMEM;
+		}
+		jobs = p;
+	}
+	memset(&jobs[njobs], 0, sizeof(jobs[njobs]));
+	jobs[njobs].path = strdup(path);
+	if (jobs[njobs].path == NULL) {
+		return ENOMEM;
+	}
+	jobs[njobs].size = st.st_size;
+	njobs++;
+
+	return 0;
+}
+
+/*
+ * the storefiles in a directory; not the rollup sidecars next to them
+ */
+ static int
+add_dir(const char *dname)
+{
+	DIR *d;
+	struct dirent *de;
+	struct stat st;
+	char path[4096];
+	size_t len;
+	int rc = 0;
+
+	d = opendir(dname);
+	if (d == NULL) {
+		fprintf(stderr, "open directory '%s' failed.  errno=%d\n", dname,
+			errno);
+		return 0;
+	}
+	while (!rc && ((de = readdir(d)) != NULL)) {
+		len = strlen(de->d_name);
+		if ((de->d_name[0] == '.') || ((len > strlen(RU_SUFFIX)) &&
+			!strcmp(&de->d_name[len - strlen(RU_SUFFIX)], RU_SUFFIX))) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", dname, de->d_name);
+		if (!stat(path, &st) && S_ISREG(st.st_mode)) {
+			rc = add_job(path);
+		}
+	}
+	closedir(d);
+
+	return rc;
+}
+
+/*
+ * the kth smallest of v[0..n-1], moving them around to find it
+ */
+ static float
+select_kth(float *v, long n, long k)
+{
+	long lo = 0, hi = n - 1;
+	long i, j;
+	float pivot, t;
+
+	while (lo < hi) {
+		pivot = v[lo + ((hi - lo) / 2)];
+		i = lo;
+		j = hi;
+		while (i <= j) {
+			while (v[i] < pivot) {
+				i++;
+			}
+			while (v[j] > pivot) {
+				j--;
+			}
+			if (i <= j) {
+				t = v[i];
+				v[i++] = v[j];
+				v[j--] = t;
+			}
+		}
+		if (k <= j) {
+			hi = j;
+		} else if (k >= i) {
+			lo = i;
+		} else {
+			break;
+		}
+	}
+
+	return v[k];
+}
+
+/*
+ * summarize one file.  watts is the thread's buffer for the percentile,
+ * grown as needed.
+ */
+ static void
+summarize(struct job *j, float **watts, long *watts_size)
+{
+	struct storefile sf;
+	struct reading r;
+	int64_t ns, prev_ns = 0, gap;
+	float prev_watts = 0;
+	float *p;
+	int rc;
+
+	j->rc = sf_open(&sf, j->path);
+	if (j->rc) {
+		return;
+	}
+	gap = gap_ns;
+	if (sf.flags & SF_FLAG_DEADBAND) {
+		gap += DB_KEYFRAME_SECS * 1000000000L;
+	}
+
+	while ((rc = sf_read(&sf, &r)) != 0) {
+		if (rc < 0) {
+			j->nbad++;
+			continue;
+		}
+		ns = sf_realtime_ns(&sf, &r.tstamp);
+		if (j->count && (ns < prev_ns)) {
+			/* anything without a magic number passes for version 1 */
+			j->rc = EINVAL;
+			break;
+		}
+		if (j->count) {
+			j->joules += (double)prev_watts * ((ns - prev_ns) / 1e9);
+			if (ns - prev_ns <= gap) {
+				j->covered_secs += (ns - prev_ns) / 1e9;
+			}
+			if (r.watts < j->min) {
+				j->min = r.watts;
+			}
+			if (r.watts > j->max) {
+				j->max = r.watts;
+			}
+		} else {
+			j->first_ns = ns;
+			j->min = j->max = r.watts;
+		}
+		if (j->count == *watts_size) {
+			p = realloc(*watts, (*watts_size ? *watts_size * 2 : 65536) *
+				sizeof(**watts));
+			if (p == NULL) {
+				j->rc = ENOMEM;
+				break;
+			}
+			*watts = p;
+			*watts_size = *watts_size ? *watts_size * 2 : 65536;
+		}
+		(*watts)[j->count++] = r.watts;
+		j->last_ns = prev_ns = ns;
+		prev_watts = r.watts;
+	}
+	sf_close(&sf);
+
+	if (j->count) {
+		j->p95 = select_kth(*watts, j->count, (j->count * 95) / 100);
+	}
+}
+
+ static void *
+worker(void *arg)
+{
+	float *watts = NULL;
+	long watts_size = 0;
+	int i;
+
+	while ((i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED)) < njobs) {
+		summarize(order[i], &watts, &watts_size);
+	}
+	free(watts);
+
+	return NULL;
+}
+
+ static int
+by_size(const void *a, const void *b)
+{
+	const struct job *ja = *(struct job * const *)a;
+	const struct job *jb = *(struct job * const *)b;
+
+	return (ja->size < jb->size) - (ja->size > jb->size);
+}
+
+ static int
+by_path(const void *a, const void *b)
+{
+	return strcmp(((const struct job *)a)->path, ((const struct job *)b)->path);
+}
+
+
+ int
+main(int argc, char **argv) {
+	pthread_t *tids;
+	struct stat st;
+	struct job *j;
+	double secs, total_j = 0, total_secs = 0, total_cov = 0;
+	long total_n = 0;
+	float tmin = 0, tmax = 0;
+	int nthreads = 0;
+	int rc;
+	int argx;
+	int i;
+
+	do {
+		rc = getopt_long(argc, argv, "", &rs_opts[0], &argx);
+		if ((rc == ':') || (rc == '?')) {
+			usage(argv);
+			exit(1);
+		}
+		if (rc != 0) {
+			continue;
+		}
+		if (rs_opts[argx].flag == &threads_opt) {
+			nthreads = atoi(optarg);
+			if (nthreads <= 0) {
+				printf("threads must be a positive number\n");
+				exit(1);
+			}
+		} else {
+			gap_ns = (int64_t)(strtod(optarg, NULL) * 1e9);
+			if (gap_ns <= 0) {
+				printf("gap must be a positive number of seconds\n");
+				exit(1);
+			}
+		}
+	} while (rc != -1);
+
+	if (optind >= argc) {
+		usage(argv);
+		exit(1);
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (!stat(argv[i], &st) && S_ISDIR(st.st_mode)) {
+			rc = add_dir(argv[i]);
+		} else {
+			rc = add_job(argv[i]);
+		}
+		if (rc) {
+			fprintf(stderr, "no memory for the list of files\n");
+			exit(1);
+		}
+	}
+	if (njobs == 0) {
+		exit(1);
+	}
+	qsort(jobs, njobs, sizeof(*jobs), by_path);
+
+	order = malloc(njobs * sizeof(*order));
+	if (order == NULL) {
+		fprintf(stderr, "no memory for the list of files\n");
+		exit(1);
+	}
+	for (i = 0; i < njobs; i++) {
+		order[i] = &jobs[i];
+	}
+	qsort(order, njobs, sizeof(*order), by_size);
+
+	if (nthreads == 0) {
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (nthreads > njobs) {
+		nthreads = njobs;
+	}
+	tids = calloc(nthreads, sizeof(*tids));
+	if (tids == NULL) {
+		fprintf(stderr, "no memory for %d threads\n", nthreads);
+		exit(1);
+	}
+	for (i = 0; i < nthreads; i++) {
+		rc = pthread_create(&tids[i], NULL, worker, NULL);
+		if (rc) {
+			fprintf(stderr, "starting thread failed.  errno=%d\n", rc);
+			nthreads = i;
+			break;
+		}
+	}
+	if (nthreads == 0) {
+		worker(NULL);
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	printf("readings     seconds  watt-hours     mean      min      max      "
+		"p95  cover file\n");
+	for (i = 0; i < njobs; i++) {
+		j = &jobs[i];
+		if (j->rc) {
+			fprintf(stderr, "'%s' failed.  errno=%d%s\n", j->path, j->rc,
+				(j->rc == EINVAL) ? ", not a storefile?" : "");
+			continue;
+		}
+		if (j->nbad) {
+			fprintf(stderr, "'%s': %ld readings failed conversion\n",
+				j->path, j->nbad);
+		}
+		if (j->count == 0) {
+			printf("%8d %11s %11s %8s %8s %8s %8s %6s %s\n", 0, "-", "-",
+				"-", "-", "-", "-", "-", j->path);
+			continue;
+		}
+		secs = (j->last_ns - j->first_ns) / 1e9;
+		printf("%8ld %11.3f %11.6f %8.3f %8.3f %8.3f %8.3f %5.1f%% %s\n",
+			j->count, secs, j->joules / 3600.,
+			secs > 0 ? j->joules / secs : j->max, j->min, j->max, j->p95,
+			secs > 0 ? (j->covered_secs * 100) / secs : 100., j->path);
+		if ((total_n == 0) || (j->min < tmin)) {
+			tmin = j->min;
+		}
+		if ((total_n == 0) || (j->max > tmax)) {
+			tmax = j->max;
+		}
+		total_n += j->count;
+		total_secs += secs;
+		total_j += j->joules;
+		total_cov += j->covered_secs;
+	}
+	if (total_n) {
+		printf("%8ld %11.3f %11.6f %8.3f %8.3f %8.3f %8s %5.1f%% total\n",
+			total_n, total_secs, total_j / 3600.,
+			total_secs > 0 ? total_j / total_secs : tmax, tmin, tmax, "-",
+			total_secs > 0 ? (total_cov * 100) / total_secs : 100.);
+	}
+
+	return 0;
+}
@@ -0,0 +1,307 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Building, writing and reading rollup sidecar files.  see rollup.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "rollup.h"
+
+#define NSEC 1000000000LL
+
+const int64_t ru_widths[RU_NLEVELS] = {
+	1 * NSEC,
+	10 * NSEC,
+	60 * NSEC,
+	600 * NSEC,
+	3600 * NSEC,
+};
+
+
+ void
+rollup_init(struct rollup *ru)
+{
+	memset(ru, 0, sizeof(*ru));
+}
+
+ void
+rollup_free(struct rollup *ru)
+{
+	int l;
+
+	for (l = 0; l < RU_NLEVELS; l++) {
+		free(ru->b[l]);
+	}
+	rollup_init(ru);
+}
+
+/*
+ * the bucket of level l that time ns falls in.  times only ever move
+ * forward, so that's either the last bucket or a new one after it.
+ */
+ static struct ru_bucket *
+bucket_at(struct rollup *ru, int l, int64_t ns)
+{
+	struct ru_bucket *bk;
+	int64_t start;
+
+	start = ns - (ns % ru_widths[l]);
+	if (ru->n[l] && (ru->b[l][ru->n[l] - 1].start_ns == start)) {
+		return &ru->b[l][ru->n[l] - 1];
+	}
+
+	if (ru->n[l] == ru->size[l]) {
+		ru->size[l] = ru->size[l] ? ru->size[l] * 2 : 1024;
+		bk = realloc(ru->b[l], ru->size[l] * sizeof(*bk));
+		if (bk == NULL) {
+			return NULL;
+		}
+		ru->b[l] = bk;
+	}
+	bk = &ru->b[l][ru->n[l]++];
+	bk->start_ns = start;
+	bk->count = 0;
+	bk->min_watts = ru->prev_watts;
+	bk->max_watts = ru->prev_watts;
+	bk->mean_watts = ru->prev_watts;
+	bk->joules = 0.0;
+	ru->wsum[l] = 0.0;
+
+	return bk;
+}
+
+/*
+ * add a reading to all the levels.  readings have to come in time order.
+ * returns 0 on success, errno on failure.
+ */
+ int
+rollup_add(struct rollup *ru, int64_t ns, float watts)
+{
+	struct ru_bucket *bk;
+	int64_t a, end, seg;
+	int l;
+
+	if (ru->have_prev && (ns < ru->prev_ns)) {
+		return EINVAL;
+	}
+
+	for (l = 0; l < RU_NLEVELS; l++) {
+		/*
+		 * spread the energy of the previous reading over the buckets
+		 * between it and this one
+		 */
+		for (a = ru->prev_ns; ru->have_prev && (a < ns); a += seg) {
+			bk = bucket_at(ru, l, a);
+			if (bk == NULL) {
+				return ENOMEM;
+			}
+			end = bk->start_ns + ru_widths[l];
+			seg = ((ns < end) ? ns : end) - a;
+			bk->joules += (double)ru->prev_watts * (seg / 1e9);
+		}
+
+		bk = bucket_at(ru, l, ns);
+		if (bk == NULL) {
+			return ENOMEM;
+		}
+		if (bk->count == 0) {
+			bk->min_watts = watts;
+			bk->max_watts = watts;
+		} else if (watts < bk->min_watts) {
+			bk->min_watts = watts;
+		} else if (watts > bk->max_watts) {
+			bk->max_watts = watts;
+		}
+		bk->count++;
+		ru->wsum[l] += watts;
+		bk->mean_watts = ru->wsum[l] / bk->count;
+	}
+
+	ru->prev_ns = ns;
+	ru->prev_watts = watts;
+	ru->have_prev = 1;
+
+	return 0;
+}
+
+/*
+ * roll up all the readings of a storefile.  leaves the file rewound.
+ * returns 0 on success, errno on failure.
+ */
+ int
+rollup_storefile(struct rollup *ru, struct storefile *sf)
+{
+	struct reading r;
+	int rc;
+	int ret = 0;
+
+	sf_rewind(sf);
+	while ((ret == 0) && ((rc = sf_read(sf, &r)) != 0)) {
+		if (rc > 0) {
+			ret = rollup_add(ru, sf_realtime_ns(sf, &r.tstamp), r.watts);
+		}
+	}
+	sf_rewind(sf);
+
+	return ret;
+}
+
+/*
+ * write the rollup out to a sidecar file, replacing any that's there
+ */
+ int
+rollup_write(struct rollup *ru, const char *path)
+{
+	struct ru_header h;
+	uint64_t off;
+	int fd;
+	int ret;
+	int l;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, RU_MAGIC, 8);
+	h.nlevels = RU_NLEVELS;
+	h.size = sizeof(h);
+	off = sizeof(h);
+	for (l = 0; l < RU_NLEVELS; l++) {
+		h.level[l].width_ns = ru_widths[l];
+		h.level[l].nbuckets = ru->n[l];
+		h.level[l].offset = off;
+		off += ru->n[l] * sizeof(struct ru_bucket);
+	}
+
+	fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd < 0) {
+		return errno;
+	}
+	ret = sf_write_all(fd, &h, sizeof(h));
+	for (l = 0; (l < RU_NLEVELS) && (ret == 0); l++) {
+		ret = sf_write_all(fd, ru->b[l], ru->n[l] * sizeof(struct ru_bucket));
+	}
+	if (close(fd) && (ret == 0)) {
+		ret = errno;
+	}
+
+	return ret;
+}
+
+
+/*
+ * map a rollup sidecar.  returns 0 on success, errno on failure.
+ */
+ int
+rollup_open(struct rollup_file *rf, const char *path)
+{
+	struct stat st;
+	int ret;
+	int l;
+
+	memset(rf, 0, sizeof(*rf));
+	rf->fd = open(path, O_RDONLY);
+	if (rf->fd < 0) {
+		return errno;
+	}
+	if (fstat(rf->fd, &st)) {
+		goto error_exit;
+	}
+	rf->size = st.st_size;
+	errno = EINVAL;
+	if (rf->size < sizeof(rf->hdr)) {
+		goto error_exit;
+	}
+
+	rf->map = mmap(NULL, rf->size, PROT_READ, MAP_PRIVATE, rf->fd, 0);
+	if (rf->map == MAP_FAILED) {
+		rf->map = NULL;
+		goto error_exit;
+	}
+	memcpy(&rf->hdr, rf->map, sizeof(rf->hdr));
+	if (memcmp(rf->hdr.magic, RU_MAGIC, 8) ||
+		(rf->hdr.size != sizeof(rf->hdr)) ||
+		(rf->hdr.nlevels != RU_NLEVELS)) {
+		errno = EINVAL;
+		goto error_exit;
+	}
+	for (l = 0; l < RU_NLEVELS; l++) {
+		if (rf->hdr.level[l].offset + (rf->hdr.level[l].nbuckets *
+			sizeof(struct ru_bucket)) > rf->size) {
+			errno = EINVAL;
+			goto error_exit;
+		}
+	}
+
+	return 0;
+
+error_exit:
+	ret = errno;
+	rollup_close(rf);
+	return ret;
+}
+
+ const struct ru_bucket *
+rollup_level(struct rollup_file *rf, int level, uint64_t *n)
+{
+	*n = rf->hdr.level[level].nbuckets;
+	return (const struct ru_bucket *)(rf->map + rf->hdr.level[level].offset);
+}
+
+/*
+ * the coarsest level whose buckets are no wider than resolution_ns, or
+ * -1 if even the finest level is too coarse
+ */
+ int
+rollup_pick_level(int64_t resolution_ns)
+{
+	int l;
+
+	for (l = RU_NLEVELS - 1; l >= 0; l--) {
+		if (ru_widths[l] <= resolution_ns) {
+			return l;
+		}
+	}
+	return -1;
+}
+
+/*
+ * index of the first bucket that starts at or after ns
+ */
+ uint64_t
+rollup_find(const struct ru_bucket *b, uint64_t n, int64_t ns)
+{
+	uint64_t lo = 0;
+	uint64_t hi = n;
+	uint64_t mid;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) / 2);
+		if (b[mid].start_ns < ns) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+ void
+rollup_close(struct rollup_file *rf)
+{
+	if (rf->map) {
+		munmap((void *)rf->map, rf->size);
+		rf->map = NULL;
+	}
+	if (rf->fd >= 0) {
+		close(rf->fd);
+		rf->fd = -1;
+	}
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Rollups: the watts of a storefile summarized into 1 second, 10 second,
+ * 1 minute, 10 minute and 1 hour buckets, kept in a sidecar file next to
+ * the storefile (<storefile>.rollup).  Something that wants a week of
+ * readings at one point per minute reads ~10000 one minute buckets
+ * instead of 1.5 million readings.
+ *
+ * The sidecar is a struct ru_header followed by each level's buckets.
+ * Buckets start on multiples of the level's width since the epoch, and
+ * only buckets that have something in them are stored, in time order.
+ */
+#ifndef _ROLLUP_H
+#define _ROLLUP_H
+
+#include <stdint.h>
+#include "storefile.h"
+
+#define RU_MAGIC "EXTECHRU"
+#define RU_NLEVELS 5
+#define RU_SUFFIX ".rollup"
+
+struct ru_level {
+	int64_t width_ns;
+	uint64_t nbuckets;
+	uint64_t offset;	/* of the first bucket, from the start of the file */
+};
+
+struct ru_header {
+	char magic[8];
+	uint32_t nlevels;
+	uint32_t size;		/* sizeof(struct ru_header) */
+	struct ru_level level[RU_NLEVELS];
+};
+
+/*
+ * the energy in a bucket is worked out like the storefile summary: each
+ * reading's watts are held until the next reading, and whatever part of
+ * that falls in the bucket counts.  so a bucket can have energy and no
+ * readings, if a gap between readings spans it, in which case min, max
+ * and mean are the watts being held.
+ */
+struct ru_bucket {
+	int64_t start_ns;
+	uint32_t count;
+	float min_watts;
+	float max_watts;
+	float mean_watts;
+	double joules;
+};
+
+/*
+ * building a rollup, one reading at a time
+ */
+struct rollup {
+	struct ru_bucket *b[RU_NLEVELS];
+	uint64_t n[RU_NLEVELS];
+	uint64_t size[RU_NLEVELS];
+	double wsum[RU_NLEVELS];	/* watts of the readings in the last bucket */
+	int64_t prev_ns;
+	float prev_watts;
+	int have_prev;
+};
+
+/*
+ * a rollup sidecar, mapped for reading
+ */
+struct rollup_file {
+	int fd;
+	const unsigned char *map;
+	size_t size;
+	struct ru_header hdr;
+};
+
+extern const int64_t ru_widths[RU_NLEVELS];
+
+extern void rollup_init(struct rollup *ru);
+extern int rollup_add(struct rollup *ru, int64_t ns, float watts);
+extern int rollup_storefile(struct rollup *ru, struct storefile *sf);
+extern int rollup_write(struct rollup *ru, const char *path);
+extern void rollup_free(struct rollup *ru);
+
+extern int rollup_open(struct rollup_file *rf, const char *path);
+extern const struct ru_bucket *rollup_level(struct rollup_file *rf,
+	int level, uint64_t *n);
+extern int rollup_pick_level(int64_t resolution_ns);
+extern uint64_t rollup_find(const struct ru_bucket *b, uint64_t n, int64_t ns);
+extern void rollup_close(struct rollup_file *rf);
+
+#endif
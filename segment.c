@@ -0,0 +1,233 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Change point segmentation of the watts.  see segment.h.
+ */
+
+#include <string.h>
+#include <math.h>
+#include "segment.h"
+
+/*
+ * for independent noise, the mean absolute difference of two readings
+ * is 2/sqrt(pi) of the stddev
+ */
+#define SEG_MAD_TO_SIGMA 0.886227
+
+#define SEG_NOISE_ALPHA 0.05	/* how fast the noise estimate moves */
+
+ static void
+acc_reset(struct seg_acc *a, int64_t ns)
+{
+	memset(a, 0, sizeof(*a));
+	a->start_ns = ns;
+}
+
+ static void
+acc_add(struct seg_acc *a, int64_t ns, float watts)
+{
+	if (a->n == 0) {
+		a->start_ns = ns;
+	}
+	a->n++;
+	a->sum += watts;
+	a->sumsq += (double)watts * watts;
+}
+
+ static double
+acc_var(const struct seg_acc *a)
+{
+	double v;
+
+	if (a->n < 2) {
+		return 0;
+	}
+	v = (a->sumsq - (a->sum * a->sum / a->n)) / (a->n - 1);
+	return (v > 0) ? v : 0;
+}
+
+ void
+seg_init(struct segmenter *s, float min_shift,
+	void (*emit)(const struct seg_result *r, void *arg), void *arg)
+{
+	memset(s, 0, sizeof(*s));
+	s->min_shift = min_shift;
+	s->conf = -1;
+	s->emit = emit;
+	s->arg = arg;
+}
+
+/*
+ * put out the readings in a as a segment ending at end_ns
+ */
+ static void
+emit_acc(struct segmenter *s, const struct seg_acc *a, int64_t end_ns)
+{
+	struct seg_result r;
+
+	r.start_ns = a->start_ns;
+	r.end_ns = end_ns;
+	r.n = a->n;
+	r.mean = a->sum / a->n;
+	r.stddev = sqrt(acc_var(a));
+	r.joules = a->joules;
+	r.conf = s->conf;
+	s->emit(&r, s->arg);
+}
+
+/*
+ * the segment is over where tail starts: what's before it goes out, and
+ * the tail is the start of the next one
+ */
+ static void
+split(struct segmenter *s, const struct seg_acc *tail)
+{
+	struct seg_acc a = s->cur;
+	double ma, mb, se;
+
+	a.n -= tail->n;
+	a.sum -= tail->sum;
+	a.sumsq -= tail->sumsq;
+	a.joules -= tail->joules;
+	emit_acc(s, &a, tail->start_ns);
+
+	/* Welch's t, taken as normal */
+	ma = a.sum / a.n;
+	mb = tail->sum / tail->n;
+	se = sqrt((acc_var(&a) / a.n) + (acc_var(tail) / tail->n));
+	s->conf = (se > 0) ? erf(fabs(ma - mb) / se / M_SQRT2) : 1.;
+
+	s->cur = *tail;
+	acc_reset(&s->tail_hi, 0);
+	acc_reset(&s->tail_lo, 0);
+	s->s_hi = s->s_lo = 0;
+}
+
+/*
+ * the next reading, at ns nsecs.  readings have to come in time order.
+ */
+ void
+seg_push(struct segmenter *s, int64_t ns, float watts)
+{
+	struct seg_acc tail;
+	double d, shift, mean, x;
+
+	if (s->have_last) {
+		/* the last reading's watts held until now */
+		x = (double)s->last_watts * ((ns - s->last_ns) / 1e9);
+		s->cur.joules += x;
+		if (s->tail_hi.n) {
+			s->tail_hi.joules += x;
+		}
+		if (s->tail_lo.n) {
+			s->tail_lo.joules += x;
+		}
+
+		/*
+		 * a change point is one big difference, which shouldn't count
+		 * as noise, so differences are clipped before they go in
+		 */
+		d = fabs(watts - s->last_watts);
+		if (d > (4 * s->noise) + s->min_shift) {
+			d = (4 * s->noise) + s->min_shift;
+		}
+		/* a plain average until there's enough for the moving one */
+		s->ndiffs++;
+		if (s->ndiffs * SEG_NOISE_ALPHA < 1) {
+			s->noise += (d - s->noise) / s->ndiffs;
+		} else {
+			s->noise += SEG_NOISE_ALPHA * (d - s->noise);
+		}
+	}
+	s->last_ns = ns;
+	s->last_watts = watts;
+	s->have_last = 1;
+
+	shift = 3 * s->noise * SEG_MAD_TO_SIGMA;
+	if (shift < s->min_shift) {
+		shift = s->min_shift;
+	}
+
+	if (s->cur.n < SEG_WARMUP) {
+		/*
+		 * too few readings for the CUSUM, but a jump as big as it
+		 * takes to set it off is a change anyway
+		 */
+		if (s->cur.n &&
+			(fabs(watts - (s->cur.sum / s->cur.n)) > 4 * shift)) {
+			acc_reset(&tail, 0);
+			acc_add(&tail, ns, watts);
+			acc_add(&s->cur, ns, watts);
+			split(s, &tail);
+		} else {
+			acc_add(&s->cur, ns, watts);
+		}
+		return;
+	}
+	mean = s->cur.sum / s->cur.n;
+
+	s->s_hi += (watts - mean) - (shift / 2);
+	if (s->s_hi <= 0) {
+		s->s_hi = 0;
+		acc_reset(&s->tail_hi, 0);
+	} else {
+		acc_add(&s->tail_hi, ns, watts);
+	}
+	s->s_lo += (mean - watts) - (shift / 2);
+	if (s->s_lo <= 0) {
+		s->s_lo = 0;
+		acc_reset(&s->tail_lo, 0);
+	} else {
+		acc_add(&s->tail_lo, ns, watts);
+	}
+	acc_add(&s->cur, ns, watts);
+
+	if (s->s_hi > 4 * shift) {
+		split(s, &s->tail_hi);
+	} else if (s->s_lo > 4 * shift) {
+		split(s, &s->tail_lo);
+	}
+}
+
+/*
+ * no more readings: the segment so far is the last one, and the last
+ * reading holds until end_ns
+ */
+ void
+seg_end(struct segmenter *s, int64_t end_ns)
+{
+	if (s->cur.n == 0) {
+		return;
+	}
+	if (end_ns > s->last_ns) {
+		s->cur.joules += (double)s->last_watts * ((end_ns - s->last_ns) / 1e9);
+	} else {
+		end_ns = s->last_ns;
+	}
+	emit_acc(s, &s->cur, end_ns);
+	acc_reset(&s->cur, 0);
+	s->have_last = 0;
+}
+
+ void
+seg_print_header(FILE *f)
+{
+	fprintf(f, "         start            end     secs readings   watts  "
+		"stddev  watt-hours  conf\n");
+}
+
+ void
+seg_print(FILE *f, const struct seg_result *r)
+{
+	fprintf(f, "%ld.%.3ld %ld.%.3ld %8.1f %8ld %7.3f %7.3f %11.6f ",
+		r->start_ns / 1000000000, (r->start_ns % 1000000000) / 1000000,
+		r->end_ns / 1000000000, (r->end_ns % 1000000000) / 1000000,
+		(r->end_ns - r->start_ns) / 1e9, r->n, r->mean, r->stddev,
+		r->joules / 3600.);
+	if (r->conf < 0) {
+		fprintf(f, "    -\n");
+	} else {
+		fprintf(f, "%5.3f\n", r->conf);
+	}
+}
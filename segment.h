@@ -0,0 +1,78 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Splitting the watts into segments of steady power, like the phases of
+ * a benchmark, as the readings go by: a two sided CUSUM on each reading's
+ * difference from the mean of the segment it's in.
+ *
+ * The noise is estimated from the differences between readings as they
+ * come, and the smallest shift looked for is 3 times that, or min_shift
+ * watts, whichever is bigger.  A shift that big is caught about 8
+ * readings after it happens, a bigger one sooner.  When one is caught,
+ * the segment is split where the CUSUM started climbing, not where it
+ * was caught, and the readings since then start the next one.  Both
+ * sides of that split are kept as running sums, so every reading is a
+ * few adds and compares, and a segment is output as soon as it's known
+ * to be over.
+ *
+ * Each segment comes with its mean, stddev, energy (each reading held
+ * until the next, like everywhere else), and the confidence that its
+ * mean really is different from the one before it, from a Welch t test
+ * at the time of the split.
+ */
+#ifndef _SEGMENT_H
+#define _SEGMENT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* readings a segment has before a change is looked for */
+#define SEG_WARMUP 3
+
+struct seg_result {
+	int64_t start_ns;	/* the first reading's time */
+	int64_t end_ns;		/* the next segment's first reading's time */
+	long n;
+	double mean;
+	double stddev;
+	double joules;
+	double conf;		/* -1 for the first segment */
+};
+
+/*
+ * running sums over a run of readings
+ */
+struct seg_acc {
+	int64_t start_ns;
+	long n;
+	double sum;
+	double sumsq;
+	double joules;
+};
+
+struct segmenter {
+	float min_shift;
+	double noise;		/* the mean absolute difference of readings */
+	long ndiffs;		/* that it's from */
+	int64_t last_ns;
+	float last_watts;
+	int have_last;
+	struct seg_acc cur;		/* the segment so far */
+	struct seg_acc tail_hi;	/* since the upward CUSUM was last 0 */
+	struct seg_acc tail_lo;	/* since the downward one was */
+	double s_hi;
+	double s_lo;
+	double conf;			/* of the split that started cur */
+	void (*emit)(const struct seg_result *r, void *arg);
+	void *arg;
+};
+
+extern void seg_init(struct segmenter *s, float min_shift,
+	void (*emit)(const struct seg_result *r, void *arg), void *arg);
+extern void seg_push(struct segmenter *s, int64_t ns, float watts);
+extern void seg_end(struct segmenter *s, int64_t end_ns);
+extern void seg_print_header(FILE *f);
+extern void seg_print(FILE *f, const struct seg_result *r);
+
+#endif
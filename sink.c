@@ -0,0 +1,609 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Sinks for readings as they're taken, and the fan-out thread that feeds
+ * them.  see sink.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <math.h>
+#include <float.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "sink.h"
+#include "storefile.h"
+#include "segment.h"
+#include "overhead.h"
+
+#define SINK_SLOTS 1024		/* ring size, ~100s of readings at the fast rate */
+#define SINK_FLUSH_NS 100000000	/* how often the fan-out thread empties it */
+#define SINK_LAZY_NS 2000000000L	/* or in low overhead mode */
+
+/*
+ * set by the sampling thread with the first reading stored, which is
+ * before the first one is put in the ring
+ */
+extern struct timespec startclk;
+extern struct timespec startmono;
+
+/*
+ * single producer, single consumer, like the capture ring
+ */
+static struct reading ring[SINK_SLOTS];
+static unsigned int head;
+static unsigned int tail;
+static unsigned long dropped;
+
+static struct sink sinks[SINK_MAX];
+static char *sink_args[SINK_MAX];
+static int nsinks;
+static int sink_on;
+static int sink_stopping;
+static pthread_t sink_thread;
+static long flush_ns = SINK_FLUSH_NS;
+static int lazy;
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond;	/* sink_stopping was set */
+
+ int64_t
+sink_realtime_ns(const struct timespec *ts)
+{
+	return ((int64_t)startclk.tv_sec * 1000000000) + startclk.tv_nsec +
+		((int64_t)(ts->tv_sec - startmono.tv_sec) * 1000000000) +
+		(ts->tv_nsec - startmono.tv_nsec);
+}
+
+
+/*
+ * stats: running min/mean/max/stddev of the watts and the energy,
+ * output at the end.  the mean and variance are kept Welford's way so a
+ * long run doesn't lose them to rounding.
+ */
+struct stats_sink {
+	long n;
+	double mean;
+	double m2;
+	float min;
+	float max;
+	double joules;
+	int64_t last_ns;
+	float last_watts;
+};
+
+ static int
+stats_open(struct sink *s, const char *arg)
+{
+	struct stats_sink *st;
+
+	st = calloc(1, sizeof(*st));
+	if (st == NULL) {
+		return ENOMEM;
+	}
+	st->min = FLT_MAX;
+	st->max = -FLT_MAX;
+	s->priv = st;
+
+	return 0;
+}
+
+ static void
+stats_push(struct sink *s, const struct reading *r, int n)
+{
+	struct stats_sink *st = s->priv;
+	int64_t ns;
+	double d;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		ns = ((int64_t)r[i].tstamp.tv_sec * 1000000000) + r[i].tstamp.tv_nsec;
+		if (st->n) {
+			st->joules += (double)st->last_watts * ((ns - st->last_ns) / 1e9);
+		}
+		st->last_ns = ns;
+		st->last_watts = r[i].watts;
+		st->n++;
+		d = r[i].watts - st->mean;
+		st->mean += d / st->n;
+		st->m2 += d * (r[i].watts - st->mean);
+		if (r[i].watts < st->min) {
+			st->min = r[i].watts;
+		}
+		if (r[i].watts > st->max) {
+			st->max = r[i].watts;
+		}
+	}
+}
+
+ static void
+stats_close(struct sink *s)
+{
+	struct stats_sink *st = s->priv;
+
+	printf("stats: %ld readings", st->n);
+	if (st->n) {
+		printf(", watts min %.3f mean %.3f max %.3f stddev %.3f, "
+			"%.3f joules to the last reading", st->min, st->mean, st->max,
+			(st->n > 1) ? sqrt(st->m2 / (st->n - 1)) : 0., st->joules);
+	}
+	printf("\n");
+	free(st);
+}
+
+
+/*
+ * display: the latest reading on stderr, on one line that keeps getting
+ * redrawn if it's a terminal, a line per reading if it isn't
+ */
+ static int
+display_open(struct sink *s, const char *arg)
+{
+	s->priv = isatty(STDERR_FILENO) ? "\r\033[K" : "";
+	return 0;
+}
+
+ static void
+display_push(struct sink *s, const struct reading *r, int n)
+{
+	const char *pre = s->priv;
+	int64_t ns;
+	int i;
+
+	/* a terminal only needs to see the last one */
+	for (i = *pre ? n - 1 : 0; i < n; i++) {
+		ns = sink_realtime_ns(&r[i].tstamp);
+		fprintf(stderr, "%s%ld.%.3ld %7.3f W %7.3f pf %7.3f V %7.3f A%s", pre,
+			ns / 1000000000, (ns % 1000000000) / 1000000, r[i].watts, r[i].pf,
+			r[i].volts, r[i].amps, *pre ? "" : "\n");
+	}
+	fflush(stderr);
+}
+
+ static void
+display_close(struct sink *s)
+{
+	if (*(const char *)s->priv) {
+		fprintf(stderr, "\n");
+	}
+}
+
+
+/*
+ * socket: each span of readings as lines of text, "<secs>.<msecs> watts
+ * pf volts amps", in a datagram to a localhost UDP port or a unix socket
+ * path.  nobody listening, or a full socket buffer, and they're dropped;
+ * it never waits.
+ */
+#define SOCK_DGRAM_MAX 8192
+
+struct socket_sink {
+	int fd;
+	struct sockaddr_storage to;
+	socklen_t tolen;
+	char buf[SOCK_DGRAM_MAX];
+};
+
+ static int
+socket_open(struct sink *s, const char *arg)
+{
+	struct socket_sink *ss;
+	struct sockaddr_in *sin;
+	struct sockaddr_un *sun;
+	char *end;
+	long port;
+	int ret;
+
+	if ((arg == NULL) || (*arg == '\0')) {
+		return EINVAL;
+	}
+	ss = calloc(1, sizeof(*ss));
+	if (ss == NULL) {
+		return ENOMEM;
+	}
+	port = strtol(arg, &end, 10);
+	if ((*end == '\0') && (end != arg)) {
+		if ((port <= 0) || (port > 65535)) {
+			ret = EINVAL;
+			goto error_exit;
+		}
+		sin = (struct sockaddr_in *)&ss->to;
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		ss->tolen = sizeof(*sin);
+	} else {
+		sun = (struct sockaddr_un *)&ss->to;
+		if (strlen(arg) >= sizeof(sun->sun_path)) {
+			ret = ENAMETOOLONG;
+			goto error_exit;
+		}
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, arg);
+		ss->tolen = sizeof(*sun);
+	}
+	ss->fd = socket(ss->to.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (ss->fd < 0) {
+		ret = errno;
+		goto error_exit;
+	}
+	s->priv = ss;
+
+	return 0;
+
+error_exit:
+	free(ss);
+	return ret;
+}
+
+ static void
+socket_push(struct sink *s, const struct reading *r, int n)
+{
+	struct socket_sink *ss = s->priv;
+	int64_t ns;
+	int len = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		/* 64 is more than a line can be */
+		if (len > sizeof(ss->buf) - 64) {
+			sendto(ss->fd, ss->buf, len, MSG_DONTWAIT,
+				(struct sockaddr *)&ss->to, ss->tolen);
+			len = 0;
+		}
+		ns = sink_realtime_ns(&r[i].tstamp);
+		len += snprintf(&ss->buf[len], sizeof(ss->buf) - len,
+			"%ld.%.3ld %.3f %.3f %.3f %.3f\n", ns / 1000000000,
+			(ns % 1000000000) / 1000000, r[i].watts, r[i].pf, r[i].volts,
+			r[i].amps);
+	}
+	if (len) {
+		sendto(ss->fd, ss->buf, len, MSG_DONTWAIT, (struct sockaddr *)&ss->to,
+			ss->tolen);
+	}
+}
+
+ static void
+socket_close(struct sink *s)
+{
+	struct socket_sink *ss = s->priv;
+
+	close(ss->fd);
+	free(ss);
+}
+
+
+/*
+ * file: every reading, streamed to a version 2 storefile as it comes in,
+ * deadband or no deadband, so it's there even if the run never gets to
+ * saving the store
+ */
+struct file_sink {
+	struct sf_writer w;
+	const char *path;
+	int err;
+};
+
+ static int
+file_open(struct sink *s, const char *arg)
+{
+	struct file_sink *fs;
+	int ret;
+
+	if ((arg == NULL) || (*arg == '\0')) {
+		return EINVAL;
+	}
+	fs = calloc(1, sizeof(*fs));
+	if (fs == NULL) {
+		return ENOMEM;
+	}
+	/* the start clocks go in with the first readings */
+	ret = sf_create(&fs->w, arg, SF_LAYOUT_READING, NULL, NULL);
+	if (ret) {
+		free(fs);
+		return ret;
+	}
+	fs->path = arg;
+	s->priv = fs;
+
+	return 0;
+}
+
+ static void
+file_push(struct sink *s, const struct reading *r, int n)
+{
+	struct file_sink *fs = s->priv;
+
+	if (fs->err) {
+		return;
+	}
+	if (fs->w.nrecs == 0) {
+		fs->w.hdr.startclk = startclk;
+		fs->w.hdr.startmono = startmono;
+	}
+	fs->err = sf_append(&fs->w, r, n);
+	if (fs->err) {
+		fprintf(stderr, "writing '%s' failed, file sink stopped.  errno=%d\n",
+			fs->path, fs->err);
+	}
+}
+
+ static void
+file_close(struct sink *s)
+{
+	struct file_sink *fs = s->priv;
+	int ret;
+
+	ret = sf_finish(&fs->w);
+	if (ret) {
+		fprintf(stderr, "finishing '%s' failed.  errno=%d\n", fs->path, ret);
+	} else if (fs->err == 0) {
+		printf("file sink saved %ld readings to %s\n", fs->w.nrecs, fs->path);
+	}
+	free(fs);
+}
+
+
+/*
+ * segments: the watts split into segments of steady power as they come,
+ * each one on stdout as soon as it's over.  the arg is the smallest
+ * change in watts worth a new segment, 1 if there isn't one.
+ */
+struct segments_sink {
+	struct segmenter seg;
+	int64_t last_ns;
+};
+
+ static void
+segments_put(const struct seg_result *r, void *arg)
+{
+	printf("segment: ");
+	seg_print(stdout, r);
+	fflush(stdout);
+}
+
+ static int
+segments_open(struct sink *s, const char *arg)
+{
+	struct segments_sink *ss;
+	float min_shift = 1.0;
+
+	if (arg && *arg) {
+		min_shift = strtof(arg, NULL);
+		if (min_shift <= 0) {
+			return EINVAL;
+		}
+	}
+	ss = calloc(1, sizeof(*ss));
+	if (ss == NULL) {
+		return ENOMEM;
+	}
+	seg_init(&ss->seg, min_shift, segments_put, NULL);
+	s->priv = ss;
+
+	return 0;
+}
+
+ static void
+segments_push(struct sink *s, const struct reading *r, int n)
+{
+	struct segments_sink *ss = s->priv;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		ss->last_ns = sink_realtime_ns(&r[i].tstamp);
+		seg_push(&ss->seg, ss->last_ns, r[i].watts);
+	}
+}
+
+ static void
+segments_close(struct sink *s)
+{
+	struct segments_sink *ss = s->priv;
+
+	seg_end(&ss->seg, ss->last_ns);
+	free(ss);
+}
+
+
+static const struct sink builtins[] = {
+	{"stats", stats_open, stats_push, stats_close},
+	{"display", display_open, display_push, display_close},
+	{"socket", socket_open, socket_push, socket_close},
+	{"file", file_open, file_push, file_close},
+	{"segments", segments_open, segments_push, segments_close},
+	{}
+};
+
+/*
+ * turn on a sink, "<name>[:<arg>]".  it isn't opened until sink_start().
+ * returns 0 on success, errno on failure.
+ */
+ int
+sink_add(const char *spec)
+{
+	const char *colon;
+	size_t len;
+	int i;
+
+	if (nsinks >= SINK_MAX) {
+		return ENOSPC;
+	}
+	colon = strchr(spec, ':');
+	len = colon ? (size_t)(colon - spec) : strlen(spec);
+	for (i = 0; builtins[i].name; i++) {
+		if ((strlen(builtins[i].name) == len) &&
+			!strncmp(builtins[i].name, spec, len)) {
+			break;
+		}
+	}
+	if (builtins[i].name == NULL) {
+		return ENOENT;
+	}
+	sinks[nsinks] = builtins[i];
+	sink_args[nsinks] = colon ? strdup(colon + 1) : NULL;
+	nsinks++;
+
+	return 0;
+}
+
+/*
+ * hand every sink the spans of readings in the ring, up to where the
+ * sampling thread had got to.  a span stops at the end of the ring, so
+ * one that wraps goes out as two.
+ */
+ static void
+fan_out(void)
+{
+	unsigned int h, t, n;
+	int i;
+
+	h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	for (t = tail; t != h; t += n) {
+		n = SINK_SLOTS - (t % SINK_SLOTS);
+		if (n > h - t) {
+			n = h - t;
+		}
+		for (i = 0; i < nsinks; i++) {
+			sinks[i].push(&sinks[i], &ring[t % SINK_SLOTS], n);
+		}
+		__atomic_store_n(&tail, t + n, __ATOMIC_RELEASE);
+	}
+}
+
+ static void *
+fan_out_proc(void *arg)
+{
+	struct timespec t;
+
+	if (lazy) {
+		prctl(PR_SET_TIMERSLACK, OH_LAZY_SLACK_NS, 0, 0, 0);
+	}
+	pthread_mutex_lock(&stop_lock);
+	while (!sink_stopping) {
+		/* sleep flush_ns, or until sink_stop() doesn't want to wait */
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		t.tv_sec += flush_ns / 1000000000;
+		t.tv_nsec += flush_ns % 1000000000;
+		if (t.tv_nsec >= 1000000000) {
+			t.tv_nsec -= 1000000000;
+			t.tv_sec++;
+		}
+		pthread_cond_timedwait(&stop_cond, &stop_lock, &t);
+		pthread_mutex_unlock(&stop_lock);
+		fan_out();
+		pthread_mutex_lock(&stop_lock);
+	}
+	pthread_mutex_unlock(&stop_lock);
+	fan_out();
+	overhead_thread_done("sinks");
+
+	return NULL;
+}
+
+/*
+ * low overhead: the fan-out thread wakes up every couple of seconds,
+ * whenever the kernel gets to it, instead of ten times a second, and the
+ * sinks get bigger spans.  has to be called before sink_start().
+ */
+ void
+sink_low_overhead(void)
+{
+	flush_ns = SINK_LAZY_NS;
+	lazy = 1;
+}
+
+/*
+ * open the sinks that were added and start the fan-out thread.  returns
+ * 0 on success, or errno, with *which the name of the sink that failed.
+ */
+ int
+sink_start(const char **which)
+{
+	pthread_condattr_t ca;
+	int ret;
+	int i;
+
+	if (nsinks == 0) {
+		return 0;
+	}
+	for (i = 0; i < nsinks; i++) {
+		ret = sinks[i].open(&sinks[i], sink_args[i]);
+		if (ret) {
+			*which = sinks[i].name;
+			goto error_exit;
+		}
+	}
+	sink_stopping = 0;
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&stop_cond, &ca);
+	pthread_condattr_destroy(&ca);
+	ret = pthread_create(&sink_thread, NULL, fan_out_proc, NULL);
+	if (ret) {
+		*which = "fan-out";
+		goto error_exit;
+	}
+	sink_on = 1;
+
+	return 0;
+
+error_exit:
+	while (i-- > 0) {
+		sinks[i].close(&sinks[i]);
+	}
+	return ret;
+}
+
+/*
+ * called on the sampling thread with each reading.  never blocks: if the
+ * fan-out thread has fallen that far behind, the reading is dropped.
+ */
+ void
+sink_put(const struct reading *r)
+{
+	unsigned int h = head;
+
+	if (!sink_on) {
+		return;
+	}
+	if (h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= SINK_SLOTS) {
+		dropped++;
+		return;
+	}
+	ring[h % SINK_SLOTS] = *r;
+	__atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * stop the fan-out thread once the sinks have everything in the ring,
+ * and close them.  the sampling thread has to be done by now.  returns
+ * how many readings the sinks missed for the ring being full.
+ */
+ unsigned long
+sink_stop(void)
+{
+	int i;
+
+	if (!sink_on) {
+		return 0;
+	}
+	sink_on = 0;
+	pthread_mutex_lock(&stop_lock);
+	sink_stopping = 1;
+	pthread_cond_signal(&stop_cond);
+	pthread_mutex_unlock(&stop_lock);
+	pthread_join(sink_thread, NULL);
+	for (i = 0; i < nsinks; i++) {
+		sinks[i].close(&sinks[i]);
+	}
+
+	return dropped;
+}
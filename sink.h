@@ -0,0 +1,44 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Sinks: places readings go while they're being taken, besides the
+ * readings store.  extech_rdr --sink=<name>[:<arg>] turns one on.
+ *
+ * The sampling thread only copies each reading into a ring, same as the
+ * protocol capture does.  A fan-out thread empties the ring a few times
+ * a second (every couple of seconds with sink_low_overhead()) and hands
+ * each sink whatever has come in as a span of readings, so a slow sink
+ * (a disk, a socket, a terminal) never holds up the next trigger.  If
+ * the ring fills up, readings are dropped for the sinks rather than the
+ * sampler ever waiting.
+ *
+ * The readings a sink gets have CLOCK_MONOTONIC timestamps, like the
+ * store's; sink_realtime_ns() makes them wall clock.
+ */
+#ifndef _SINK_H
+#define _SINK_H
+
+#include <stdint.h>
+#include "extech.h"
+
+#define SINK_MAX 8	/* sinks that can be on at once */
+
+struct sink {
+	const char *name;
+	/* arg is what came after the ':', or NULL.  returns 0 or errno. */
+	int (*open)(struct sink *s, const char *arg);
+	/* n readings, oldest first, on the fan-out thread */
+	void (*push)(struct sink *s, const struct reading *r, int n);
+	void (*close)(struct sink *s);
+	void *priv;
+};
+
+extern int sink_add(const char *spec);
+extern int sink_start(const char **which);
+extern void sink_put(const struct reading *r);
+extern unsigned long sink_stop(void);
+extern void sink_low_overhead(void);
+extern int64_t sink_realtime_ns(const struct timespec *ts);
+
+#endif
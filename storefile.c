@@ -0,0 +1,853 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Reading and writing readings storefiles.  see storefile.h for the
+ * formats.
+ *
+ * Storefiles are mmapped for reading, so the whole thing is never read
+ * into a buffer; records are handed out one at a time by sf_read(),
+ * and raw meter words are decoded right there, on the way out.
+ */
+
+#define _GNU_SOURCE /* for strptime */
+#include <stdio.h>
+#include <stdlib.h>
+#include <float.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "storefile.h"
+
+
+ static size_t
+sf_layout_rec_size(int layout)
+{
+	switch (layout) {
+		case SF_LAYOUT_READING:
+			return sizeof(struct reading);
+		case SF_LAYOUT_RAW:
+			return sizeof(struct sf_rawrec);
+		case SF_LAYOUT_COLUMNS:
+			return SF_COLUMNS_REC_SIZE;
+	}
+	return 0;
+}
+
+/*
+ * CRC32C (Castagnoli), a byte at a time from a table
+ */
+ uint32_t
+sf_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	static uint32_t table[256];
+	const unsigned char *b = buf;
+	uint32_t c;
+	int i, k;
+
+	if (table[1] == 0) {
+		for (i = 0; i < 256; i++) {
+			c = i;
+			for (k = 0; k < 8; k++) {
+				c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+			}
+			table[i] = c;
+		}
+	}
+
+	crc = ~crc;
+	while (len--) {
+		crc = table[(crc ^ *b++) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+/*
+ * go through the blocks of a log, len bytes at p, for as long as they
+ * check out.  returns how many bytes of good blocks there are, and the
+ * number of records in them in *nrecs.
+ */
+ static size_t
+log_scan(const unsigned char *p, size_t len, size_t rec_size, long *nrecs)
+{
+	struct sf_block b;
+	size_t off = 0;
+	size_t blen;
+	uint32_t crc;
+	uint64_t seq = 0;
+
+	*nrecs = 0;
+	while (len - off >= sizeof(b)) {
+		memcpy(&b, p + off, sizeof(b));
+		if ((b.magic != SF_BLOCK_MAGIC) || (b.seq != seq) ||
+			(b.nrecs > (len - off - sizeof(b)) / rec_size)) {
+			break;
+		}
+		blen = sizeof(b) + (b.nrecs * rec_size);
+		crc = b.crc;
+		b.crc = 0;
+		if (sf_crc32c(sf_crc32c(0, &b, sizeof(b)), p + off + sizeof(b),
+			blen - sizeof(b)) != crc) {
+			break;
+		}
+		*nrecs += b.nrecs;
+		off += blen;
+		seq++;
+	}
+
+	return off;
+}
+
+/*
+ * open and map a storefile, and figure out which version it is.
+ * returns 0 on success, errno on failure.
+ */
+ int
+sf_open(struct storefile *sf, const char *path)
+{
+	struct stat st;
+	const struct sf_header *h;
+	size_t nbytes;
+	int i;
+
+	memset(sf, 0, sizeof(*sf));
+	sf->fd = open(path, O_RDONLY);
+	if (sf->fd < 0) {
+		return errno;
+	}
+
+	if (fstat(sf->fd, &st)) {
+		goto error_exit;
+	}
+	sf->size = st.st_size;
+	if (sf->size < sizeof(struct timespec)) {
+		errno = EINVAL;
+		goto error_exit;
+	}
+
+	sf->map = mmap(NULL, sf->size, PROT_READ, MAP_PRIVATE, sf->fd, 0);
+	if (sf->map == MAP_FAILED) {
+		sf->map = NULL;
+		goto error_exit;
+	}
+	madvise((void *)sf->map, sf->size, MADV_SEQUENTIAL);
+
+	h = (const struct sf_header *)sf->map;
+	if ((sf->size >= sizeof(*h)) && !memcmp(h->magic, SF_MAGIC, 8)) {
+		if ((h->version != SF_VERSION) || (h->hdr_size > sf->size) ||
+			((h->rec_size != sf_layout_rec_size(h->layout)) &&
+			!((h->layout == SF_LAYOUT_RAW) &&
+			(h->rec_size == SF_RAWREC_OLD_SIZE)))) {
+			errno = EINVAL;
+			goto error_exit;
+		}
+		sf->version = h->version;
+		sf->layout = h->layout;
+		sf->startclk = h->startclk;
+		sf->startmono = h->startmono;
+		sf->flags = h->flags;
+		sf->period_us = h->period_us;
+		if ((sf->flags & SF_FLAG_LOG) && (h->hdr_size < sizeof(*h))) {
+			errno = EINVAL;
+			goto error_exit;
+		}
+		sf->recs = sf->map + h->hdr_size;
+		sf->rec_size = h->rec_size;
+	} else {
+		/*
+		 * version 1: a bare realtime start clock and then the readings
+		 */
+		sf->version = 1;
+		sf->layout = SF_LAYOUT_READING;
+		memcpy(&sf->startclk, sf->map, sizeof(struct timespec));
+		sf->recs = sf->map + sizeof(struct timespec);
+		sf->rec_size = sizeof(struct reading);
+	}
+
+	/*
+	 * a summary footer, if there is one, isn't part of the readings
+	 */
+	nbytes = sf->size - (sf->recs - sf->map);
+	if (nbytes >= sizeof(struct sf_summary)) {
+		memcpy(&sf->summary, sf->map + sf->size - sizeof(struct sf_summary),
+			sizeof(struct sf_summary));
+		if (!memcmp(sf->summary.magic, SF_SUMMARY_MAGIC, 8) &&
+			(sf->summary.size == sizeof(struct sf_summary))) {
+			sf->has_summary = 1;
+			nbytes -= sizeof(struct sf_summary);
+		}
+	}
+	sf->nrecs = nbytes / sf->rec_size;
+	if (sf->flags & SF_FLAG_LOG) {
+		/* a torn last block from a crash is just left out */
+		log_scan(sf->recs, nbytes, sf->rec_size, &sf->nrecs);
+	}
+	sf->pos = sf->recs;
+
+	if (sf->layout == SF_LAYOUT_COLUMNS) {
+		/*
+		 * where the columns are depends on nrecs, so it has to be in the
+		 * header, and they have to fit
+		 */
+		if ((sf->flags & SF_FLAG_LOG) || (h->nrecs > sf->nrecs)) {
+			errno = EINVAL;
+			goto error_exit;
+		}
+		sf->nrecs = h->nrecs;
+		sf->col_ns = (const int64_t *)sf->recs;
+		sf->col[0] = (const float *)(sf->recs + (sf->nrecs * sizeof(int64_t)));
+		for (i = 1; i < SF_NFIELDS; i++) {
+			sf->col[i] = sf->col[i - 1] + sf->nrecs;
+		}
+	} else if (sf->version == SF_VERSION) {
+		if (h->nrecs && (h->nrecs < sf->nrecs)) {
+			sf->nrecs = h->nrecs;
+		}
+	} else if (sf->nrecs) {
+		/*
+		 * there's no monotonic anchor in a v1 file, so use the first
+		 * reading, like readings-dat2ascii always has
+		 */
+		memcpy(&sf->startmono, sf->recs, sizeof(struct timespec));
+	}
+
+	return 0;
+
+error_exit:
+	nbytes = errno;
+	sf_close(sf);
+	return nbytes;
+}
+
+/*
+ * decode the value words of a raw record.  the timestamp isn't touched,
+ * since that depends on the records before this one.
+ * returns 0 on success, -1 if any of the words fail to decode.
+ */
+ int
+sf_decode_rawrec(const struct sf_rawrec *rr, struct reading *r)
+{
+	if (extech_decode_word(rr->word[SF_WORD_WATTS], &r->watts) ||
+		extech_decode_word(rr->word[SF_WORD_AMPS], &r->amps) ||
+		extech_decode_word(rr->word[SF_WORD_VOLTS], &r->volts) ||
+		extech_decode_word(rr->word[SF_WORD_PF], &r->pf)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * get the next reading out of the storefile.  the tstamp is the monotonic
+ * clock value, same as extech_rdr stored it in a v1 file, no matter what
+ * the layout is.
+ *
+ * returns 1 if a reading was returned, 0 at the end of the file, and -1
+ * if a record couldn't be decoded.  in that last case the record is
+ * skipped, and *r has only its tstamp filled in.
+ */
+ int
+sf_read(struct storefile *sf, struct reading *r)
+{
+	const unsigned char *rec;
+	struct sf_rawrec rr;
+	uint64_t ns;
+
+	if (sf->next >= sf->nrecs) {
+		return 0;
+	}
+	if (sf->flags & SF_FLAG_LOG) {
+		/* sf_open() made sure the blocks hold nrecs records */
+		while (sf->blk_left == 0) {
+			sf->blk_left = ((const struct sf_block *)sf->pos)->nrecs;
+			sf->pos += sizeof(struct sf_block);
+		}
+		rec = sf->pos;
+		sf->pos += sf->rec_size;
+		sf->blk_left--;
+		sf->next++;
+	} else if (sf->layout == SF_LAYOUT_COLUMNS) {
+		r->tstamp.tv_sec = sf->col_ns[sf->next] / 1000000000;
+		r->tstamp.tv_nsec = sf->col_ns[sf->next] % 1000000000;
+		r->watts = sf->col[0][sf->next];
+		r->pf = sf->col[1][sf->next];
+		r->volts = sf->col[2][sf->next];
+		r->amps = sf->col[3][sf->next];
+		sf->next++;
+		return 1;
+	} else {
+		rec = sf->recs + (sf->next++ * sf->rec_size);
+	}
+
+	if (sf->layout == SF_LAYOUT_RAW) {
+		memset(&rr, 0, sizeof(rr));
+		memcpy(&rr, rec, sf->rec_size);
+		sf->tmono_us += rr.tdelta;
+		sf->trig_us = rr.trig_us;
+		sf->done_us = rr.done_us;
+		ns = sf->startmono.tv_nsec + (sf->tmono_us * 1000);
+		r->tstamp.tv_sec = sf->startmono.tv_sec + (ns / 1000000000);
+		r->tstamp.tv_nsec = ns % 1000000000;
+		if (sf_decode_rawrec(&rr, r)) {
+			return -1;
+		}
+	} else {
+		memcpy(r, rec, sizeof(*r));
+	}
+
+	return 1;
+}
+
+/*
+ * convert a monotonic tstamp to realtime, in nsecs since the epoch,
+ * given the realtime and monotonic clocks taken at the same moment
+ */
+ static int64_t
+realtime_ns(const struct timespec *clk, const struct timespec *mono,
+	const struct timespec *tstamp)
+{
+	return ((int64_t)clk->tv_sec * 1000000000) + clk->tv_nsec +
+		((int64_t)(tstamp->tv_sec - mono->tv_sec) * 1000000000) +
+		(tstamp->tv_nsec - mono->tv_nsec);
+}
+
+/*
+ * the wall clock time of a reading from this file, in nsecs since the epoch
+ */
+ int64_t
+sf_realtime_ns(const struct storefile *sf, const struct timespec *tstamp)
+{
+	return realtime_ns(&sf->startclk, &sf->startmono, tstamp);
+}
+
+/*
+ * position the file so the next sf_read() returns the last reading at or
+ * before wall clock time ns, or the first reading if they're all after
+ * it.  only fixed size records with their own tstamps can be searched;
+ * a raw file, whose times are deltas, or a log, whose records are split
+ * up into blocks, just starts over from the top.
+ */
+ void
+sf_seek_ns(struct storefile *sf, int64_t ns)
+{
+	struct reading r;
+	long lo, hi, mid;
+
+	sf_rewind(sf);
+	if (((sf->layout != SF_LAYOUT_READING) &&
+		(sf->layout != SF_LAYOUT_COLUMNS)) || (sf->flags & SF_FLAG_LOG)) {
+		return;
+	}
+
+	lo = 0;
+	hi = sf->nrecs;
+	while (hi - lo > 1) {
+		mid = lo + ((hi - lo) / 2);
+		if (sf->layout == SF_LAYOUT_COLUMNS) {
+			r.tstamp.tv_sec = sf->col_ns[mid] / 1000000000;
+			r.tstamp.tv_nsec = sf->col_ns[mid] % 1000000000;
+		} else {
+			memcpy(&r, sf->recs + (mid * sf->rec_size), sizeof(r));
+		}
+		if (sf_realtime_ns(sf, &r.tstamp) <= ns) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	sf->next = lo;
+}
+
+ void
+sf_summary_init(struct sf_summary *s)
+{
+	int i;
+
+	memset(s, 0, sizeof(*s));
+	memcpy(s->magic, SF_SUMMARY_MAGIC, 8);
+	s->size = sizeof(*s);
+	for (i = 0; i < SF_NFIELDS; i++) {
+		s->min[i] = FLT_MAX;
+		s->max[i] = -FLT_MAX;
+	}
+}
+
+/*
+ * add a reading taken at wall clock time ns to a summary.  readings
+ * have to be added in time order.
+ */
+ void
+sf_summary_add(struct sf_summary *s, int64_t ns, const struct reading *r)
+{
+	float v[SF_NFIELDS] = {r->watts, r->pf, r->volts, r->amps};
+	int i;
+
+	if (s->count) {
+		s->joules += (double)s->last_watts * ((ns - s->last_ns) / 1e9);
+	} else {
+		s->first_ns = ns;
+	}
+	s->last_ns = ns;
+	s->last_watts = r->watts;
+	s->count++;
+
+	for (i = 0; i < SF_NFIELDS; i++) {
+		if (v[i] < s->min[i]) {
+			s->min[i] = v[i];
+		}
+		if (v[i] > s->max[i]) {
+			s->max[i] = v[i];
+		}
+		s->sum[i] += v[i];
+	}
+}
+
+/*
+ * summarize all the readings in a storefile.  leaves the file rewound.
+ * returns the number of readings that failed conversion.
+ */
+ int
+sf_summarize(struct storefile *sf, struct sf_summary *s)
+{
+	struct reading r;
+	int nbad = 0;
+	int rc;
+
+	sf_summary_init(s);
+	sf_rewind(sf);
+	while ((rc = sf_read(sf, &r)) != 0) {
+		if (rc < 0) {
+			nbad++;
+			continue;
+		}
+		sf_summary_add(s, sf_realtime_ns(sf, &r.tstamp), &r);
+	}
+	sf_rewind(sf);
+
+	return nbad;
+}
+
+/*
+ * tack a summary footer onto the end of a storefile that doesn't have one
+ */
+ int
+sf_add_summary(const char *path, const struct sf_summary *s)
+{
+	int fd;
+	int ret;
+
+	fd = open(path, O_WRONLY | O_APPEND);
+	if (fd < 0) {
+		return errno;
+	}
+	ret = sf_write_all(fd, s, sizeof(*s));
+	if (close(fd) && (ret == 0)) {
+		ret = errno;
+	}
+
+	return ret;
+}
+
+/*
+ * start over at the first reading
+ */
+ void
+sf_rewind(struct storefile *sf)
+{
+	sf->next = 0;
+	sf->tmono_us = 0;
+	sf->pos = sf->recs;
+	sf->blk_left = 0;
+}
+
+ void
+sf_close(struct storefile *sf)
+{
+	if (sf->map) {
+		munmap((void *)sf->map, sf->size);
+		sf->map = NULL;
+	}
+	if (sf->fd >= 0) {
+		close(sf->fd);
+		sf->fd = -1;
+	}
+}
+
+
+/*
+ * write all of a buffer, even if it takes more than one write.
+ * returns 0 on success, errno on failure.
+ */
+ int
+sf_write_all(int fd, const void *buf, size_t len)
+{
+	const char *b = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, b, len);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno;
+		}
+		b += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * create a version 2 storefile and write its header.  like extech_rdr
+ * always has, refuse to write over an existing file.
+ * returns 0 on success, errno on failure.
+ */
+ static int
+create(struct sf_writer *w, const char *path, int layout, uint32_t flags,
+	const struct timespec *startclk, const struct timespec *startmono)
+{
+	int ret;
+
+	memset(w, 0, sizeof(*w));
+	memcpy(w->hdr.magic, SF_MAGIC, 8);
+	w->hdr.version = SF_VERSION;
+	w->hdr.layout = layout;
+	w->hdr.hdr_size = sizeof(struct sf_header);
+	w->hdr.rec_size = sf_layout_rec_size(layout);
+	w->hdr.flags = flags;
+	w->fd = -1;
+	if ((w->hdr.rec_size == 0) ||
+		((layout == SF_LAYOUT_COLUMNS) && (flags & SF_FLAG_LOG))) {
+		return EINVAL;
+	}
+	if (startclk) {
+		w->hdr.startclk = *startclk;
+	}
+	if (startmono) {
+		w->hdr.startmono = *startmono;
+	}
+	sf_summary_init(&w->summary);
+
+	w->fd = open(path, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (w->fd < 0) {
+		return errno;
+	}
+
+	ret = sf_write_all(w->fd, &w->hdr, sizeof(w->hdr));
+	if (ret) {
+		close(w->fd);
+		w->fd = -1;
+	}
+
+	return ret;
+}
+
+ int
+sf_create(struct sf_writer *w, const char *path, int layout,
+	const struct timespec *startclk, const struct timespec *startmono)
+{
+	return create(w, path, layout, 0, startclk, startmono);
+}
+
+/*
+ * create a log storefile: sf_append() writes each batch of records as a
+ * checksummed block, and nothing is on disk for sure until sf_log_sync().
+ * the start clocks can be filled into w->hdr any time before the first
+ * sf_append().  the file and its directory entry are synced before this
+ * returns, so a crash can't leave a log without a header.
+ */
+ int
+sf_log_create(struct sf_writer *w, const char *path, int layout)
+{
+	char dname[4096];
+	int dfd;
+	int ret;
+
+	ret = create(w, path, layout, SF_FLAG_LOG, NULL, NULL);
+	if (ret) {
+		return ret;
+	}
+	if (fsync(w->fd)) {
+		return errno;
+	}
+
+	strncpy(dname, path, sizeof(dname) - 1);
+	dname[sizeof(dname) - 1] = 0;
+	dfd = open(dirname(dname), O_RDONLY | O_DIRECTORY);
+	if (dfd >= 0) {
+		fsync(dfd);
+		close(dfd);
+	}
+	w->hdr_dirty = 1;
+
+	return 0;
+}
+
+/*
+ * group commit: get everything appended to a log since the last sync on
+ * to the disk, with the one fdatasync().  the header goes first if the
+ * start clocks or anything else in it changed.
+ */
+ int
+sf_log_sync(struct sf_writer *w)
+{
+	if (w->hdr_dirty) {
+		if (pwrite(w->fd, &w->hdr, sizeof(w->hdr), 0) < 0) {
+			return errno;
+		}
+		w->hdr_dirty = 0;
+	}
+	if (fdatasync(w->fd)) {
+		return errno;
+	}
+	return 0;
+}
+
+/*
+ * after a crash, cut a log off after its last good block, so it can get
+ * a summary footer and be like any other storefile.  a log that already
+ * has a footer was finished properly and is left alone.  the number of
+ * records left is returned in *nrecs.
+ * returns 0 on success, errno on failure.
+ */
+ int
+sf_log_recover(const char *path, long *nrecs)
+{
+	struct storefile sf;
+	off_t good;
+	int fd;
+	int ret;
+
+	ret = sf_open(&sf, path);
+	if (ret) {
+		return ret;
+	}
+	*nrecs = sf.nrecs;
+	if (!(sf.flags & SF_FLAG_LOG) || sf.has_summary) {
+		sf_close(&sf);
+		return 0;
+	}
+	good = (sf.recs - sf.map) + log_scan(sf.recs, sf.size - (sf.recs - sf.map),
+		sf.rec_size, nrecs);
+	sf_close(&sf);
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0) {
+		return errno;
+	}
+	ret = 0;
+	if (ftruncate(fd, good) || fsync(fd)) {
+		ret = errno;
+	}
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * write n records as the next block of a log, with one write, so the
+ * block is either all there or torn, never interleaved with anything
+ */
+ static int
+append_block(struct sf_writer *w, const void *recs, long n)
+{
+	struct sf_block b;
+	struct iovec iov[2];
+	size_t len;
+	ssize_t ret;
+
+	b.magic = SF_BLOCK_MAGIC;
+	b.nrecs = n;
+	b.seq = w->seq;
+	b.crc = 0;
+	b.reserved = 0;
+	len = n * w->hdr.rec_size;
+	b.crc = sf_crc32c(sf_crc32c(0, &b, sizeof(b)), recs, len);
+
+	iov[0].iov_base = &b;
+	iov[0].iov_len = sizeof(b);
+	iov[1].iov_base = (void *)recs;
+	iov[1].iov_len = len;
+	do {
+		ret = writev(w->fd, iov, 2);
+	} while ((ret < 0) && (errno == EINTR));
+	if (ret < 0) {
+		return errno;
+	}
+	if ((size_t)ret != sizeof(b) + len) {
+		/* the rest of it would have to go in more writes, so finish it */
+		if ((size_t)ret < sizeof(b)) {
+			ret = sf_write_all(w->fd, (char *)&b + ret, sizeof(b) - ret) ?:
+				sf_write_all(w->fd, recs, len);
+		} else {
+			ret = sf_write_all(w->fd, (const char *)recs + (ret - sizeof(b)),
+				len - (ret - sizeof(b)));
+		}
+		if (ret) {
+			return ret;
+		}
+	}
+	w->seq++;
+
+	return 0;
+}
+
+/*
+ * append n records, which must be in the layout the file was created with.
+ * they're added to the file's summary footer on the way by.
+ */
+ int
+sf_append(struct sf_writer *w, const void *recs, long n)
+{
+	const unsigned char *rec = recs;
+	struct sf_rawrec rr;
+	struct reading r;
+	int64_t ns;
+	long i;
+	int ret;
+
+	if (w->hdr.layout == SF_LAYOUT_COLUMNS) {
+		return EINVAL;
+	}
+	if (w->hdr.flags & SF_FLAG_LOG) {
+		ret = append_block(w, recs, n);
+	} else {
+		ret = sf_write_all(w->fd, recs, n * w->hdr.rec_size);
+	}
+	if (ret) {
+		return ret;
+	}
+	w->nrecs += n;
+
+	for (i = 0; i < n; i++, rec += w->hdr.rec_size) {
+		if (w->hdr.layout == SF_LAYOUT_RAW) {
+			memcpy(&rr, rec, sizeof(rr));
+			w->tmono_us += rr.tdelta;
+			if (sf_decode_rawrec(&rr, &r)) {
+				continue;
+			}
+			ns = realtime_ns(&w->hdr.startclk, &w->hdr.startmono,
+				&w->hdr.startmono) + (w->tmono_us * 1000);
+		} else {
+			memcpy(&r, rec, sizeof(r));
+			ns = realtime_ns(&w->hdr.startclk, &w->hdr.startmono, &r.tstamp);
+		}
+		sf_summary_add(&w->summary, ns, &r);
+	}
+
+	return 0;
+}
+
+/*
+ * write all the readings of a SF_LAYOUT_COLUMNS storefile, a column at a
+ * time.  it's all of them in one go, since where each column starts
+ * depends on how many there are.
+ */
+ int
+sf_write_columns(struct sf_writer *w, const struct columns *c)
+{
+	struct reading r;
+	long i;
+	int ret;
+
+	if ((w->hdr.layout != SF_LAYOUT_COLUMNS) || w->nrecs) {
+		return EINVAL;
+	}
+	ret = sf_write_all(w->fd, c->ns, c->n * sizeof(*c->ns));
+	for (i = 0; (i < COL_NFIELDS) && !ret; i++) {
+		ret = sf_write_all(w->fd, c->v[i], c->n * sizeof(*c->v[i]));
+	}
+	if (ret) {
+		return ret;
+	}
+	w->nrecs = c->n;
+
+	for (i = 0; i < c->n; i++) {
+		col_get(c, i, &r);
+		sf_summary_add(&w->summary,
+			realtime_ns(&w->hdr.startclk, &w->hdr.startmono, &r.tstamp), &r);
+	}
+
+	return 0;
+}
+
+/*
+ * write the summary footer, fill in the record count in the header and
+ * close the file.  anything else filled into w->hdr since sf_create()
+ * (the flags, say) goes out with it.  if the file isn't seekable (a fifo,
+ * say) the header is left as sf_create() wrote it, with a count of 0,
+ * which readers take to mean "read to EOF".
+ */
+ int
+sf_finish(struct sf_writer *w)
+{
+	int ret = 0;
+
+	if (w->fd < 0) {
+		return EBADF;
+	}
+	ret = sf_write_all(w->fd, &w->summary, sizeof(w->summary));
+	w->hdr.nrecs = w->nrecs;
+	if (pwrite(w->fd, &w->hdr, sizeof(w->hdr), 0) < 0) {
+		if ((errno != ESPIPE) && (ret == 0)) {
+			ret = errno;
+		}
+	}
+	if ((w->hdr.flags & SF_FLAG_LOG) && fdatasync(w->fd) && (ret == 0)) {
+		ret = errno;
+	}
+	if (close(w->fd)) {
+		ret = errno;
+	}
+	w->fd = -1;
+
+	return ret;
+}
+
+/*
+ * parse a time from a command line into nsecs since the epoch: local
+ * 'YYYY-MM-DD HH:MM:SS[.fff]' or seconds since the epoch.
+ * returns 0 on success.
+ */
+ int
+sf_parse_time(const char *s, int64_t *ns)
+{
+	struct tm tm;
+	char *end;
+	double secs;
+	double frac = 0.0;
+
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(s, "%Y-%m-%d %H:%M:%S", &tm);
+	if (end == NULL) {
+		end = strptime(s, "%Y-%m-%dT%H:%M:%S", &tm);
+	}
+	if (end) {
+		if (*end == '.') {
+			frac = strtod(end, &end);
+		}
+		if (*end) {
+			return -1;
+		}
+		tm.tm_isdst = -1;
+		*ns = ((int64_t)mktime(&tm) * 1000000000) + (int64_t)(frac * 1e9);
+		return 0;
+	}
+
+	secs = strtod(s, &end);
+	if ((end == s) || *end) {
+		return -1;
+	}
+	*ns = (int64_t)(secs * 1e9);
+
+	return 0;
+}
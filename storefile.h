@@ -0,0 +1,205 @@
+/*
+ * Copyright 2017-2019, Low Power Company, Inc.
+ * Copyright 2017-2019, Andrew Sharp
+ *
+ * Readings storefile formats
+ *
+ * A version 1 storefile is what extech_rdr has always written: the
+ * CLOCK_REALTIME value at the first reading (a struct timespec) followed
+ * by an array of struct reading.  Files from before extech_rdr took that
+ * from a matched pair of clock readings have CLOCK_REALTIME_COARSE taken
+ * some time after the first reading instead.  It has no magic number, so
+ * anything that doesn't start with SF_MAGIC is taken to be version 1.
+ *
+ * A version 2 storefile starts with a struct sf_header, which says how
+ * the records following it are laid out.
+ *
+ * Either version can end with a struct sf_summary footer, which lets a
+ * program decide whether it needs to look at the readings at all.
+ * Version 2 files always get one; readings-query --index adds them to
+ * files that don't have one.
+ */
+#ifndef _STOREFILE_H
+#define _STOREFILE_H
+
+#include <stdint.h>
+#include <time.h>
+#include "extech.h"
+#include "columns.h"
+
+#define SF_MAGIC "EXTECHSF"
+#define SF_VERSION 2
+
+/*
+ * record layouts of a version 2 storefile
+ */
+#define SF_LAYOUT_READING	0	/* struct reading per sample, like v1 */
+#define SF_LAYOUT_RAW		1	/* struct sf_rawrec per sample */
+#define SF_LAYOUT_COLUMNS	2	/* columns, see below */
+
+struct sf_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t layout;
+	uint32_t hdr_size;	/* offset of the first record */
+	uint32_t rec_size;
+	uint64_t nrecs;		/* 0 means "however many fit before EOF" */
+	struct timespec startclk;	/* CLOCK_REALTIME at the first reading */
+	struct timespec startmono;	/* the first reading's CLOCK_MONOTONIC tstamp */
+	uint32_t flags;
+	uint32_t period_us;	/* SF_FLAG_DEADBAND: sampling period, 0 if it varied */
+	uint32_t reserved[6];
+};
+
+/*
+ * a deadband storefile only has the readings where something changed by
+ * more than a tolerance, plus a keyframe now and then, plus the last one.
+ * each reading holds until the next, same as the energy integral has
+ * always assumed, so the readings in between are the one before them.
+ */
+#define SF_FLAG_DEADBAND	0x1
+
+/*
+ * a log storefile is written a block at a time while the readings come
+ * in, each block a struct sf_block and then its records, with a CRC32C
+ * over both.  a block either made it to disk whole or it didn't: readers
+ * stop at the first block that doesn't check out, and sf_log_recover()
+ * cuts it and everything after it off.
+ */
+#define SF_FLAG_LOG			0x2
+#define SF_BLOCK_MAGIC		0x4b425845	/* "EXBK" */
+
+struct sf_block {
+	uint32_t magic;
+	uint32_t nrecs;
+	uint64_t seq;		/* 0 for the first block, and so on */
+	uint32_t crc;		/* CRC32C of the block, with this field 0 */
+	uint32_t reserved;
+};
+
+/*
+ * a sample as the meter sent it: the four encoded value words, in wire
+ * order (watts, amps, volts, pf), and the number of usecs since the
+ * previous record (since startmono for the first one).  they get
+ * decoded when the file is read, so a fixed decoder fixes old runs too.
+ *
+ * the record's time is when the meter is estimated to have taken the
+ * reading; trig_us is how long before that the trigger was written and
+ * done_us how long after it the whole reading had been read, 65535 if
+ * that long or longer.  files from before these were kept have 12 byte
+ * records, which read back with them 0.
+ */
+struct sf_rawrec {
+	uint16_t word[4];
+	uint32_t tdelta;
+	uint16_t trig_us;
+	uint16_t done_us;
+};
+
+#define SF_RAWREC_OLD_SIZE 12
+
+/*
+ * a columns storefile has all nrecs tstamps first, as int64_t nsecs of
+ * CLOCK_MONOTONIC, then all the watts, all the pf, all the volts and all
+ * the amps, as floats.  rec_size is what a reading takes over all the
+ * columns.  nrecs has to be known up front, so it can't be a log.
+ */
+#define SF_COLUMNS_REC_SIZE	(sizeof(int64_t) + (SF_NFIELDS * sizeof(float)))
+
+#define SF_WORD_WATTS	0
+#define SF_WORD_AMPS	1
+#define SF_WORD_VOLTS	2
+#define SF_WORD_PF		3
+
+/*
+ * the summary footer, the last thing in the file.  the energy integral
+ * holds each reading's watts until the next reading, so the last reading
+ * adds nothing; last_watts is kept so the integral can be carried on.
+ * min/max/sum are in struct reading order: watts, pf, volts, amps.
+ */
+#define SF_SUMMARY_MAGIC "EXTECHZM"
+#define SF_NFIELDS 4
+
+struct sf_summary {
+	char magic[8];
+	uint32_t size;		/* sizeof(struct sf_summary) */
+	float last_watts;
+	uint64_t count;		/* number of readings summarized */
+	int64_t first_ns;	/* wall clock time of the first and last readings */
+	int64_t last_ns;
+	float min[SF_NFIELDS];
+	float max[SF_NFIELDS];
+	double sum[SF_NFIELDS];
+	double joules;
+};
+
+/*
+ * an open storefile, for reading
+ */
+struct storefile {
+	int fd;
+	int version;
+	int layout;
+	const unsigned char *map;
+	size_t size;
+	const unsigned char *recs;	/* first record */
+	size_t rec_size;
+	long nrecs;
+	struct timespec startclk;
+	struct timespec startmono;	/* v1: tstamp of the first reading */
+	uint32_t flags;
+	uint32_t period_us;
+	int has_summary;
+	struct sf_summary summary;
+
+	/* sf_read() state */
+	long next;
+	uint64_t tmono_us;	/* SF_LAYOUT_RAW: usecs since startmono */
+	const unsigned char *pos;	/* SF_FLAG_LOG: next record or block */
+	uint32_t blk_left;	/* SF_FLAG_LOG: records left in this block */
+	uint16_t trig_us;	/* SF_LAYOUT_RAW: the last record's timing */
+	uint16_t done_us;
+	const int64_t *col_ns;	/* SF_LAYOUT_COLUMNS: the columns */
+	const float *col[SF_NFIELDS];
+};
+
+/*
+ * a storefile being written
+ */
+struct sf_writer {
+	int fd;
+	long nrecs;
+	uint64_t tmono_us;	/* SF_LAYOUT_RAW: usecs since startmono */
+	uint64_t seq;		/* SF_FLAG_LOG: of the next block */
+	int hdr_dirty;		/* SF_FLAG_LOG: hdr changed since it was written */
+	struct sf_header hdr;
+	struct sf_summary summary;
+};
+
+extern int sf_open(struct storefile *sf, const char *path);
+extern int sf_read(struct storefile *sf, struct reading *r);
+extern void sf_rewind(struct storefile *sf);
+extern void sf_close(struct storefile *sf);
+extern int64_t sf_realtime_ns(const struct storefile *sf,
+	const struct timespec *tstamp);
+extern int sf_decode_rawrec(const struct sf_rawrec *rr, struct reading *r);
+extern void sf_seek_ns(struct storefile *sf, int64_t ns);
+extern void sf_summary_init(struct sf_summary *s);
+extern void sf_summary_add(struct sf_summary *s, int64_t ns,
+	const struct reading *r);
+extern int sf_summarize(struct storefile *sf, struct sf_summary *s);
+extern int sf_add_summary(const char *path, const struct sf_summary *s);
+
+extern int sf_create(struct sf_writer *w, const char *path, int layout,
+	const struct timespec *startclk, const struct timespec *startmono);
+extern int sf_append(struct sf_writer *w, const void *recs, long n);
+extern int sf_write_columns(struct sf_writer *w, const struct columns *c);
+extern int sf_finish(struct sf_writer *w);
+extern int sf_log_create(struct sf_writer *w, const char *path, int layout);
+extern int sf_log_sync(struct sf_writer *w);
+extern int sf_log_recover(const char *path, long *nrecs);
+extern uint32_t sf_crc32c(uint32_t crc, const void *buf, size_t len);
+extern int sf_write_all(int fd, const void *buf, size_t len);
+extern int sf_parse_time(const char *s, int64_t *ns);
+
+#endif